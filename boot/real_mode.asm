@@ -1,6 +1,8 @@
 %include "rm_print.asm"
 
-KERNEL_OFFSET equ 0x500 ; PA where kernel will be loaded
+KERNEL_OFFSET equ 0x10000 ; PA where kernel will be loaded (above the boot sector)
+KERNEL_SEG equ KERNEL_OFFSET >> 4
+SECTORS_PER_READ equ 64 ; 32 KiB per BIOS call, so a read never crosses a 64 KiB segment
 CODE_SEG_SEL equ gdt_code_seg_desc - gdt_start ; Define offsets (indexes) into GDT that will be used when setting segment registers
 DATA_SEG_SEL equ gdt_data_seg_desc - gdt_start ; 0x0 -> NULL; 0x08 -> CODE; 0x10 -> DATA
 
@@ -10,24 +12,36 @@ start_rm:
 	call rm_print
 
 load_kernel:
-	;    Load kernel into RAM from boot drive
+	;    Load kernel into RAM from boot drive. KERNEL_SECTORS is passed in by the Makefile.
+	;    The BIOS extended read function (LBA addressing) is used in chunks of SECTORS_PER_READ,
+	;    advancing the destination segment after each chunk.
 	mov  bx, msg_load
 	call rm_print
-	mov  bx, KERNEL_OFFSET; Where in RAM to load
-	mov  dh, 40; Number of sectors to load (512B each)
-	mov  dl, [boot_drive]; Location of boot drive
+	mov  cx, KERNEL_SECTORS; Number of sectors left to load (512B each)
+
+load_kernel_loop:
+	mov  ax, cx
+	cmp  ax, SECTORS_PER_READ
+	jbe  load_kernel_chunk
+	mov  ax, SECTORS_PER_READ
 
-	push dx
-	mov  ah, 0x02; Select BIOS read sector function
-	mov  al, dh; Number of sectors to read
-	mov  ch, 0x00; Read from cylinder 0
-	mov  dh, 0x00; Read from head 0
-	mov  cl, 0x02; Read from the second sector (first sector is the boot sector)
+load_kernel_chunk:
+	mov  [dap_count], ax
+	sub  cx, ax
+	push cx
+	push ax
+	mov  si, dap; Disk address packet describing the read
+	mov  ah, 0x42; Select BIOS extended read function
+	mov  dl, [boot_drive]; Location of boot drive
 	int  0x13; BIOS interrupt for disk access
 	jc   disk_err; A set carry flag indicates error
-	pop  dx
-	cmp  dh, al; al stores number of sectors read
-	jne  disk_err
+	pop  ax
+	pop  cx
+	add  [dap_lba], ax; Continue from the next sector
+	shl  ax, 5; Sectors * 512 / 16 = segment increment
+	add  [dap_segment], ax
+	test cx, cx
+	jnz  load_kernel_loop
 
 prepare_pm:
 	;    Disable interrupts (current setup won't work in PM) and load GDT
@@ -45,6 +59,21 @@ msg_disk_err: db 'Disk read error!',0
 msg_rm: db 'Starting in 16-bit Real Mode. ',0
 boot_drive: db 0
 
+dap:
+	db 0x10; Size of the disk address packet
+	db 0x0
+
+dap_count:
+	dw 0x0; Number of sectors to read
+	dw 0x0; Destination offset
+
+dap_segment:
+	dw KERNEL_SEG; Destination segment
+
+dap_lba:
+	dd 0x1; First sector to read (the sector after the boot sector)
+	dd 0x0
+
 gdt_start:
 	; Check Intel developer manual for GDT descriptor/entry structures.
 	; Segment registers will be set to cover the entire addressable memory space (paging will be used).
@@ -0,0 +1,375 @@
+/*
+
+CPU and interrupt controller discovery
+
+The firmware describes the processors and interrupt controllers it found in one
+of two tables:
+- ACPI: the Root System Description Pointer (RSDP) points to the Root System
+  Description Table (RSDT), which lists all other tables. The Multiple APIC
+  Description Table (MADT, signature "APIC") has an entry for every local
+  APIC, i.e. every CPU, and every I/O APIC. ISA IRQs are wired to the I/O APIC
+  input of the same number, unless an interrupt source override says otherwise
+  (the PIT is usually moved to input 2).
+- The older Intel MultiProcessor Specification: the MP floating pointer
+  structure ("_MP_") points to the MP configuration table ("PCMP"), which has
+  a processor entry for every CPU, and an entry for every I/O APIC and every
+  interrupt wired to one.
+
+Both anchors are found by scanning for their signature on 16-byte boundaries
+in the first KiB of the Extended BIOS Data Area (EBDA) and in the BIOS ROM.
+Low memory is mapped at 0xC0000000, the tables themselves can live anywhere
+in RAM and are mapped through the MMIO window.
+
+*/
+
+#include "include/acpi.h"
+#include "include/memory.h"
+#include "include/vmm.h"
+#include <stddef.h>
+
+#define LOW_MEM_BASE 0xC0000000 // Physical 0-1MiB is mapped here
+#define EBDA_SEG_PTR 0x40E      // BIOS data area word holding the EBDA segment
+#define BASE_MEM_END 0xA0000
+#define BIOS_ROM_START 0xE0000
+#define BIOS_ROM_END 0x100000
+
+#define LAPIC_DEFAULT_PA 0xFEE00000
+
+Platform platform;
+
+typedef struct {
+  char signature[8]; // "RSD PTR "
+  uint8_t checksum;
+  char oem_id[6];
+  uint8_t revision;
+  uint32_t rsdt_pa;
+} __attribute__((packed)) Rsdp;
+
+/* Header shared by all ACPI tables */
+typedef struct {
+  char signature[4];
+  uint32_t length; // Including the header
+  uint8_t revision;
+  uint8_t checksum;
+  char oem_id[6];
+  char oem_table_id[8];
+  uint32_t oem_revision;
+  uint32_t creator_id;
+  uint32_t creator_revision;
+} __attribute__((packed)) AcpiHeader;
+
+typedef struct {
+  AcpiHeader header;
+  uint32_t lapic_pa;
+  uint32_t flags;
+} __attribute__((packed)) Madt; // Followed by variable-sized entries
+
+#define MADT_LAPIC 0
+#define MADT_IOAPIC 1
+#define MADT_OVERRIDE 2
+#define MADT_LAPIC_ENABLED 0x1
+
+typedef struct {
+  uint8_t type;
+  uint8_t length;
+} __attribute__((packed)) MadtEntry;
+
+typedef struct {
+  MadtEntry entry;
+  uint8_t acpi_cpu_id;
+  uint8_t apic_id;
+  uint32_t flags;
+} __attribute__((packed)) MadtLapic;
+
+typedef struct {
+  MadtEntry entry;
+  uint8_t ioapic_id;
+  uint8_t reserved;
+  uint32_t ioapic_pa;
+  uint32_t gsi_base;
+} __attribute__((packed)) MadtIoapic;
+
+/* An ISA IRQ that is not wired to the I/O APIC input of the same number */
+typedef struct {
+  MadtEntry entry;
+  uint8_t bus; // 0: ISA
+  uint8_t irq;
+  uint32_t gsi;
+  uint16_t flags; // INTI_*
+} __attribute__((packed)) MadtOverride;
+
+typedef struct {
+  char signature[4]; // "_MP_"
+  uint32_t config_pa;
+  uint8_t length; // In 16-byte units
+  uint8_t spec_rev;
+  uint8_t checksum;
+  uint8_t features[5]; // features[1] bit 7: the IMCR is present
+} __attribute__((packed)) MpFloatingPointer;
+
+#define MP_IMCR_PRESENT 0x80
+
+typedef struct {
+  char signature[4]; // "PCMP"
+  uint16_t length;
+  uint8_t spec_rev;
+  uint8_t checksum;
+  char oem_id[8];
+  char product_id[12];
+  uint32_t oem_table_pa;
+  uint16_t oem_table_size;
+  uint16_t no_entries;
+  uint32_t lapic_pa;
+  uint16_t ext_length;
+  uint8_t ext_checksum;
+  uint8_t reserved;
+} __attribute__((packed)) MpConfig; // Followed by entries
+
+#define MP_PROCESSOR 0 // 20 bytes, every other entry type is 8 bytes
+#define MP_BUS 1
+#define MP_IOAPIC 2
+#define MP_IO_INTERRUPT 3
+#define MP_PROCESSOR_ENABLED 0x1
+#define MP_IOAPIC_ENABLED 0x1
+#define MP_INT 0 // Vectored interrupt, as opposed to NMI, SMI or ExtINT
+#define MP_ALL_IOAPICS 0xFF
+
+typedef struct {
+  uint8_t type;
+  uint8_t apic_id;
+  uint8_t apic_version;
+  uint8_t flags;
+  uint32_t signature;
+  uint32_t features;
+  uint32_t reserved[2];
+} __attribute__((packed)) MpProcessor;
+
+typedef struct {
+  uint8_t type;
+  uint8_t bus_id;
+  char bus_type[6]; // e.g. "ISA   ", "PCI   "
+} __attribute__((packed)) MpBus;
+
+typedef struct {
+  uint8_t type;
+  uint8_t ioapic_id;
+  uint8_t version;
+  uint8_t flags;
+  uint32_t ioapic_pa;
+} __attribute__((packed)) MpIoapic;
+
+typedef struct {
+  uint8_t type;
+  uint8_t int_type;
+  uint16_t flags; // INTI_*
+  uint8_t src_bus;
+  uint8_t src_irq;
+  uint8_t dst_ioapic_id;
+  uint8_t dst_input;
+} __attribute__((packed)) MpIoInterrupt;
+
+static void add_cpu(uint8_t apic_id) {
+  if (platform.no_cpus < MAX_CPUS) {
+    platform.apic_ids[platform.no_cpus++] = apic_id;
+  }
+}
+
+/* Wire each ISA IRQ to the I/O APIC input of the same number */
+static void reset_interrupts() {
+  platform.ioapic_pa = 0;
+  platform.ioapic_gsi_base = 0;
+  platform.imcr = 0;
+  for (int i = 0; i < NO_ISA_IRQS; i++) {
+    platform.isa_gsi[i] = i;
+    platform.isa_flags[i] = 0;
+  }
+}
+
+/* All bytes of a table sum to 0 */
+static int checksum_ok(uint8_t *table, uint32_t no_bytes) {
+  uint8_t sum = 0;
+  for (uint32_t i = 0; i < no_bytes; i++) {
+    sum += table[i];
+  }
+  return sum == 0;
+}
+
+/* Find a 16-byte aligned signature in physical low memory [start, end) */
+static void *scan(const char *signature, uint32_t len, uintptr_t start,
+                  uintptr_t end) {
+  for (uintptr_t pa = start; pa + len <= end; pa += 16) {
+    uint8_t *va = (uint8_t *)(LOW_MEM_BASE + pa);
+    if (mem_cmp(va, (const uint8_t *)signature, len) == 0) {
+      return va;
+    }
+  }
+  return NULL;
+}
+
+static void *find_anchor(const char *signature, uint32_t len) {
+  uintptr_t ebda = *(uint16_t *)(LOW_MEM_BASE + EBDA_SEG_PTR) << 4;
+  void *anchor = NULL;
+  if (ebda != 0) {
+    anchor = scan(signature, len, ebda, ebda + 1024);
+  }
+  if (anchor == NULL) {
+    anchor = scan(signature, len, BASE_MEM_END - 1024, BASE_MEM_END);
+  }
+  if (anchor == NULL) {
+    anchor = scan(signature, len, BIOS_ROM_START, BIOS_ROM_END);
+  }
+  return anchor;
+}
+
+/* Map a whole ACPI table, whose length is only known from its header */
+static AcpiHeader *map_table(uintptr_t pa) {
+  AcpiHeader *header = (AcpiHeader *)map_mmio(pa, sizeof(AcpiHeader));
+  if (header == NULL) {
+    return NULL;
+  }
+  header = (AcpiHeader *)map_mmio(pa, header->length);
+  if (header == NULL || !checksum_ok((uint8_t *)header, header->length)) {
+    return NULL;
+  }
+  return header;
+}
+
+/*
+
+ACPI
+
+*/
+
+static int parse_madt(Madt *madt) {
+  platform.lapic_pa = madt->lapic_pa;
+  uintptr_t entry = (uintptr_t)madt + sizeof(Madt);
+  uintptr_t end = (uintptr_t)madt + madt->header.length;
+  while (entry + sizeof(MadtEntry) <= end) {
+    MadtEntry *e = (MadtEntry *)entry;
+    if (e->length == 0) {
+      break;
+    }
+    if (e->type == MADT_LAPIC &&
+        (((MadtLapic *)e)->flags & MADT_LAPIC_ENABLED)) {
+      add_cpu(((MadtLapic *)e)->apic_id);
+    } else if (e->type == MADT_IOAPIC) {
+      MadtIoapic *ioapic = (MadtIoapic *)e; // The ISA IRQs go to GSI 0-15
+      if (platform.ioapic_pa == 0 || ioapic->gsi_base == 0) {
+        platform.ioapic_pa = ioapic->ioapic_pa;
+        platform.ioapic_id = ioapic->ioapic_id;
+        platform.ioapic_gsi_base = ioapic->gsi_base;
+      }
+    } else if (e->type == MADT_OVERRIDE) {
+      MadtOverride *override = (MadtOverride *)e;
+      if (override->bus == 0 && override->irq < NO_ISA_IRQS) {
+        platform.isa_gsi[override->irq] = override->gsi;
+        platform.isa_flags[override->irq] = override->flags;
+      }
+    }
+    entry += e->length;
+  }
+  return platform.no_cpus != 0;
+}
+
+static int acpi_find_madt() {
+  Rsdp *rsdp = find_anchor("RSD PTR ", 8);
+  if (rsdp == NULL || !checksum_ok((uint8_t *)rsdp, sizeof(Rsdp))) {
+    return 0;
+  }
+
+  AcpiHeader *rsdt = map_table(rsdp->rsdt_pa);
+  if (rsdt == NULL) {
+    return 0;
+  }
+  uint32_t *table_pas = (uint32_t *)((uintptr_t)rsdt + sizeof(AcpiHeader));
+  uint32_t no_tables = (rsdt->length - sizeof(AcpiHeader)) / 4;
+  for (uint32_t i = 0; i < no_tables; i++) {
+    AcpiHeader *table = map_table(table_pas[i]);
+    if (table != NULL &&
+        mem_cmp((uint8_t *)table->signature, (const uint8_t *)"APIC", 4) ==
+            0) {
+      return parse_madt((Madt *)table);
+    }
+  }
+  return 0;
+}
+
+/*
+
+MP tables
+
+*/
+
+static int mp_find_cpus() {
+  MpFloatingPointer *mpfp = find_anchor("_MP_", 4);
+  if (mpfp == NULL || mpfp->config_pa == 0 ||
+      !checksum_ok((uint8_t *)mpfp, mpfp->length * 16)) {
+    return 0;
+  }
+
+  MpConfig *config = (MpConfig *)map_mmio(mpfp->config_pa, sizeof(MpConfig));
+  if (config == NULL) {
+    return 0;
+  }
+  config = (MpConfig *)map_mmio(mpfp->config_pa, config->length);
+  if (config == NULL || !checksum_ok((uint8_t *)config, config->length)) {
+    return 0;
+  }
+
+  platform.lapic_pa = config->lapic_pa;
+  platform.imcr = (mpfp->features[1] & MP_IMCR_PRESENT) != 0;
+  int isa_bus = -1;
+  uintptr_t entry = (uintptr_t)config + sizeof(MpConfig);
+  for (int i = 0; i < config->no_entries; i++) {
+    uint8_t type = *(uint8_t *)entry;
+    if (type == MP_PROCESSOR) {
+      MpProcessor *cpu = (MpProcessor *)entry;
+      if (cpu->flags & MP_PROCESSOR_ENABLED) {
+        add_cpu(cpu->apic_id);
+      }
+      entry += sizeof(MpProcessor);
+      continue;
+    }
+    if (type == MP_BUS) {
+      MpBus *bus = (MpBus *)entry;
+      if (mem_cmp((uint8_t *)bus->bus_type, (const uint8_t *)"ISA", 3) == 0) {
+        isa_bus = bus->bus_id;
+      }
+    } else if (type == MP_IOAPIC) {
+      MpIoapic *ioapic = (MpIoapic *)entry;
+      if ((ioapic->flags & MP_IOAPIC_ENABLED) && platform.ioapic_pa == 0) {
+        platform.ioapic_pa = ioapic->ioapic_pa;
+        platform.ioapic_id = ioapic->ioapic_id;
+      }
+    } else if (type == MP_IO_INTERRUPT) {
+      /* Buses and I/O APICs come first, the inputs count from GSI 0 */
+      MpIoInterrupt *irq = (MpIoInterrupt *)entry;
+      if (irq->int_type == MP_INT && irq->src_bus == isa_bus &&
+          irq->src_irq < NO_ISA_IRQS && platform.ioapic_pa != 0 &&
+          (irq->dst_ioapic_id == platform.ioapic_id ||
+           irq->dst_ioapic_id == MP_ALL_IOAPICS)) {
+        platform.isa_gsi[irq->src_irq] = irq->dst_input;
+        platform.isa_flags[irq->src_irq] = irq->flags;
+      }
+    }
+    entry += 8;
+  }
+  return platform.no_cpus != 0;
+}
+
+/*
+Fill in platform from the MADT, or the MP configuration table if there is no
+MADT. Return 0 if neither was found, the machine is then treated as having a
+single CPU and only the PIC.
+*/
+int acpi_init() {
+  platform.no_cpus = 0;
+  platform.lapic_pa = LAPIC_DEFAULT_PA;
+  reset_interrupts();
+  if (acpi_find_madt()) {
+    return 1;
+  }
+  platform.no_cpus = 0;
+  reset_interrupts();
+  return mp_find_cpus();
+}
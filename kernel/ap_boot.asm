@@ -0,0 +1,72 @@
+	;----------------------
+
+	; Startup code of the application processors (APs), see smp.c.
+	; A STARTUP IPI starts an AP in real mode at CS:IP = (AP_BOOT_PA >> 4):0, so the
+	; BSP copies everything between ap_boot_start and ap_boot_end to AP_BOOT_PA
+	; first. The code therefore only addresses itself relative to ap_boot_start.
+	; The BSP also fills in the stack and CPU index of the AP, and identity maps low
+	; memory so execution can continue here right after paging is enabled.
+
+	;----------------------
+
+AP_BOOT_PA equ 0x70000
+PD_PA equ 0x7E000
+CODE_SEG_SEL equ 0x08
+DATA_SEG_SEL equ 0x10
+
+%define REL(label) (label - ap_boot_start)
+%define PA(label) (AP_BOOT_PA + (label - ap_boot_start))
+
+global ap_boot_start
+global ap_boot_end
+global ap_boot_stack
+global ap_boot_cpu
+
+extern ap_main
+
+[bits 16]
+
+ap_boot_start:
+	cli
+	mov  ax, cs
+	mov  ds, ax
+	lgdt [REL(ap_boot_gdt_descriptor)]
+	mov  eax, cr0
+	or   eax, 1; Protected mode
+	mov  cr0, eax
+	jmp  dword CODE_SEG_SEL:PA(ap_boot_pm)
+
+[bits 32]
+
+ap_boot_pm:
+	mov ax, DATA_SEG_SEL
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+	mov fs, ax
+	mov gs, ax
+	mov eax, PD_PA
+	mov cr3, eax
+	mov eax, cr0
+	or  eax, 0x80000000; Paging
+	mov cr0, eax
+	mov esp, [PA(ap_boot_stack)]
+	push dword [PA(ap_boot_cpu)]
+	mov  eax, ap_main; Higher-half address of the kernel
+	call eax
+	jmp  $
+
+align 8
+ap_boot_gdt:
+	dq 0x0000000000000000; Null
+	dq 0x00CF9A000000FFFF; Code: base 0, limit 4GiB, ring 0, executable
+	dq 0x00CF92000000FFFF; Data: base 0, limit 4GiB, ring 0, writable
+
+ap_boot_gdt_descriptor:
+	dw ap_boot_gdt_descriptor - ap_boot_gdt - 1
+	dd PA(ap_boot_gdt)
+
+ap_boot_stack: dd 0; VA of the top of the AP's stack
+ap_boot_cpu: dd 0; Index of the AP in cpus
+
+ap_boot_end:
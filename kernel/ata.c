@@ -0,0 +1,582 @@
+/*
+
+ATA disks
+
+A driver for the parallel ATA (IDE) disks behind the PCI IDE controller, as
+QEMU emulates it (PIIX). Each of its two channels has a command block of I/O
+ports, an IRQ (14 and 15 in compatibility mode) and up to two drives, master
+and slave, only one of which runs a command at a time.
+
+- Drives are found with IDENTIFY at boot. Requests use 28-bit LBAs, 48-bit
+  ones past the first 128 GiB of a drive that has them, and move up to
+  ATA_MAX_SECTORS per command: longer requests are split.
+- With bus-master DMA the controller moves the data itself. It follows a
+  table of physical region descriptors (PRDs), one per physically contiguous
+  piece of the buffer (heap pages need not be contiguous), and the drive
+  raises its IRQ once the whole transfer is done.
+- PIO is the fallback: without a bus-master controller, for drives without
+  DMA, for buffers at odd addresses, or after ata_set_dma(0). The CPU moves
+  each sector through the data port, and the drive raises its IRQ per sector.
+- Either way the requesting thread sleeps until the IRQ, whose handler wakes
+  it through a semaphore. The mutex of a channel serializes the requests to
+  its drives, so requests must come from threads.
+- Each drive counts its requests, sectors and errors, and the time from a
+  request to its completion (print_ata_stats()).
+
+*/
+
+#include "include/ata.h"
+#include "include/io.h"
+#include "include/irq.h"
+#include "include/pci.h"
+#include "include/pmm.h"
+#include "include/screen.h"
+#include "include/sync.h"
+#include "include/timer.h"
+#include "include/vmm.h"
+#include <stddef.h>
+
+#define PAGE_SIZE 4096
+
+#define PRIMARY_BASE 0x1F0
+#define PRIMARY_CTRL 0x3F6
+#define PRIMARY_IRQ 14
+#define SECONDARY_BASE 0x170
+#define SECONDARY_CTRL 0x376
+#define SECONDARY_IRQ 15
+
+/* Command block registers, from the base of a channel */
+#define REG_DATA 0
+#define REG_COUNT 2
+#define REG_LBA0 3
+#define REG_LBA1 4
+#define REG_LBA2 5
+#define REG_DRIVE 6
+#define REG_STATUS 7 // Reading it acknowledges the IRQ
+#define REG_COMMAND 7
+
+/*
+The control register reads as the alternate status, which does not
+acknowledge the IRQ, and is written as the device control
+*/
+#define CTRL_NIEN 0x02 // Keep the IRQ line quiet
+
+#define STATUS_ERR 0x01
+#define STATUS_DRQ 0x08 // Data may be moved through the data port
+#define STATUS_DF 0x20  // Device fault
+#define STATUS_BSY 0x80
+
+#define DRIVE_LBA 0xE0   // LBA addressing, with bits 24-27 of a 28-bit LBA
+#define DRIVE_LBA48 0x40 // LBA addressing, the LBA is in the other registers
+#define DRIVE_SLAVE 0x10
+#define LBA28_LIMIT 0x10000000
+
+#define CMD_READ_PIO 0x20
+#define CMD_READ_PIO_EXT 0x24
+#define CMD_READ_DMA 0xC8
+#define CMD_READ_DMA_EXT 0x25
+#define CMD_WRITE_PIO 0x30
+#define CMD_WRITE_PIO_EXT 0x34
+#define CMD_WRITE_DMA 0xCA
+#define CMD_WRITE_DMA_EXT 0x35
+#define CMD_IDENTIFY 0xEC
+
+/* Words of the IDENTIFY data */
+#define ID_MODEL 27 // 40 characters, two per word, high byte first
+#define ID_CAPS 49
+#define ID_CAPS_DMA 0x100
+#define ID_SECTORS 60 // 28-bit sector count, low word first
+#define ID_FEATURES 83
+#define ID_FEATURES_LBA48 0x400
+#define ID_SECTORS_EXT 100 // 48-bit sector count, low word first
+
+/* PCI IDE controller */
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+#define PROG_IF_NATIVE(channel) (1 << (channel) * 2) // Not on legacy ports
+#define PROG_IF_BUS_MASTER 0x80
+#define BM_BAR 4
+#define BM_CHANNEL_OFFSET 8 // The secondary channel's registers
+
+/* Bus master registers, from the channel's base */
+#define BM_COMMAND 0
+#define BM_STATUS 2
+#define BM_PRDT 4
+#define BM_CMD_START 0x01
+#define BM_CMD_TO_MEMORY 0x08 // Reads from the drive
+#define BM_STATUS_ERR 0x02    // Both are cleared by writing 1
+#define BM_STATUS_IRQ 0x04    // ^
+
+#define PRD_EOT 0x8000 // Last entry of the table
+#define MAX_PRDS (ATA_MAX_SECTORS * ATA_SECTOR_SIZE / PAGE_SIZE + 1)
+
+#define BSY_TIMEOUT_US 1000000
+
+/* Physical region descriptor, a piece of a DMA transfer */
+typedef struct {
+  uint32_t pa;
+  uint16_t no_bytes;
+  uint16_t flags;
+} __attribute__((packed)) Prd;
+
+typedef struct {
+  uint16_t base;
+  uint16_t ctrl;
+  uint16_t bm; // Bus master registers, 0 without DMA
+  int irq;
+  Prd *prdt; // Must not cross a 64 KiB boundary, a page does not
+  uintptr_t prdt_pa;
+  Mutex lock;                 // Held for a whole request
+  Semaphore done;             // Upped by the IRQ handler
+  volatile int busy;          // A command runs, its IRQ is expected
+  volatile uint8_t status;    // Read by the IRQ handler
+  volatile uint8_t bm_status; // ^
+} AtaChannel;
+
+typedef struct {
+  AtaChannel *channel;
+  uint8_t slave;
+  uint8_t lba48;
+  uint8_t dma;
+  uint64_t sectors;
+  char model[41];
+  AtaStats stats; // Under the channel's lock
+} AtaDrive;
+
+static AtaChannel channels[2];
+static AtaDrive drives[ATA_MAX_DRIVES];
+static uint32_t no_drives;
+static int dma_enabled = 1;
+
+/*
+
+Registers
+
+*/
+
+/* Give the drive 400ns to put its status up, by reading the alternate status */
+static void ata_delay(AtaChannel *channel) {
+  for (int i = 0; i < 4; i++) {
+    port_byte_in(channel->ctrl);
+  }
+}
+
+/* Wait until the channel is not busy. Return its status, or -1 on a timeout. */
+static int wait_not_busy(AtaChannel *channel) {
+  uint64_t end = clock_monotonic() + (uint64_t)BSY_TIMEOUT_US * 1000;
+  uint8_t status;
+  while ((status = port_byte_in(channel->ctrl)) & STATUS_BSY) {
+    if (clock_monotonic() > end) {
+      return -1;
+    }
+    __asm__ __volatile__("pause");
+  }
+  return status;
+}
+
+/* Select drive and start command on count sectors at lba */
+static void issue(AtaDrive *drive, uint64_t lba, uint32_t count,
+                  uint8_t command, int ext) {
+  AtaChannel *channel = drive->channel;
+  uint16_t base = channel->base;
+  uint8_t slave = drive->slave ? DRIVE_SLAVE : 0;
+  if (ext) {
+    port_byte_out(base + REG_DRIVE, DRIVE_LBA48 | slave);
+    ata_delay(channel);
+    wait_not_busy(channel);
+    port_byte_out(base + REG_COUNT, count >> 8); // High bytes first
+    port_byte_out(base + REG_LBA0, lba >> 24);
+    port_byte_out(base + REG_LBA1, lba >> 32);
+    port_byte_out(base + REG_LBA2, lba >> 40);
+  } else {
+    port_byte_out(base + REG_DRIVE, DRIVE_LBA | slave | (lba >> 24 & 0xF));
+    ata_delay(channel);
+    wait_not_busy(channel);
+  }
+  port_byte_out(base + REG_COUNT, count); // 256 is written as 0
+  port_byte_out(base + REG_LBA0, lba);
+  port_byte_out(base + REG_LBA1, lba >> 8);
+  port_byte_out(base + REG_LBA2, lba >> 16);
+  channel->busy = 1;
+  port_byte_out(base + REG_COMMAND, command);
+}
+
+/* Sleep until the IRQ of the running command. Return its status. */
+static uint8_t wait_irq(AtaChannel *channel) {
+  semaphore_down(&channel->done);
+  return channel->status;
+}
+
+/*
+
+IRQ
+
+*/
+
+static int channel_irq(AtaChannel *channel) {
+  uint8_t bm_status = 0;
+  if (channel->bm != 0) {
+    bm_status = port_byte_in(channel->bm + BM_STATUS);
+    if (!(bm_status & BM_STATUS_IRQ)) {
+      return 0; // Another device on the line
+    }
+    port_byte_out(channel->bm + BM_COMMAND, 0); // Stop a DMA transfer
+    port_byte_out(channel->bm + BM_STATUS, bm_status);
+  }
+  uint8_t status = port_byte_in(channel->base + REG_STATUS);
+  if (!channel->busy) {
+    return 0;
+  }
+  channel->status = status;
+  channel->bm_status = bm_status;
+  channel->busy = 0;
+  semaphore_up(&channel->done);
+  return 1;
+}
+
+static int primary_handler(CpuContext *context) {
+  return channel_irq(&channels[0]);
+}
+
+static int secondary_handler(CpuContext *context) {
+  return channel_irq(&channels[1]);
+}
+
+/*
+
+Transfers
+
+*/
+
+/*
+Move count sectors with DMA. The PRD table covers the buffer page by page, and
+merges pages that are physically contiguous. Return -1 on an error.
+*/
+static int dma_transfer(AtaDrive *drive, uint64_t lba, uint32_t count,
+                        uint8_t *buf, int write, int ext) {
+  AtaChannel *channel = drive->channel;
+  uint32_t no_prds = 0;
+  uintptr_t va = (uintptr_t)buf;
+  uint32_t left = count * ATA_SECTOR_SIZE;
+  while (left > 0) {
+    uint32_t no_bytes = PAGE_SIZE - (va & (PAGE_SIZE - 1));
+    if (no_bytes > left) {
+      no_bytes = left;
+    }
+    uintptr_t pa = va_to_pa(va);
+    if (pa == 0) {
+      return -1;
+    }
+    Prd *last = no_prds > 0 ? &channel->prdt[no_prds - 1] : NULL;
+    if (last != NULL && last->pa + last->no_bytes == pa &&
+        (pa & 0xFFFF) != 0 && last->no_bytes + no_bytes < 0x10000) {
+      last->no_bytes += no_bytes; // Same 64 KiB region, as the PRD requires
+    } else {
+      channel->prdt[no_prds++] = (Prd){pa, no_bytes, 0};
+    }
+    va += no_bytes;
+    left -= no_bytes;
+  }
+  channel->prdt[no_prds - 1].flags = PRD_EOT;
+
+  uint16_t bm = channel->bm;
+  uint8_t direction = write ? 0 : BM_CMD_TO_MEMORY;
+  port_long_out(bm + BM_PRDT, channel->prdt_pa);
+  port_byte_out(bm + BM_COMMAND, direction);
+  port_byte_out(bm + BM_STATUS,
+                port_byte_in(bm + BM_STATUS) | BM_STATUS_IRQ | BM_STATUS_ERR);
+  uint8_t command = write ? (ext ? CMD_WRITE_DMA_EXT : CMD_WRITE_DMA)
+                          : (ext ? CMD_READ_DMA_EXT : CMD_READ_DMA);
+  issue(drive, lba, count, command, ext);
+  port_byte_out(bm + BM_COMMAND, direction | BM_CMD_START);
+  uint8_t status = wait_irq(channel);
+  if (status & (STATUS_ERR | STATUS_DF) || channel->bm_status & BM_STATUS_ERR) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+Move count sectors through the data port. The drive raises its IRQ when a
+sector can be read, and after a sector was written. Return -1 on an error.
+*/
+static int pio_transfer(AtaDrive *drive, uint64_t lba, uint32_t count,
+                        uint8_t *buf, int write, int ext) {
+  AtaChannel *channel = drive->channel;
+  uint16_t data = channel->base + REG_DATA;
+  uint8_t command = write ? (ext ? CMD_WRITE_PIO_EXT : CMD_WRITE_PIO)
+                          : (ext ? CMD_READ_PIO_EXT : CMD_READ_PIO);
+  issue(drive, lba, count, command, ext);
+  if (write) {
+    int status = wait_not_busy(channel); // No IRQ before the first sector
+    if (status < 0 || status & (STATUS_ERR | STATUS_DF) ||
+        !(status & STATUS_DRQ)) {
+      return -1;
+    }
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    uint16_t *sector = (uint16_t *)(buf + i * ATA_SECTOR_SIZE);
+    if (write) {
+      port_words_out(data, sector, ATA_SECTOR_SIZE / 2);
+    }
+    uint8_t status = wait_irq(channel);
+    if (status & (STATUS_ERR | STATUS_DF)) {
+      return -1;
+    }
+    if (!write) {
+      // The next sector's IRQ may come as soon as this one is read
+      channel->busy = i + 1 < count;
+      port_words_in(data, sector, ATA_SECTOR_SIZE / 2);
+    } else if (i + 1 < count) {
+      channel->busy = 1;
+    }
+  }
+  return 0;
+}
+
+/* Split a request into commands, and account for it */
+static int ata_request(uint32_t no, uint64_t lba, uint32_t count, uint8_t *buf,
+                       int write) {
+  if (no >= no_drives || count == 0 || lba + count > drives[no].sectors) {
+    return -1;
+  }
+  AtaDrive *drive = &drives[no];
+  AtaChannel *channel = drive->channel;
+  int dma = dma_enabled && drive->dma && ((uintptr_t)buf & 1) == 0;
+  uint64_t start = clock_monotonic();
+
+  mutex_lock(&channel->lock);
+  int err = 0;
+  for (uint32_t done = 0; done < count && err == 0; done += ATA_MAX_SECTORS) {
+    uint32_t n = count - done;
+    if (n > ATA_MAX_SECTORS) {
+      n = ATA_MAX_SECTORS;
+    }
+    uint64_t at = lba + done;
+    int ext = at + n > LBA28_LIMIT;
+    uint8_t *chunk = buf + done * ATA_SECTOR_SIZE;
+    err = dma ? dma_transfer(drive, at, n, chunk, write, ext)
+              : pio_transfer(drive, at, n, chunk, write, ext);
+  }
+
+  AtaStats *stats = &drive->stats;
+  uint64_t ns = clock_monotonic() - start;
+  if (write) {
+    stats->writes++;
+    stats->sectors_written += count;
+  } else {
+    stats->reads++;
+    stats->sectors_read += count;
+  }
+  if (dma) {
+    stats->dma++;
+  } else {
+    stats->pio++;
+  }
+  if (err) {
+    stats->errors++;
+  }
+  stats->total_ns += ns;
+  if (ns > stats->max_ns) {
+    stats->max_ns = ns;
+  }
+  mutex_unlock(&channel->lock);
+  return err;
+}
+
+/*
+Read count sectors from drive, starting at sector lba, into buf. Return -1 on
+an error. Sleeps until the data is there.
+*/
+int ata_read(uint32_t drive, uint64_t lba, uint32_t count, void *buf) {
+  return ata_request(drive, lba, count, buf, 0);
+}
+
+/* Write count sectors from buf to drive, at sector lba. Return -1 on error. */
+int ata_write(uint32_t drive, uint64_t lba, uint32_t count, const void *buf) {
+  return ata_request(drive, lba, count, (uint8_t *)buf, 1);
+}
+
+/* Use DMA for drives that support it (the default), or PIO for all of them */
+void ata_set_dma(int enabled) { dma_enabled = enabled; }
+
+uint32_t ata_no_drives() { return no_drives; }
+
+/* Size of drive in sectors, 0 if there is no such drive */
+uint64_t ata_sectors(uint32_t drive) {
+  return drive < no_drives ? drives[drive].sectors : 0;
+}
+
+/*
+
+Setup
+
+*/
+
+/* Keep the model name of IDENTIFY data, without its padding */
+static void read_model(const uint16_t *id, char *model) {
+  for (int i = 0; i < 20; i++) {
+    model[i * 2] = id[ID_MODEL + i] >> 8;
+    model[i * 2 + 1] = id[ID_MODEL + i] & 0xFF;
+  }
+  int len = 40;
+  while (len > 0 && model[len - 1] == ' ') {
+    len--;
+  }
+  model[len] = '\0';
+}
+
+/*
+Identify the master or slave of channel, and add it to the drives if it is an
+ATA disk. ATAPI and SATA devices leave a signature in the LBA registers.
+*/
+static void probe(AtaChannel *channel, uint8_t slave) {
+  if (no_drives == ATA_MAX_DRIVES) {
+    return;
+  }
+  uint16_t base = channel->base;
+  port_byte_out(base + REG_DRIVE, DRIVE_LBA | (slave ? DRIVE_SLAVE : 0));
+  ata_delay(channel);
+  port_byte_out(base + REG_COUNT, 0);
+  port_byte_out(base + REG_LBA0, 0);
+  port_byte_out(base + REG_LBA1, 0);
+  port_byte_out(base + REG_LBA2, 0);
+  port_byte_out(base + REG_COMMAND, CMD_IDENTIFY);
+  ata_delay(channel);
+  if (port_byte_in(base + REG_STATUS) == 0) {
+    return; // No drive
+  }
+  int status = wait_not_busy(channel);
+  if (status < 0 || port_byte_in(base + REG_LBA1) != 0 ||
+      port_byte_in(base + REG_LBA2) != 0) {
+    return;
+  }
+  if (status & STATUS_ERR || !(status & STATUS_DRQ)) {
+    return;
+  }
+  uint16_t id[256];
+  port_words_in(base + REG_DATA, id, 256);
+
+  AtaDrive *drive = &drives[no_drives++];
+  drive->channel = channel;
+  drive->slave = slave;
+  drive->lba48 = (id[ID_FEATURES] & ID_FEATURES_LBA48) != 0;
+  drive->dma = channel->bm != 0 && (id[ID_CAPS] & ID_CAPS_DMA) != 0;
+  if (drive->lba48) {
+    drive->sectors = (uint64_t)id[ID_SECTORS_EXT] |
+                     (uint64_t)id[ID_SECTORS_EXT + 1] << 16 |
+                     (uint64_t)id[ID_SECTORS_EXT + 2] << 32 |
+                     (uint64_t)id[ID_SECTORS_EXT + 3] << 48;
+  } else {
+    drive->sectors = id[ID_SECTORS] | (uint32_t)id[ID_SECTORS + 1] << 16;
+  }
+  read_model(id, drive->model);
+}
+
+static void print_drive(uint32_t no) {
+  AtaDrive *drive = &drives[no];
+  print("ata");
+  print_int(no);
+  print(": ");
+  print(drive->model);
+  print(", ");
+  print_int(drive->sectors / 2);
+  print(drive->dma ? " KiB, DMA\n" : " KiB, PIO\n");
+}
+
+/*
+Find the drives of the IDE controller's channels, and let the controller do
+DMA if it can. Channels in native PCI mode are not used. Needs pci_init(), the
+heap and a calibrated TSC. Interrupts must be disabled. Return the number of
+drives.
+*/
+uint32_t ata_init() {
+  PciDevice ide;
+  int found = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &ide);
+  uint16_t bm = 0;
+  if (found && ide.prog_if & PROG_IF_BUS_MASTER) {
+    pci_enable(&ide, PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+    bm = pci_bar(&ide, BM_BAR);
+  }
+  channels[0] = (AtaChannel){.base = PRIMARY_BASE,
+                             .ctrl = PRIMARY_CTRL,
+                             .bm = bm,
+                             .irq = PRIMARY_IRQ};
+  channels[1] = (AtaChannel){.base = SECONDARY_BASE,
+                             .ctrl = SECONDARY_CTRL,
+                             .bm = bm != 0 ? bm + BM_CHANNEL_OFFSET : 0,
+                             .irq = SECONDARY_IRQ};
+
+  for (int i = 0; i < 2; i++) {
+    AtaChannel *channel = &channels[i];
+    mutex_init(&channel->lock);
+    semaphore_init(&channel->done, 0);
+    if ((found && ide.prog_if & PROG_IF_NATIVE(i)) ||
+        port_byte_in(channel->base + REG_STATUS) == 0xFF) {
+      continue; // Nothing on the legacy ports (a floating bus reads 0xFF)
+    }
+    uint32_t first = no_drives;
+    port_byte_out(channel->ctrl, CTRL_NIEN);
+    probe(channel, 0);
+    probe(channel, 1);
+    port_byte_out(channel->ctrl, 0);
+    if (no_drives == first) {
+      continue;
+    }
+    if (channel->bm != 0) {
+      channel->prdt_pa = alloc_frame();
+      channel->prdt =
+          channel->prdt_pa != 0
+              ? (Prd *)map_mmio(channel->prdt_pa, MAX_PRDS * sizeof(Prd))
+              : NULL;
+    }
+    if (channel->bm != 0 && channel->prdt == NULL) {
+      if (channel->prdt_pa != 0) {
+        free_frame(channel->prdt_pa);
+      }
+      channel->bm = 0; // Out of memory for the PRDT, its drives use PIO
+      for (uint32_t d = first; d < no_drives; d++) {
+        drives[d].dma = 0;
+      }
+    } else if (channel->bm != 0) {
+      port_byte_out(channel->bm + BM_STATUS,
+                    port_byte_in(channel->bm + BM_STATUS)); // Clear the IRQ
+    }
+    irq_install_handler(channel->irq,
+                        i == 0 ? primary_handler : secondary_handler);
+  }
+  for (uint32_t i = 0; i < no_drives; i++) {
+    print_drive(i);
+  }
+  return no_drives;
+}
+
+/* Print what every drive did since boot */
+void print_ata_stats() {
+  for (uint32_t i = 0; i < no_drives; i++) {
+    AtaStats stats = drives[i].stats; // Racy, only for display
+    uint32_t requests = stats.reads + stats.writes;
+    uint64_t kib = (stats.sectors_read + stats.sectors_written) / 2;
+    print("ata");
+    print_int(i);
+    print(": ");
+    print_int(stats.reads);
+    print(" reads, ");
+    print_int(stats.writes);
+    print(" writes, ");
+    print_int(kib);
+    print(" KiB (");
+    print_int(stats.dma);
+    print(" DMA, ");
+    print_int(stats.pio);
+    print(" PIO), ");
+    print_int(stats.errors);
+    print(" errors, avg ");
+    print_int(requests != 0 ? stats.total_ns / requests / 1000 : 0);
+    print(" us, max ");
+    print_int(stats.max_ns / 1000);
+    print(" us, ");
+    print_int(stats.total_ns != 0 ? kib * 1000000000 / stats.total_ns : 0);
+    print(" KiB/s\n");
+  }
+}
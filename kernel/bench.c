@@ -0,0 +1,158 @@
+/*
+
+In-kernel micro-benchmarks
+
+- Like the tests, each benchmark is started by hand (e.g. from kmain) and
+  prints its results to the screen when done.
+- Times are measured with the TSC and reported both in cycles and in
+  nanoseconds per operation.
+
+*/
+
+#include "include/bench.h"
+#include "include/pmm.h"
+#include "include/process.h"
+#include "include/screen.h"
+#include "include/sync.h"
+#include "include/syscall.h"
+#include "include/timer.h"
+#include "include/vdso.h"
+#include "include/vmm.h"
+#include <stddef.h>
+
+/* Print the average cost of one of ops operations that took cycles */
+static void bench_report(const char *name, uint64_t cycles, uint32_t ops) {
+  print(name);
+  print(": ");
+  print_int(cycles / ops);
+  print(" cycles, ");
+  print_int(tsc_to_ns(cycles) / ops);
+  print(" ns\n");
+}
+
+/*
+
+Null system call round trip, through int 0x80 and through SYSENTER, and for
+comparison a read of the vDSO clock. Runs in a user thread, which leaves its
+results in a page of its process for a kernel thread of the same process to
+report (its PD is loaded for both).
+
+*/
+
+#define SYSCALL_ROUNDS 100000
+#define SYSCALL_BENCH_VA 0x400000 // Results page, in the benchmark's process
+
+typedef volatile struct {
+  uint64_t int80_cycles;
+  uint64_t sysenter_cycles;
+  uint64_t vdso_clock_cycles;
+  uint32_t done;
+} SyscallBench;
+
+static inline __attribute__((always_inline)) uint64_t user_rdtsc() {
+  uint64_t tsc;
+  __asm__ __volatile__("rdtsc" : "=A"(tsc));
+  return tsc;
+}
+
+USER_CODE static void t_bench_syscall(SyscallBench *bench) {
+  uint64_t start = user_rdtsc();
+  for (uint32_t i = 0; i < SYSCALL_ROUNDS; i++) {
+    syscall0(SYS_NULL);
+  }
+  bench->int80_cycles = user_rdtsc() - start;
+
+  if (vdso_has_sysenter()) {
+    start = user_rdtsc();
+    for (uint32_t i = 0; i < SYSCALL_ROUNDS; i++) {
+      fast_syscall3(SYS_NULL, 0, 0, 0);
+    }
+    bench->sysenter_cycles = user_rdtsc() - start;
+  }
+
+  start = user_rdtsc();
+  for (uint32_t i = 0; i < SYSCALL_ROUNDS; i++) {
+    vdso_clock_ns();
+  }
+  bench->vdso_clock_cycles = user_rdtsc() - start;
+  bench->done = 1;
+}
+
+static void t_bench_syscall_report(SyscallBench *bench) {
+  while (!bench->done) {
+    timer_wait_ms(10);
+  }
+  bench_report("int 0x80 null syscall", bench->int80_cycles, SYSCALL_ROUNDS);
+  if (has_sysenter) {
+    bench_report("sysenter null syscall", bench->sysenter_cycles,
+                 SYSCALL_ROUNDS);
+  } else {
+    print("sysenter not supported\n");
+  }
+  bench_report("vdso clock read", bench->vdso_clock_cycles, SYSCALL_ROUNDS);
+  thread_exit();
+}
+
+void bench_syscall() {
+  Process *p = create_process();
+  if (p == NULL) {
+    return;
+  }
+  uintptr_t frame = alloc_frame();
+  if (frame == 0) {
+    delete_process(p);
+    print("syscall benchmark: out of memory\n");
+    return;
+  }
+  map_user_page(p->pd, SYSCALL_BENCH_VA, frame); // Zeroed, done is 0
+  if (create_user_thread(p, (void (*)(uintptr_t))t_bench_syscall,
+                         SYSCALL_BENCH_VA) == NULL) {
+    delete_process(p); // Frees the page too
+    return;
+  }
+  create_thread(p, (void (*)(uintptr_t))t_bench_syscall_report,
+                SYSCALL_BENCH_VA);
+}
+
+/*
+
+Thread ping-pong: two kernel threads wake each other through semaphores, so
+every round trip is two blocking switches (and, when the threads were placed on
+different CPUs, two cross-CPU wake-ups).
+
+*/
+
+#define PING_PONG_ROUNDS 10000
+
+static struct {
+  Semaphore ping;
+  Semaphore pong;
+  uint64_t start;
+} ping_pong;
+
+static void t_ping() {
+  ping_pong.start = rdtsc();
+  for (uint32_t i = 0; i < PING_PONG_ROUNDS; i++) {
+    semaphore_up(&ping_pong.ping);
+    semaphore_down(&ping_pong.pong);
+  }
+  bench_report("thread ping-pong round trip", rdtsc() - ping_pong.start,
+               PING_PONG_ROUNDS);
+  thread_exit();
+}
+
+static void t_pong() {
+  for (uint32_t i = 0; i < PING_PONG_ROUNDS; i++) {
+    semaphore_down(&ping_pong.ping);
+    semaphore_up(&ping_pong.pong);
+  }
+  thread_exit();
+}
+
+void bench_ping_pong() {
+  semaphore_init(&ping_pong.ping, 0);
+  semaphore_init(&ping_pong.pong, 0);
+  Process *p = create_process();
+  create_thread(p, (void (*)(uintptr_t))t_pong, 0);
+  create_thread(p, (void (*)(uintptr_t))t_ping, 0);
+}
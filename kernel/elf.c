@@ -0,0 +1,303 @@
+/*
+
+ELF program loader
+
+Programs are ELF32 executables (i386, statically linked) held in memory, as
+there is no file system yet. Starting a process costs the pages it touches,
+not the size of its image:
+
+- elf_open() checks the image and notes its PT_LOAD segments once. Nothing is
+  copied, the image must stay in memory until elf_close().
+- elf_exec() creates a process whose PD maps nothing of the program, and a
+  user thread starting at the entry point (called like a thread function, see
+  create_user_thread()). Its pages are loaded by the page fault handler as
+  they are first touched: the page is filled from the image, and whatever lies
+  past the data in the file (.bss) is zeroed.
+- Pages of read-only segments (code, constants) are loaded once and the same
+  frame is mapped into every process running the image. The image owns these
+  frames, and frees them on elf_close(). Pages of writable segments are
+  private to each process and freed with its PD.
+- System calls fault in the pages of the buffers they are passed before
+  checking them (elf_fault_in()), as they must not fault on user memory.
+- Each image counts the pages it read and the ones it reused.
+
+Loading a page holds the image's lock, so threads of different processes
+faulting on the same shared page do not both load it, nor do two threads of
+one process faulting on the same private page.
+
+*/
+
+#include "include/elf.h"
+#include "include/isr.h"
+#include "include/memory.h"
+#include "include/pmm.h"
+#include "include/process.h"
+#include "include/vmm.h"
+#include <stddef.h>
+
+#define PAGE_SIZE 4096
+#define PF_ISR_NO 14
+#define PF_PROTECTION (1 << 0) // Else the page was not present
+
+#define ELF_VA_START PAGE_SIZE // The page at NULL stays unmapped
+#define ELF_VA_END 0xB0000000  // User stacks are above, see process.c
+
+#define ELF_CLASS_32 1
+#define ELF_DATA_LSB 1
+#define ELF_TYPE_EXEC 2
+#define ELF_MACHINE_386 3
+
+static uintptr_t page_down(uintptr_t va) { return va & ~(PAGE_SIZE - 1); }
+
+static uintptr_t page_up(uintptr_t va) {
+  return (va + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+/*
+
+Images
+
+*/
+
+static int is_header_ok(const ElfHeader *header, uint32_t size) {
+  return header->ident[0] == 0x7F && header->ident[1] == 'E' &&
+         header->ident[2] == 'L' && header->ident[3] == 'F' &&
+         header->ident[4] == ELF_CLASS_32 && header->ident[5] == ELF_DATA_LSB &&
+         header->type == ELF_TYPE_EXEC && header->machine == ELF_MACHINE_386 &&
+         header->phentsize == sizeof(ElfProgramHeader) &&
+         header->phoff < size &&
+         header->phnum <= (size - header->phoff) / sizeof(ElfProgramHeader);
+}
+
+/* Return 0 if the segment cannot be loaded */
+static int add_segment(ElfImage *image, const ElfProgramHeader *ph,
+                       uint32_t size) {
+  if (image->no_segments == ELF_MAX_SEGMENTS || ph->filesz > ph->memsz ||
+      ph->offset > size || ph->filesz > size - ph->offset ||
+      ph->vaddr < ELF_VA_START || ph->memsz > ELF_VA_END - ph->vaddr ||
+      (ph->vaddr - ph->offset) % PAGE_SIZE != 0) {
+    return 0;
+  }
+
+  ElfSegment *segment = &image->segments[image->no_segments];
+  segment->start = page_down(ph->vaddr);
+  segment->end = page_up(ph->vaddr + ph->memsz);
+  for (uint32_t i = 0; i < image->no_segments; i++) {
+    if (segment->start < image->segments[i].end &&
+        image->segments[i].start < segment->end) {
+      return 0; // Pages are loaded from one segment only
+    }
+  }
+  segment->vaddr = ph->vaddr;
+  segment->offset = ph->offset;
+  segment->filesz = ph->filesz;
+  segment->writable = (ph->flags & ELF_PF_W) != 0;
+  segment->frames = NULL;
+  if (!segment->writable) {
+    uint32_t no_bytes =
+        (segment->end - segment->start) / PAGE_SIZE * sizeof(uintptr_t);
+    segment->frames = (uintptr_t *)kmalloc(no_bytes);
+    mem_set((uint8_t *)segment->frames, 0x0, no_bytes);
+  }
+  image->no_segments++;
+  return 1;
+}
+
+static void free_segments(ElfImage *image) {
+  for (uint32_t i = 0; i < image->no_segments; i++) {
+    ElfSegment *segment = &image->segments[i];
+    if (segment->frames == NULL) {
+      continue;
+    }
+    for (uintptr_t page = segment->start; page < segment->end;
+         page += PAGE_SIZE) {
+      uintptr_t frame = segment->frames[(page - segment->start) / PAGE_SIZE];
+      if (frame != 0) {
+        free_frame(frame);
+      }
+    }
+    kfree(segment->frames);
+  }
+}
+
+static ElfSegment *find_segment(ElfImage *image, uintptr_t va) {
+  for (uint32_t i = 0; i < image->no_segments; i++) {
+    if (va >= image->segments[i].start && va < image->segments[i].end) {
+      return &image->segments[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+Check an executable held in memory and note what to load from it. Return NULL
+if it is not one this loader can run.
+*/
+ElfImage *elf_open(const uint8_t *data, uint32_t size) {
+  const ElfHeader *header = (const ElfHeader *)data;
+  if (size < sizeof(ElfHeader) || !is_header_ok(header, size)) {
+    return NULL;
+  }
+
+  ElfImage *image = (ElfImage *)kmalloc(sizeof(ElfImage));
+  image->data = data;
+  image->size = size;
+  image->entry = header->entry;
+  image->no_segments = 0;
+  spin_init(&image->lock);
+  image->processes = 0;
+  image->pages_read = 0;
+  image->pages_reused = 0;
+
+  const ElfProgramHeader *phs =
+      (const ElfProgramHeader *)(data + header->phoff);
+  int ok = 1;
+  for (uint32_t i = 0; ok && i < header->phnum; i++) {
+    if (phs[i].type == ELF_PT_LOAD && phs[i].memsz != 0) {
+      ok = add_segment(image, &phs[i], size);
+    }
+  }
+  if (!ok || find_segment(image, image->entry) == NULL) {
+    free_segments(image);
+    kfree(image);
+    return NULL;
+  }
+  return image;
+}
+
+/* Free an image and its shared pages. Return -1 if a process still runs it. */
+int elf_close(ElfImage *image) {
+  uint32_t flags = spin_lock_irqsave(&image->lock);
+  uint32_t processes = image->processes;
+  spin_unlock_irqrestore(&image->lock, flags);
+  if (processes != 0) {
+    return -1;
+  }
+  free_segments(image);
+  kfree(image);
+  return 0;
+}
+
+/*
+
+Processes
+
+*/
+
+/*
+Start the program in a new process, as if its entry point was called with arg.
+Return NULL if there are no IDs left for it.
+*/
+Process *elf_exec(ElfImage *image, uintptr_t arg) {
+  Process *process = create_process();
+  if (process == NULL) {
+    return NULL;
+  }
+  uint32_t flags = spin_lock_irqsave(&image->lock);
+  image->processes++;
+  spin_unlock_irqrestore(&image->lock, flags);
+  process->image = image;
+
+  if (create_user_thread(process, (void (*)(uintptr_t))image->entry, arg) ==
+      NULL) {
+    delete_process(process);
+    return NULL;
+  }
+  return process;
+}
+
+/* Called once the PD of a process is freed, so the image may be closed */
+void elf_exit(Process *process) {
+  ElfImage *image = process->image;
+  if (image == NULL) {
+    return;
+  }
+  uint32_t flags = spin_lock_irqsave(&image->lock);
+  image->processes--;
+  spin_unlock_irqrestore(&image->lock, flags);
+  process->image = NULL;
+}
+
+/*
+
+Demand paging
+
+*/
+
+/*
+Map the page at va into the loaded PD, the one of a process running image.
+Return 0 if va is not part of the program or memory ran out.
+*/
+static int load_page(ElfImage *image, uintptr_t va) {
+  ElfSegment *segment = find_segment(image, va);
+  if (segment == NULL) {
+    return 0;
+  }
+  uintptr_t page = page_down(va);
+  uint32_t flags = spin_lock_irqsave(&image->lock);
+  if (is_user_range(page, 1)) {
+    spin_unlock_irqrestore(&image->lock, flags);
+    return 1; // Another thread of the process loaded it meanwhile
+  }
+
+  uintptr_t *shared = NULL;
+  if (!segment->writable) {
+    shared = &segment->frames[(page - segment->start) / PAGE_SIZE];
+    if (*shared != 0) {
+      map_user_page_here(page, *shared, UP_SHARED, NULL, 0);
+      image->pages_reused++;
+      spin_unlock_irqrestore(&image->lock, flags);
+      return 1;
+    }
+  }
+
+  uintptr_t frame = alloc_frame();
+  if (frame != 0) {
+    /*
+    Data runs from the page (the file offset is congruent to it, see
+    add_segment()) to the end of the segment's data, the rest is zeroed
+    */
+    uintptr_t data_end = segment->vaddr + segment->filesz;
+    const uint8_t *src =
+        image->data + segment->offset + (page - segment->vaddr);
+    uint32_t no_bytes = 0;
+    if (page < data_end) {
+      no_bytes = data_end - page < PAGE_SIZE ? data_end - page : PAGE_SIZE;
+    }
+    map_user_page_here(page, frame,
+                       UP_FILL | (shared != NULL ? UP_SHARED : UP_WRITE), src,
+                       no_bytes);
+    if (shared != NULL) {
+      *shared = frame;
+    }
+    image->pages_read++;
+  }
+  spin_unlock_irqrestore(&image->lock, flags);
+  return frame != 0;
+}
+
+/* Load the pages of [va, va + no_bytes) the running program did not touch */
+void elf_fault_in(uintptr_t va, uint32_t no_bytes) {
+  ElfImage *image = thread_current()->process->image;
+  if (image == NULL || va + no_bytes < va) {
+    return;
+  }
+  for (uintptr_t page = page_down(va); page < va + no_bytes;
+       page += PAGE_SIZE) {
+    load_page(image, page);
+  }
+}
+
+/* #PF fixup: a missing page of the running program is loaded, not a fault */
+static int elf_pf_fixup(CpuContext *context) {
+  uintptr_t va;
+  __asm__ __volatile__("mov %%cr2, %0" : "=r"(va));
+  if ((context->err_code & PF_PROTECTION) || va >= ELF_VA_END) {
+    return 0;
+  }
+  ElfImage *image = thread_current()->process->image;
+  return image != NULL && load_page(image, va);
+}
+
+/* Take over page faults, once threads exist */
+void elf_init() { isr_install_fixup(PF_ISR_NO, elf_pf_fixup); }
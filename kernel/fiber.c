@@ -0,0 +1,288 @@
+/*
+
+Fibers
+
+Many small cooperative tasks multiplexed onto the thread that creates them
+(their host), without the cost of threads:
+
+- Fibers only switch when they yield, wait for another fiber (fiber_join())
+  or finish, never on a timer. Switching uses swtch() like threads do, only
+  saving the callee-saved registers, and takes no lock: each host has its own
+  ready queue, in a thread-local variable.
+- A fiber that blocks the thread (sleeping, taking a mutex) blocks every
+  fiber of its host.
+- Interrupts are handled on whatever stack is current, so a stack needs room
+  for the deepest IRQ path on top of the fiber's own frames. Instead of a
+  stack each, fibers run one at a time on the host's run stack, and a fiber
+  that is switched out only keeps the part of it that it used (rarely more
+  than a few hundred bytes). Switching goes through the host's own stack,
+  which copies the used part out and the next fiber's back in. So locals of a
+  fiber must not be passed to other fibers by address.
+- Fibers, saved stacks and run stacks come from a pool of power-of-two size
+  classes, carved out of page-sized chunks. Freed blocks go back to the pool
+  and are reused, no fiber operation walks the kernel heap.
+- Every fiber must be joined, once, which frees it. The host joins fibers
+  from outside of them, which runs its fibers until the one joined finished.
+
+*/
+
+#include "include/fiber.h"
+#include "include/memory.h"
+#include "include/screen.h"
+#include "include/spinlock.h"
+#include "include/vmm.h"
+#include <stddef.h>
+
+#define FIBER_STACK_SIZE 8192 // Run stack of a host
+
+#define POOL_MIN_BLOCK 64
+#define POOL_NO_CLASSES 8 // Up to FIBER_STACK_SIZE
+#define POOL_CHUNK_SIZE 4096
+
+extern void swtch(uintptr_t *prev_sp, uintptr_t next_sp,
+                  volatile uint32_t *lock);
+
+/* The fibers of one thread */
+typedef struct {
+  Fiber *current; // NULL while the host itself runs
+  Fiber *head;    // Ready queue
+  Fiber *tail;
+  uint32_t live; // Created and not yet joined
+  uint8_t *stack;
+  uintptr_t sp;     // Saved stack pointer of the host
+  uint32_t no_lock; // swtch() releases a lock, fibers have none
+} FiberHost;
+
+static __thread FiberHost host;
+
+/*
+
+Pool
+
+*/
+
+static struct {
+  Spinlock lock;
+  void *free[POOL_NO_CLASSES]; // Free blocks, linked through their first word
+} pool;
+
+/* Return the smallest size class that fits no_bytes */
+static uint32_t pool_class(uint32_t no_bytes) {
+  uint32_t class = 0;
+  while ((uint32_t)POOL_MIN_BLOCK << class < no_bytes) {
+    class++;
+  }
+  return class;
+}
+
+static void pool_free(void *block, uint32_t class) {
+  uint32_t flags = spin_lock_irqsave(&pool.lock);
+  *(void **)block = pool.free[class];
+  pool.free[class] = block;
+  spin_unlock_irqrestore(&pool.lock, flags);
+}
+
+/* Return NULL if the kernel heap is full */
+static void *pool_alloc(uint32_t class) {
+  uint32_t flags = spin_lock_irqsave(&pool.lock);
+  void *block = pool.free[class];
+  if (block != NULL) {
+    pool.free[class] = *(void **)block;
+  }
+  spin_unlock_irqrestore(&pool.lock, flags);
+  if (block != NULL) {
+    return block;
+  }
+
+  uint32_t size = POOL_MIN_BLOCK << class;
+  if (size >= POOL_CHUNK_SIZE) {
+    return (void *)kmalloc(size);
+  }
+  uint8_t *chunk = (uint8_t *)kmalloc(POOL_CHUNK_SIZE);
+  if (chunk == NULL) {
+    return NULL;
+  }
+  for (uint32_t offset = size; offset < POOL_CHUNK_SIZE; offset += size) {
+    pool_free(chunk + offset, class);
+  }
+  return chunk;
+}
+
+/*
+
+Switching
+
+*/
+
+/* Where a new fiber's first switch returns to. Never returns itself. */
+static void fiber_start() {
+  Fiber *fiber = host.current;
+  fiber->function(fiber->arg);
+  fiber->status = FIBER_DONE;
+  swtch(&fiber->sp, host.sp, &host.no_lock);
+}
+
+/* Make room for no_bytes of fiber's stack. Return -1 if out of memory. */
+static int reserve_saved(Fiber *fiber, uint32_t no_bytes) {
+  uint32_t class = pool_class(no_bytes);
+  if (fiber->saved != NULL && fiber->saved_class >= class) {
+    return 0;
+  }
+  uint8_t *saved = (uint8_t *)pool_alloc(class);
+  if (saved == NULL) {
+    return -1;
+  }
+  if (fiber->saved != NULL) {
+    pool_free(fiber->saved, fiber->saved_class);
+  }
+  fiber->saved = saved;
+  fiber->saved_class = class;
+  return 0;
+}
+
+/*
+Keep the part of fiber's stack that is in use, from its saved stack pointer up
+to the top of the run stack. Return -1 if there is no memory for it.
+*/
+static int save_stack(Fiber *fiber, uint8_t *top) {
+  uint32_t no_bytes = top - (uint8_t *)fiber->sp;
+  if (reserve_saved(fiber, no_bytes) != 0) {
+    return -1;
+  }
+  mem_cpy(top - no_bytes, fiber->saved, no_bytes);
+  fiber->no_saved = no_bytes;
+  return 0;
+}
+
+static void make_ready(Fiber *fiber) {
+  fiber->status = FIBER_READY;
+  fiber->next = NULL;
+  if (host.tail == NULL) {
+    host.head = fiber;
+  } else {
+    host.tail->next = fiber;
+  }
+  host.tail = fiber;
+}
+
+/*
+Run the fiber at the front of the ready queue until it switches back to the
+host. Return 0 if none was ready. Only called on the host's stack.
+*/
+static int run_next() {
+  Fiber *fiber = host.head;
+  if (fiber == NULL) {
+    return 0;
+  }
+  host.head = fiber->next;
+  if (host.head == NULL) {
+    host.tail = NULL;
+  }
+
+  uint8_t *top = host.stack + FIBER_STACK_SIZE;
+  mem_cpy(fiber->saved, top - fiber->no_saved, fiber->no_saved);
+  fiber->status = FIBER_RUNNING;
+  host.current = fiber;
+  swtch(&host.sp, fiber->sp, &host.no_lock);
+  host.current = NULL;
+
+  if (fiber->status == FIBER_DONE) {
+    pool_free(fiber->saved, fiber->saved_class);
+    fiber->saved = NULL;
+    if (fiber->joiner != NULL) {
+      make_ready(fiber->joiner);
+    }
+  } else if (save_stack(fiber, top) != 0) {
+    print("\nFiber stack lost, out of memory!\n");
+    while (1) {
+    }
+  }
+  return 1;
+}
+
+/* Switch from the running fiber back to its host */
+static void switch_to_host() {
+  swtch(&host.current->sp, host.sp, &host.no_lock);
+}
+
+/*
+
+API
+
+*/
+
+/*
+Create a fiber of the calling thread (or of the fiber's host, from a fiber)
+that runs function(arg) once the host gets to it. Return NULL if out of memory.
+*/
+Fiber *fiber_create(void (*function)(uintptr_t), uintptr_t arg) {
+  if (host.stack == NULL) {
+    host.stack = (uint8_t *)pool_alloc(pool_class(FIBER_STACK_SIZE));
+    if (host.stack == NULL) {
+      return NULL;
+    }
+  }
+  Fiber *fiber = (Fiber *)pool_alloc(pool_class(sizeof(Fiber)));
+  if (fiber == NULL) {
+    return NULL;
+  }
+  fiber->function = function;
+  fiber->arg = arg;
+  fiber->joiner = NULL;
+
+  /*
+  The first switch frame: callee-saved registers (edi, esi, ebx, ebp) and
+  where swtch() returns to, followed by a null return address for
+  fiber_start()
+  */
+  uint32_t frame[] = {0, 0, 0, 0, (uintptr_t)fiber_start, 0};
+  fiber->saved = NULL;
+  if (reserve_saved(fiber, sizeof(frame)) != 0) {
+    pool_free(fiber, pool_class(sizeof(Fiber)));
+    return NULL;
+  }
+  mem_cpy((uint8_t *)frame, fiber->saved, sizeof(frame));
+  fiber->no_saved = sizeof(frame);
+  fiber->sp = (uintptr_t)(host.stack + FIBER_STACK_SIZE - sizeof(frame));
+  host.live++;
+  make_ready(fiber);
+  return fiber;
+}
+
+/* Let the other ready fibers of the host run first. Does nothing outside of
+ * a fiber. */
+void fiber_yield() {
+  if (host.current == NULL) {
+    return;
+  }
+  make_ready(host.current);
+  switch_to_host();
+}
+
+/*
+Wait for a fiber of the same host to finish, and free it. From the host
+itself, this runs its fibers meanwhile. Return -1 if it can never finish (the
+fibers left all wait for each other).
+*/
+int fiber_join(Fiber *fiber) {
+  if (host.current != NULL) {
+    if (fiber->status != FIBER_DONE) {
+      fiber->joiner = host.current;
+      host.current->status = FIBER_WAITING;
+      switch_to_host();
+    }
+  } else {
+    while (fiber->status != FIBER_DONE) {
+      if (!run_next()) {
+        return -1;
+      }
+    }
+  }
+
+  pool_free(fiber, pool_class(sizeof(Fiber)));
+  if (--host.live == 0) {
+    pool_free(host.stack, pool_class(FIBER_STACK_SIZE));
+    host.stack = NULL;
+  }
+  return 0;
+}
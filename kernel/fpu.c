@@ -0,0 +1,157 @@
+/*
+
+Lazy x87/SSE context switching
+
+CpuContext only holds the general purpose registers. The FPU and SSE registers
+are switched lazily, so threads that never touch them pay nothing:
+- On every context switch the scheduler sets CR0.TS. The next FPU or SSE
+  instruction then raises #NM (Device Not Available, vector 7), whose handler
+  clears TS and loads the thread's state with FXRSTOR. A thread that uses
+  the FPU for the first time gets a 512-byte save area and a clean state.
+- A thread that had TS cleared during its slice has live FPU state, which is
+  saved with FXSAVE when it is switched out, so the saved state is always
+  current while the thread is not running and it may move to another CPU.
+- Each CPU remembers whose state its registers hold (fpu_owner). A thread
+  switched back in on the CPU it last used the FPU on, with no other FPU user
+  in between, gets TS cleared right away and takes no #NM.
+- CPUs without FXSAVE fall back to FNSAVE/FRSTOR, which only cover the x87
+  registers (such CPUs have no SSE either).
+
+FPU code in interrupt handlers would clobber the interrupted thread's
+registers, so the kernel only uses the FPU from threads. Kernel services
+(e.g. timer_wait_ms()) stick to integers, so calling them does not turn a
+thread into an FPU user.
+
+*/
+
+#include "include/fpu.h"
+#include "include/isr.h"
+#include "include/smp.h"
+#include "include/vmm.h"
+#include <stddef.h>
+
+#define NM_ISR_NO 7
+
+#define CR0_MP (1 << 1) // Monitor coprocessor: WAIT/FWAIT honour TS
+#define CR0_EM (1 << 2) // Emulation: must be clear to use the FPU
+#define CR0_TS (1 << 3) // Task switched: next FPU instruction raises #NM
+#define CR0_NE (1 << 5) // Report x87 errors through #MF, not IRQ 13
+#define CR4_OSFXSR (1 << 9)      // FXSAVE/FXRSTOR and SSE enabled
+#define CR4_OSXMMEXCPT (1 << 10) // SSE errors raise #XM
+
+#define MXCSR_DEFAULT 0x1F80 // All SSE exceptions masked
+
+/* The save area must be 16-byte aligned, fpu_state is the raw allocation */
+#define FPU_AREA(thread)                                                       \
+  ((uint8_t *)(((uintptr_t)(thread)->fpu_state + 15) & ~(uintptr_t)15))
+
+static int has_fxsr;
+
+static uint32_t read_cr0() {
+  uint32_t cr0;
+  __asm__ __volatile__("mov %%cr0, %0" : "=r"(cr0));
+  return cr0;
+}
+
+static void write_cr0(uint32_t cr0) {
+  __asm__ __volatile__("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+static void stts() { write_cr0(read_cr0() | CR0_TS); }
+
+static void clts() { __asm__ __volatile__("clts" : : : "memory"); }
+
+static void fpu_save(Thread *thread) {
+  if (has_fxsr) {
+    __asm__ __volatile__("fxsave (%0)" : : "r"(FPU_AREA(thread)) : "memory");
+  } else {
+    // FNSAVE also reinitializes the FPU, which the owner's state then no
+    // longer matches
+    __asm__ __volatile__("fnsave (%0)" : : "r"(FPU_AREA(thread)) : "memory");
+    this_cpu()->fpu_owner = NULL;
+  }
+}
+
+static void fpu_restore(Thread *thread) {
+  if (has_fxsr) {
+    __asm__ __volatile__("fxrstor (%0)" : : "r"(FPU_AREA(thread)) : "memory");
+  } else {
+    __asm__ __volatile__("frstor (%0)" : : "r"(FPU_AREA(thread)) : "memory");
+  }
+}
+
+/* Give the running thread the FPU, on its first FPU instruction of a slice */
+static int fpu_nm_fixup(CpuContext *context) {
+  Cpu *cpu = this_cpu();
+  Thread *thread = cpu->curr_thread;
+  if (thread == NULL) {
+    return 0;
+  }
+
+  clts();
+  if (thread->fpu_state == NULL) {
+    thread->fpu_state = (uint8_t *)kmalloc(FPU_STATE_SIZE + 15);
+    __asm__ __volatile__("fninit");
+    if (has_fxsr) {
+      uint32_t mxcsr = MXCSR_DEFAULT;
+      __asm__ __volatile__("ldmxcsr %0" : : "m"(mxcsr));
+    }
+  } else if (cpu->fpu_owner != thread || thread->fpu_cpu != cpu) {
+    fpu_restore(thread);
+  }
+  cpu->fpu_owner = thread;
+  thread->fpu_cpu = cpu;
+  return 1;
+}
+
+/*
+Save prev's FPU state if it was live, and arm #NM for next unless this CPU's
+registers still hold next's state. Called by schedule() with interrupts
+disabled.
+*/
+void fpu_switch(Cpu *cpu, Thread *prev, Thread *next) {
+  if (!(read_cr0() & CR0_TS) && prev->status != DEAD) {
+    fpu_save(prev);
+  }
+  if (cpu->fpu_owner == next && next->fpu_cpu == cpu) {
+    clts();
+  } else {
+    stts();
+  }
+}
+
+/* Release the save area of a thread that is gone */
+void fpu_free(Thread *thread) {
+  if (thread->fpu_cpu != NULL) {
+    __sync_bool_compare_and_swap(&thread->fpu_cpu->fpu_owner, thread, NULL);
+  }
+  if (thread->fpu_state != NULL) {
+    kfree(thread->fpu_state);
+  }
+}
+
+/* Enable the FPU, and SSE where supported, on the calling CPU */
+void fpu_init_cpu() {
+  uint32_t cr0 = read_cr0();
+  cr0 &= ~(CR0_EM | CR0_TS);
+  cr0 |= CR0_MP | CR0_NE;
+  write_cr0(cr0);
+
+  if (has_fxsr) {
+    uint32_t cr4;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    __asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4));
+  }
+  __asm__ __volatile__("fninit");
+  this_cpu()->fpu_owner = NULL;
+}
+
+/* Detect FXSAVE, take over #NM and enable the FPU on the BSP */
+void fpu_init() {
+  uint32_t eax = 1, ebx, ecx, edx;
+  __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+  has_fxsr = (edx >> 24) & 1;
+  isr_install_fixup(NM_ISR_NO, fpu_nm_fixup);
+  fpu_init_cpu();
+}
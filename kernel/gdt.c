@@ -0,0 +1,78 @@
+/*
+
+Global Descriptor Table
+
+The boot sector loads a minimal GDT to enter protected mode. Each CPU then
+switches to a GDT of its own (kept in its Cpu struct), which adds:
+- Code and data segments for user mode (ring 3). All segments are flat, the
+  privilege level is what tells them apart.
+- A Task State Segment, also per CPU, giving the stack the CPU switches to on
+  an interrupt from user mode. The scheduler points it at the kernel stack of
+  the thread it switches to.
+- A per-CPU data segment based at the CPU's Cpu struct. It is loaded into FS,
+  so a CPU finds its own state with a single FS-relative load, no matter which
+  CPU it is.
+- A ring 3 segment whose limit is the CPU's index. It is never loaded, but
+  LSL on it tells user mode which CPU it runs on (see vdso_cpu()).
+- A thread-local data segment, loaded into GS. The scheduler rebases it on
+  the TLS block of every thread it switches to (see tls.c). It starts out
+  flat, until the CPU runs its first thread.
+
+*/
+
+#include "include/gdt.h"
+#include "include/memory.h"
+#include "include/smp.h"
+
+typedef struct {
+  uint16_t limit;
+  uintptr_t base_addr;
+} __attribute__((packed)) GdtDescriptor;
+
+void gdt_set_entry(GdtEntry *gdt, int index, uintptr_t base, uint32_t limit,
+                   uint8_t access, uint8_t granularity) {
+  GdtEntry *entry = &gdt[index];
+  entry->limit_low = limit & 0xFFFF;
+  entry->base_low = base & 0xFFFF;
+  entry->base_mid = (base >> 16) & 0xFF;
+  entry->access = access;
+  entry->granularity = (granularity & 0xF0) | ((limit >> 16) & 0x0F);
+  entry->base_high = base >> 24;
+}
+
+/*
+Build and load the GDT and TSS of cpu, and point FS at it. cpu->stack must be
+set.
+*/
+void gdt_init_cpu(Cpu *cpu) {
+  GdtEntry *gdt = cpu->gdt;
+  mem_set((uint8_t *)gdt, 0, sizeof(cpu->gdt));
+  gdt_set_entry(gdt, GDT_KERNEL_CODE, 0, 0xFFFFF, 0x9A, 0xC0); // Ring 0, x/r
+  gdt_set_entry(gdt, GDT_KERNEL_DATA, 0, 0xFFFFF, 0x92, 0xC0); // Ring 0, r/w
+  gdt_set_entry(gdt, GDT_USER_CODE, 0, 0xFFFFF, 0xFA, 0xC0);   // Ring 3, x/r
+  gdt_set_entry(gdt, GDT_USER_DATA, 0, 0xFFFFF, 0xF2, 0xC0);   // Ring 3, r/w
+  gdt_set_entry(gdt, GDT_PERCPU, (uintptr_t)cpu, sizeof(Cpu) - 1, 0x92,
+                0x40); // Byte granular
+  gdt_set_entry(gdt, GDT_CPU_ID, 0, cpu->id, 0xF2, 0x40); // Ring 3, limit = id
+  // Flat until tls_switch() bases it on the first thread's TLS block
+  gdt_set_entry(gdt, GDT_TLS, 0, 0xFFFFF, 0x92, 0xC0);
+
+  mem_set((uint8_t *)&cpu->tss, 0, sizeof(Tss));
+  cpu->tss.ss0 = KERNEL_DS;
+  cpu->tss.esp0 = cpu->stack;
+  cpu->tss.iomap_base = sizeof(Tss); // No I/O permission bitmap
+  gdt_set_entry(gdt, GDT_TSS, (uintptr_t)&cpu->tss, sizeof(Tss) - 1, 0x89,
+                0x00); // Present, 32-bit available TSS
+
+  GdtDescriptor descriptor = {sizeof(cpu->gdt) - 1, (uintptr_t)gdt};
+  __asm__ __volatile__("lgdt (%0)" : : "r"(&descriptor) : "memory");
+  __asm__ __volatile__("ljmp %0, $1f\n1:" : : "i"(KERNEL_CS));
+  __asm__ __volatile__("mov %0, %%ds\n\t"
+                       "mov %0, %%es\n\t"
+                       "mov %0, %%ss\n\t"
+                       "mov %0, %%gs"
+                       :
+                       : "r"((uint16_t)KERNEL_DS));
+  __asm__ __volatile__("mov %0, %%fs" : : "r"((uint16_t)PERCPU_SEL));
+  __asm__ __volatile__("ltr %0" : : "r"((uint16_t)TSS_SEL));
+}
@@ -0,0 +1,61 @@
+/*
+
+ID allocation
+
+IDs (of processes and threads) are bits in a bitmap, set while the ID is in
+use. A second bitmap has a bit per word of the first, set while that word is
+full, so finding a free ID looks at no more than ID_FULL_WORDS + 2 words,
+however many IDs are in use.
+
+Allocation continues after the last ID handed out and wraps around, so a freed
+ID is only reused once the others have been. Something that remembers an old ID
+is then unlikely to find another task under it.
+
+The allocator has no lock of its own, callers serialize (the scheduler holds
+scheduler.lock).
+
+*/
+
+#include "include/ids.h"
+
+/* Return the first word at or after start (wrapping around) with a free ID.
+ * There must be one. */
+static uint32_t free_word(IdAllocator *ids, uint32_t start) {
+  start %= ID_WORDS;
+  uint32_t i = start / 32;
+  uint32_t not_full = ~ids->full[i] & (~0u << (start % 32));
+  while (not_full == 0) {
+    i = (i + 1) % ID_FULL_WORDS;
+    not_full = ~ids->full[i];
+  }
+  return i * 32 + __builtin_ctz(not_full);
+}
+
+/* Return a free ID and mark it used, or -1 if all are in use */
+int32_t id_alloc(IdAllocator *ids) {
+  if (ids->no_used == MAX_IDS) {
+    return -1;
+  }
+  uint32_t word = ids->next / 32;
+  uint32_t free = ~ids->used[word] & (~0u << (ids->next % 32));
+  if (free == 0) {
+    word = free_word(ids, word + 1);
+    free = ~ids->used[word];
+  }
+  uint32_t id = word * 32 + __builtin_ctz(free);
+
+  ids->used[word] |= 1u << (id % 32);
+  if (ids->used[word] == ~0u) {
+    ids->full[word / 32] |= 1u << (word % 32);
+  }
+  ids->no_used++;
+  ids->next = (id + 1) % MAX_IDS;
+  return id;
+}
+
+void id_free(IdAllocator *ids, uint32_t id) {
+  uint32_t word = id / 32;
+  ids->used[word] &= ~(1u << (id % 32));
+  ids->full[word / 32] &= ~(1u << (word % 32));
+  ids->no_used--;
+}
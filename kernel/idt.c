@@ -37,12 +37,30 @@ void idt_set_gate(uint8_t int_vec_num, uint32_t isr) {
   idt[int_vec_num] = entry;
 }
 
-/* Initialize IDT pointer, and load IDT initialized with zeroes (256
- * descriptors) */
+/* Like idt_set_gate(), but the interrupt may also be raised by user mode */
+void idt_set_user_gate(uint8_t int_vec_num, uint32_t isr) {
+  idt_set_gate(int_vec_num, isr);
+  idt[int_vec_num].flags = 0xEE; // DPL 3
+}
+
+/* Entry stubs of all vectors, generated in int.asm */
+extern uintptr_t vector_table[256];
+
+/*
+Initialize IDT pointer, and load the IDT with the entry stub of every vector,
+which dispatches to the handlers installed on it (see vector.c)
+*/
 void idt_init() {
   idt_descriptor.limit = (sizeof(InterruptGateDescriptor) * 256) - 1;
   idt_descriptor.base_addr = (uintptr_t)&idt;
-  mem_set((unsigned char *)&idt, 0, sizeof(InterruptGateDescriptor) * 256);
+  for (int i = 0; i < 256; i++) {
+    idt_set_gate(i, vector_table[i]);
+  }
+  idt_load();
+}
+
+/* Load the IDT on the calling CPU. All CPUs share the same IDT. */
+void idt_load() {
   __asm__ __volatile__("lidt (%0)" : : "r"((uintptr_t)&idt_descriptor));
 }
 
@@ -64,6 +82,15 @@ void print_cpu_context(CpuContext *context) {
   print(", eax: ");
   print_hex(context->eax);
   print(", ");
+  print("gs: ");
+  print_hex(context->gs);
+  print(", fs: ");
+  print_hex(context->fs);
+  print(", es: ");
+  print_hex(context->es);
+  print(", ds: ");
+  print_hex(context->ds);
+  print(", ");
   print("int_no: ");
   print_hex(context->int_no);
   print(", err_code: ");
@@ -75,4 +102,10 @@ void print_cpu_context(CpuContext *context) {
   print_hex(context->cs);
   print(", eflags: ");
   print_hex(context->eflags);
+  if (context->cs & 3) {
+    print(", useresp: ");
+    print_hex(context->useresp);
+    print(", ss: ");
+    print_hex(context->ss);
+  }
 }
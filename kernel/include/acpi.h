@@ -0,0 +1,33 @@
+#ifndef __ACPI_H
+#define __ACPI_H
+
+#include <stdint.h>
+
+#define MAX_CPUS 8
+#define NO_ISA_IRQS 16
+
+/* Polarity and trigger mode of an interrupt (MADT and MP table encoding) */
+#define INTI_POLARITY_MASK 0x3
+#define INTI_ACTIVE_LOW 0x3
+#define INTI_TRIGGER_MASK 0xC
+#define INTI_LEVEL 0xC
+
+/* What the firmware reports about the machine's processors and interrupts */
+typedef struct {
+  uintptr_t lapic_pa; // Physical address of the local APIC registers
+  uint32_t no_cpus;
+  uint8_t apic_ids[MAX_CPUS]; // Local APIC IDs of the usable CPUs
+
+  uintptr_t ioapic_pa; // I/O APIC the ISA IRQs are wired to, 0 if none
+  uint8_t ioapic_id;
+  uint32_t ioapic_gsi_base;        // Global system interrupt of its input 0
+  uint32_t isa_gsi[NO_ISA_IRQS];   // Where each ISA IRQ is wired to
+  uint16_t isa_flags[NO_ISA_IRQS]; // INTI_*, 0 for the ISA default
+  int imcr; // The machine starts in PIC mode and must be switched (MP only)
+} Platform;
+
+extern Platform platform;
+
+int acpi_init();
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef __ATA_H
+#define __ATA_H
+
+#include <stdint.h>
+
+#define ATA_SECTOR_SIZE 512
+#define ATA_MAX_DRIVES 4    // Master and slave of two channels
+#define ATA_MAX_SECTORS 128 // Per command, longer requests are split
+
+/* What a drive did since boot, see ata.c */
+typedef struct {
+  uint32_t reads;
+  uint32_t writes;
+  uint32_t dma; // Requests whose data the controller moved
+  uint32_t pio; // Requests whose data the CPU moved
+  uint32_t errors;
+  uint64_t sectors_read;
+  uint64_t sectors_written;
+  uint64_t total_ns; // From the requests to their completion
+  uint64_t max_ns;
+} AtaStats;
+
+uint32_t ata_init();
+uint32_t ata_no_drives();
+uint64_t ata_sectors(uint32_t drive);
+int ata_read(uint32_t drive, uint64_t lba, uint32_t count, void *buf);
+int ata_write(uint32_t drive, uint64_t lba, uint32_t count, const void *buf);
+void ata_set_dma(int enabled);
+void print_ata_stats();
+
+#endif
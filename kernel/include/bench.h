@@ -0,0 +1,7 @@
+#ifndef __BENCH_H
+#define __BENCH_H
+
+void bench_syscall();
+void bench_ping_pong();
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef __ELF_H
+#define __ELF_H
+
+#include "process.h"
+#include "spinlock.h"
+#include <stdint.h>
+
+#define ELF_MAX_SEGMENTS 8
+
+/* ELF32 file header */
+typedef struct {
+  uint8_t ident[16]; // Magic, class, byte order, version
+  uint16_t type;
+  uint16_t machine;
+  uint32_t version;
+  uint32_t entry;
+  uint32_t phoff; // File offset of the program headers
+  uint32_t shoff;
+  uint32_t flags;
+  uint16_t ehsize;
+  uint16_t phentsize;
+  uint16_t phnum;
+  uint16_t shentsize;
+  uint16_t shnum;
+  uint16_t shstrndx;
+} __attribute__((packed)) ElfHeader;
+
+/* ELF32 program header, describing a segment */
+typedef struct {
+  uint32_t type;
+  uint32_t offset; // File offset of the segment's data
+  uint32_t vaddr;
+  uint32_t paddr;
+  uint32_t filesz; // Bytes in the file, the rest up to memsz is zeroed (.bss)
+  uint32_t memsz;
+  uint32_t flags;
+  uint32_t align;
+} __attribute__((packed)) ElfProgramHeader;
+
+#define ELF_PT_LOAD 1
+#define ELF_PF_W (1 << 1)
+
+/* A PT_LOAD segment, the page-aligned VA range [start, end) */
+typedef struct {
+  uintptr_t start;
+  uintptr_t end;
+  uintptr_t vaddr;   // Where the segment's data starts
+  uint32_t offset;   // File offset of vaddr
+  uint32_t filesz;   // Bytes of data at vaddr, the rest is zeroed
+  int writable;      // Private pages, else shared by all processes
+  uintptr_t *frames; // Shared frames by page, 0 until loaded (read-only only)
+} ElfSegment;
+
+/* A program, whose pages are loaded as processes running it touch them */
+typedef struct ElfImage {
+  const uint8_t *data;
+  uint32_t size;
+  uintptr_t entry;
+  uint32_t no_segments;
+  ElfSegment segments[ELF_MAX_SEGMENTS];
+  Spinlock lock;         // Protects the fields below and loading pages
+  uint32_t processes;    // Running the image, it stays open while any are
+  uint32_t pages_read;   // Pages filled from the image (or zeroed)
+  uint32_t pages_reused; // Shared pages some other process loaded first
+} ElfImage;
+
+void elf_init();
+ElfImage *elf_open(const uint8_t *data, uint32_t size);
+int elf_close(ElfImage *image);
+Process *elf_exec(ElfImage *image, uintptr_t arg);
+void elf_exit(Process *process);
+void elf_fault_in(uintptr_t va, uint32_t no_bytes);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef __FIBER_H
+#define __FIBER_H
+
+#include <stdint.h>
+
+typedef enum {
+  FIBER_READY,
+  FIBER_RUNNING,
+  FIBER_WAITING, // In fiber_join()
+  FIBER_DONE
+} FiberStatus;
+
+/* A cooperative task, run by the thread that created it */
+typedef struct Fiber {
+  FiberStatus status;
+  void (*function)(uintptr_t);
+  uintptr_t arg;
+  uintptr_t sp;         // Saved stack pointer, on the host's run stack
+  uint8_t *saved;       // Used part of its stack while switched out
+  uint32_t no_saved;    // Bytes of it
+  uint32_t saved_class; // Pool size class of saved
+  struct Fiber *next;   // Next in the ready queue
+  struct Fiber *joiner; // Fiber waiting for it to finish
+} Fiber;
+
+Fiber *fiber_create(void (*function)(uintptr_t), uintptr_t arg);
+void fiber_yield();
+int fiber_join(Fiber *fiber);
+
+#endif
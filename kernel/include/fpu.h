@@ -0,0 +1,15 @@
+#ifndef __FPU_H
+#define __FPU_H
+
+#include "process.h"
+
+#define FPU_STATE_SIZE 512 // FXSAVE area
+
+struct Cpu;
+
+void fpu_init();
+void fpu_init_cpu();
+void fpu_switch(struct Cpu *cpu, Thread *prev, Thread *next);
+void fpu_free(Thread *thread);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef __GDT_H
+#define __GDT_H
+
+#include <stdint.h>
+
+/*
+GDT layout, identical on every CPU. The user segments directly follow the
+kernel's: SYSENTER/SYSEXIT derive all four selectors from the kernel code
+selector, so they have to be in this order.
+*/
+#define GDT_KERNEL_CODE 1
+#define GDT_KERNEL_DATA 2
+#define GDT_USER_CODE 3
+#define GDT_USER_DATA 4
+#define GDT_TSS 5
+#define GDT_PERCPU 6 // Based at the CPU's Cpu struct, loaded into FS
+#define GDT_CPU_ID 7 // Never loaded, its limit is the CPU's index (for LSL)
+#define GDT_TLS 8    // Based at the running thread's TLS block, loaded into GS
+#define GDT_NO_ENTRIES 9
+
+#define GDT_SEL(index) ((index) << 3)
+#define KERNEL_CS GDT_SEL(GDT_KERNEL_CODE)
+#define KERNEL_DS GDT_SEL(GDT_KERNEL_DATA)
+#define USER_CS (GDT_SEL(GDT_USER_CODE) | 3) // Requested privilege level 3
+#define USER_DS (GDT_SEL(GDT_USER_DATA) | 3)
+#define TSS_SEL GDT_SEL(GDT_TSS)
+#define PERCPU_SEL GDT_SEL(GDT_PERCPU)
+#define CPU_ID_SEL (GDT_SEL(GDT_CPU_ID) | 3)
+#define TLS_SEL GDT_SEL(GDT_TLS)
+
+typedef struct {
+  uint16_t limit_low;
+  uint16_t base_low;
+  uint8_t base_mid;
+  /* Present (bit 7), DPL (bits 5-6), code/data or system (bit 4), type (bits
+  0-3) */
+  uint8_t access;
+  /* Granularity (bit 7, limit in 4KiB units), 32-bit (bit 6), bits 16-19 of
+  the limit (bits 0-3) */
+  uint8_t granularity;
+  uint8_t base_high;
+} __attribute__((packed)) GdtEntry;
+
+/*
+Task State Segment. Only used to find the kernel stack (ss0:esp0) when an
+interrupt arrives from a less privileged ring, hardware task switching is not
+used.
+*/
+typedef struct {
+  uint32_t prev_tss;
+  uint32_t esp0, ss0;
+  uint32_t esp1, ss1;
+  uint32_t esp2, ss2;
+  uint32_t cr3, eip, eflags;
+  uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+  uint32_t es, cs, ss, ds, fs, gs;
+  uint32_t ldt;
+  uint16_t trap;
+  uint16_t iomap_base;
+} __attribute__((packed)) Tss;
+
+struct Cpu;
+
+void gdt_init_cpu(struct Cpu *cpu);
+void gdt_set_entry(GdtEntry *gdt, int index, uintptr_t base, uint32_t limit,
+                   uint8_t access, uint8_t granularity);
+
+#endif
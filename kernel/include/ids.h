@@ -0,0 +1,21 @@
+#ifndef __IDS_H
+#define __IDS_H
+
+#include <stdint.h>
+
+#define MAX_IDS 32768 // IDs are 0 to MAX_IDS - 1
+#define ID_WORDS (MAX_IDS / 32)
+#define ID_FULL_WORDS (ID_WORDS / 32)
+
+/* A set of IDs. A zeroed IdAllocator has every ID free. */
+typedef struct {
+  uint32_t used[ID_WORDS];      // Bit set = ID in use
+  uint32_t full[ID_FULL_WORDS]; // Bit set = that word of used is all ones
+  uint32_t next;                // Where the search for a free ID starts
+  uint32_t no_used;
+} IdAllocator;
+
+int32_t id_alloc(IdAllocator *ids);
+void id_free(IdAllocator *ids, uint32_t id);
+
+#endif
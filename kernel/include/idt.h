@@ -4,7 +4,9 @@
 #include <stdint.h>
 
 void idt_init();
+void idt_load();
 void idt_set_gate(uint8_t int_vec_num, uint32_t isr);
+void idt_set_user_gate(uint8_t int_vec_num, uint32_t isr);
 
 /*
 When an interrupt occurs, the custom ISR wrapper pushes the following:
@@ -24,8 +26,10 @@ and the following when crossing rings (like user to kernel)
 */
 typedef struct {
   uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;
+  uint32_t gs, fs, es, ds;
   uint32_t int_no, err_code;
   uint32_t eip, cs, eflags;
+  uint32_t useresp, ss; // Only valid if the interrupt came from user mode
 } CpuContext;
 
 void print_cpu_context(CpuContext *context);
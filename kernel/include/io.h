@@ -5,5 +5,11 @@
 
 uint8_t port_byte_in(uint16_t port);
 void port_byte_out(uint16_t port, uint8_t data);
+uint16_t port_word_in(uint16_t port);
+void port_word_out(uint16_t port, uint16_t data);
+uint32_t port_long_in(uint16_t port);
+void port_long_out(uint16_t port, uint32_t data);
+void port_words_in(uint16_t port, uint16_t *dest, uint32_t count);
+void port_words_out(uint16_t port, const uint16_t *src, uint32_t count);
 
 #endif
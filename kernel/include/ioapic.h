@@ -0,0 +1,15 @@
+#ifndef __IOAPIC_H
+#define __IOAPIC_H
+
+#include <stdint.h>
+
+/* Redirection entry flags, see ioapic_route() */
+#define IOAPIC_ACTIVE_LOW 0x2000
+#define IOAPIC_LEVEL 0x8000
+
+void ioapic_install(uintptr_t ioapic_pa, uint32_t gsi_base);
+int ioapic_route(uint32_t gsi, uint8_t vector, uint32_t flags,
+                 uint8_t apic_id);
+int ioapic_mask(uint32_t gsi);
+
+#endif
@@ -2,8 +2,38 @@
 #define __IRQ_H
 
 #include "idt.h"
+#include "vector.h"
+#include <stdint.h>
+
+/* Time interrupts-off sections unless built with -DTRACE_IRQS_OFF=0 */
+#ifndef TRACE_IRQS_OFF
+#define TRACE_IRQS_OFF 1
+#endif
+
+#define IRQ_BASE_VECTOR 32  // Vector of IRQ 0, IRQs 0-15 follow
+#define IRQ0_APIC_VECTOR 48 // IRQ 0 through the I/O APIC, see irq.c
+#define EFLAGS_IF (1 << 9)   // Interrupts enabled
+#define IRQS_OFF_NO_SITES 8
+
+/* Where a CPU had interrupts disabled, and for how long (see irq.c) */
+typedef struct {
+  uintptr_t site; // Caller of irq_save(), or the IRQ handler
+  uint32_t count;
+  uint64_t max_cycles;
+  uint64_t total_cycles;
+} IrqsOffSite;
 
 void irqs_init();
-void irq_install_handler(int irq_no, void (*handler)(CpuContext *context));
+int irq_install_handler(int irq_no, VectorHandler handler);
+int irqs_use_ioapic(uint8_t apic_id);
+int irq_set_cpu(int irq_no, uint32_t cpu_id);
+
+uint32_t irq_save();
+uint32_t irq_save_from(uintptr_t site);
+void irq_restore(uint32_t flags);
+int irqs_enabled();
+void irqs_off_begin(uintptr_t site);
+void irqs_off_end();
+void print_irqs_off();
 
 #endif
@@ -5,5 +5,7 @@
 
 void isrs_init();
 void isr_install_handler(int isr_no, void (*handler)(CpuContext *context));
+void isr_install_fixup(int isr_no, int (*fixup)(CpuContext *context));
+void isr_fault_handler(CpuContext *context);
 
 #endif
@@ -0,0 +1,19 @@
+#ifndef __LAPIC_H
+#define __LAPIC_H
+
+#include <stdint.h>
+
+#define LAPIC_TIMER_VECTOR 64
+#define RESCHED_VECTOR 65 // IPI asking another CPU to run its scheduler
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+void lapic_install(uintptr_t lapic_pa);
+void lapic_init();
+uint8_t lapic_id();
+void lapic_eoi();
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector);
+void lapic_send_init(uint8_t apic_id);
+void lapic_send_startup(uint8_t apic_id, uintptr_t entry_pa);
+void lapic_timer_start();
+
+#endif
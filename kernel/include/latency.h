@@ -0,0 +1,34 @@
+#ifndef __LATENCY_H
+#define __LATENCY_H
+
+#include <stdint.h>
+
+/* Trace interrupt latencies unless built with -DTRACE_LATENCY=0 */
+#ifndef TRACE_LATENCY
+#define TRACE_LATENCY 1
+#endif
+
+#define LATENCY_NO_VECTORS 16 // Vectors traced, the first ones to be recorded
+#define LATENCY_NO_BUCKETS 32 // Powers of two of TSC cycles
+
+/* What is timed for each interrupt, see latency.c */
+typedef enum {
+  LAT_ENTRY,   // Stub entry to the first handler
+  LAT_HANDLER, // Running the handlers
+  LAT_WAKEUP,  // Stub entry to a thread woken by the handlers running
+  LAT_NO_KINDS
+} LatencyKind;
+
+typedef struct {
+  uint32_t count;
+  uint32_t min; // In TSC cycles, like the rest
+  uint32_t max;
+  uint64_t total;
+  uint32_t buckets[LATENCY_NO_BUCKETS]; // Bucket i counts [2^i, 2^(i+1))
+} LatencyHist;
+
+void latency_record(uint32_t vector, LatencyKind kind, uint64_t cycles);
+void latency_reset();
+void print_latency();
+
+#endif
@@ -5,5 +5,6 @@
 
 void mem_cpy(uint8_t *source, uint8_t *dest, uint32_t no_bytes);
 void mem_set(uint8_t *dest, uint8_t val, uint32_t no_bytes);
+int mem_cmp(const uint8_t *a, const uint8_t *b, uint32_t no_bytes);
 
 #endif
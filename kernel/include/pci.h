@@ -0,0 +1,44 @@
+#ifndef __PCI_H
+#define __PCI_H
+
+#include <stdint.h>
+
+/* Configuration space registers, see pci.c */
+#define PCI_VENDOR_ID 0x00   // Device ID in the high half
+#define PCI_COMMAND 0x04     // Status in the high half
+#define PCI_CLASS 0x08       // Class, subclass, prog IF and revision
+#define PCI_HEADER_TYPE 0x0C // Bits 16-23
+#define PCI_BAR0 0x10        // Base address registers 0-5 follow
+#define PCI_INTERRUPT 0x3C   // Interrupt line in the low byte
+
+#define PCI_COMMAND_IO 0x1         // Respond to its I/O ports
+#define PCI_COMMAND_MEMORY 0x2     // Respond to its memory ranges
+#define PCI_COMMAND_BUS_MASTER 0x4 // Allow it to do DMA
+#define PCI_BAR_IO 0x1             // The BAR holds an I/O port base
+
+#define PCI_MAX_DEVICES 32 // Functions kept by pci_init()
+
+/* A function of a device on the PCI bus */
+typedef struct {
+  uint8_t bus;
+  uint8_t slot;
+  uint8_t func;
+  uint16_t vendor_id;
+  uint16_t device_id;
+  uint8_t class;
+  uint8_t subclass;
+  uint8_t prog_if;
+  uint8_t irq; // Interrupt line the firmware assigned, 0xFF if none
+} PciDevice;
+
+uint32_t pci_read(const PciDevice *device, uint8_t offset);
+void pci_write(const PciDevice *device, uint8_t offset, uint32_t value);
+uint32_t pci_init();
+int pci_find_class(uint8_t class, uint8_t subclass, PciDevice *device);
+int pci_find_device(uint16_t vendor_id, uint16_t device_id,
+                    PciDevice *device);
+uint32_t pci_bar(const PciDevice *device, int bar);
+void pci_enable(const PciDevice *device, uint32_t command);
+void print_pci();
+
+#endif
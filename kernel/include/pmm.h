@@ -5,6 +5,8 @@
 
 void pmm_init();
 uintptr_t alloc_frame();
+uintptr_t alloc_frames(uint32_t no_frames);
 void free_frame(uintptr_t phys_addr);
+uint32_t pmm_frames_used();
 
 #endif
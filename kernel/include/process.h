@@ -2,37 +2,128 @@
 #define __PROCESS_H
 
 #include "idt.h"
+#include "spinlock.h"
 #include "vmm.h"
 #include <stdint.h>
 
-typedef enum { READY, RUNNING, DEAD } ThreadStatus;
+typedef enum { READY, RUNNING, BLOCKED, DEAD } ThreadStatus;
 
 typedef struct Process Process;
+struct Cpu;
+struct ElfImage;
+
+#define RT_UTIL_ONE 1000000 // All of a CPU, in parts per million
+
+/* A periodic real-time thread, see sched_set_periodic() */
+typedef struct {
+  uint64_t period;    // 0 for best-effort threads
+  uint64_t budget;    // Run time allowed per period
+  uint64_t release;   // When the current job was released
+  uint64_t deadline;  // When the current job must be done by
+  uint64_t job_run;   // The thread's run_ns when the current job started
+  uint32_t util;      // budget / period, in RT_UTIL_ONE units
+  uint32_t throttled; // Set once the job used its budget, until the next one
+  uint32_t misses;    // Jobs that completed after their deadline
+  uint32_t overruns;  // Jobs that used up their budget
+  struct Cpu *cpu;    // CPU the thread was admitted on
+} RtParams;
 
 typedef struct Thread {
-  uint8_t tid;
+  uint32_t tid;
   ThreadStatus status;
   Process *process;
-  struct Thread *next;
-  CpuContext *context;
+  struct Thread *next;       // Next thread of the same process
+  struct Thread *prev;       // Previous thread of the same process
+  struct Thread *queue_next; // Next thread in the run queue or a wait queue
+  struct Thread *hash_next;  // Next thread in the same tid hash bucket
+  struct Cpu *cpu;           // CPU the thread runs or last ran on
+  uintptr_t k_esp; // Saved kernel stack pointer while switched out (swtch())
   uintptr_t k_stack;
+  uint8_t *fpu_state;  // FPU/SSE save area, NULL until first used (fpu.c)
+  struct Cpu *fpu_cpu; // CPU the thread last used the FPU on
+  uintptr_t tls;       // Thread pointer of its TLS block, the GS base (tls.c)
+
+  /* Accounting, in clock_monotonic() nanoseconds */
+  uint64_t run_ns;         // Time spent running
+  uint64_t wait_ns;        // Time spent READY in a run queue
+  uint64_t last_switch;    // When it last started running or was queued
+  uint32_t nr_voluntary;   // Switches away because it blocked or yielded
+  uint32_t nr_involuntary; // Switches away because it was preempted
+
+  /* Interrupt that woke it, until it runs (latency.c) */
+  uint32_t wake_vector; // 0 if none
+  uint64_t wake_tsc;    // When the interrupt entered its stub
+
+  RtParams rt;
 } Thread;
 
+/* A copy of a thread's accounting, taken by sched_snapshot() */
+typedef struct {
+  Thread *thread; // Tells threads apart, may have exited since
+  uint32_t pid;
+  uint32_t tid;
+  ThreadStatus status;
+  uint32_t cpu;
+  uint64_t run_ns; // Includes the current slice of running threads
+  uint64_t wait_ns;
+  uint32_t nr_voluntary;
+  uint32_t nr_involuntary;
+} ThreadStats;
+
+/*
+READY threads of one CPU: real-time threads ordered by deadline, and a FIFO of
+best-effort threads
+*/
+typedef struct {
+  Spinlock lock;
+  Thread *head;
+  Thread *tail;
+  uint32_t nr_ready; // Best-effort threads
+  Thread *rt_head;   // Earliest deadline first
+  uint32_t nr_rt;
+} RunQueue;
+
 /* A Process Control Block (PCB) */
 typedef struct Process {
-  uint8_t pid;
+  uint32_t pid;
   ProcessPd *pd;
   struct Process *next;
+  struct Process *prev;
+  struct Process *hash_next; // Next process in the same pid hash bucket
   Thread *head_thread;
-  Thread *curr_running_thread;
+  Thread *tail_thread;
+  uintptr_t user_stack_top; // Where the next user thread's stack goes
+  struct ElfImage *image;   // Program it runs, NULL for kernel code (elf.c)
+  int user_space; // Has user threads, its PD must be loaded for its threads
 } Process;
 
-void schedule(CpuContext *context);
+void sched_init();
+void sched_init_ap();
+void schedule();
+int schedule_pending();
 Process *create_process();
+void delete_process(Process *process);
 Thread *create_thread(Process *process, void (*function)(uintptr_t),
                       uintptr_t arg);
+Thread *create_user_thread(Process *process, void (*function)(uintptr_t),
+                           uintptr_t arg);
 void thread_exit();
 
+Thread *thread_current();
+Process *find_process(uint32_t pid);
+Thread *find_thread(uint32_t tid);
+void thread_block();
+void thread_wake(Thread *thread);
+void yield();
+void preempt_disable();
+void preempt_enable();
+
+int sched_set_periodic(uint64_t period_ns, uint64_t budget_ns);
+void sched_clear_periodic();
+int sched_wait_period();
+
+uint32_t sched_snapshot(ThreadStats *stats, uint32_t max);
+
 void print_process(Process *process);
 void print_thread(Thread *thread);
 
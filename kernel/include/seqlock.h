@@ -0,0 +1,51 @@
+#ifndef __SEQLOCK_H
+#define __SEQLOCK_H
+
+#include <stdint.h>
+
+/*
+A sequence counter for data with a single writer at a time and readers that
+must never block it, e.g. readers in user mode. The writer makes the count odd
+while it updates the data. Readers retry if the count was odd or changed while
+they copied the data. Writers must be serialized by the caller (a spinlock, or
+only ever writing from one CPU).
+
+Always inlined, so user code linked into .utext can read without calling into
+the kernel. x86 does not reorder stores with stores or loads with loads, so
+compiler barriers are enough.
+*/
+typedef struct {
+  volatile uint32_t seq;
+} SeqCount;
+
+#define SEQ_INLINE static inline __attribute__((always_inline))
+
+SEQ_INLINE void seq_barrier() { __asm__ __volatile__("" : : : "memory"); }
+
+SEQ_INLINE void seq_write_begin(SeqCount *s) {
+  s->seq++;
+  seq_barrier();
+}
+
+SEQ_INLINE void seq_write_end(SeqCount *s) {
+  seq_barrier();
+  s->seq++;
+}
+
+/* Wait out a writer, return the count to pass to seq_read_retry() */
+SEQ_INLINE uint32_t seq_read_begin(const SeqCount *s) {
+  uint32_t seq;
+  while ((seq = s->seq) & 1) {
+    __asm__ __volatile__("pause");
+  }
+  seq_barrier();
+  return seq;
+}
+
+/* Return 1 if the data read since seq_read_begin() may be torn */
+SEQ_INLINE int seq_read_retry(const SeqCount *s, uint32_t seq) {
+  seq_barrier();
+  return s->seq != seq;
+}
+
+#endif
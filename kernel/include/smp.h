@@ -0,0 +1,58 @@
+#ifndef __SMP_H
+#define __SMP_H
+
+#include "acpi.h"
+#include "gdt.h"
+#include "irq.h"
+#include "process.h"
+#include "vector.h"
+#include <stdint.h>
+
+#define IRQ_STACK_SIZE (4096 * 2) // See vector.c
+
+/* Per-CPU state, reached through the FS segment of the CPU (see this_cpu()) */
+typedef struct Cpu {
+  struct Cpu *self; // Must stay first
+  uint32_t id;      // Index into cpus
+  uint8_t apic_id;
+  volatile uint32_t online;
+  uintptr_t stack; // Top of the stack the CPU booted on (its idle thread's)
+  GdtEntry gdt[GDT_NO_ENTRIES];
+  Tss tss;
+
+  RunQueue rq;
+  Thread *curr_thread;
+  Thread *idle_thread; // Runs when no thread is READY, never queued
+  Thread *fpu_owner;   // Whose state the FPU registers hold, see fpu.c
+  uint32_t steals;     // Threads taken from other CPUs' run queues
+  uint32_t switches;   // Context switches, published in the vDSO page
+  uint32_t rt_util;    // Admitted real-time load, in RT_UTIL_ONE units
+
+  volatile uint32_t need_resched; // Switch threads at the next chance
+  uint32_t preempt_count;         // Preemption is deferred while nonzero
+
+  /* Lazy TLB, see switch_pd() in process.c */
+  ProcessPd *volatile active_pd; // Loaded PD, maybe borrowed by a kernel thread
+  uint32_t cr3_loads;
+  uint32_t cr3_skips; // Process changes that kept the loaded PD
+
+  /* Interrupts-off sections, see irq.c */
+  uintptr_t irqs_off_site; // Where the current one started, 0 if none
+  uint64_t irqs_off_since;
+  IrqsOffSite irqs_off[IRQS_OFF_NO_SITES];
+
+  VectorStats vectors[NO_VECTORS]; // Interrupts taken, see vector.c
+  uint32_t irq_vector;             // Whose handlers run, 0 if none (latency.c)
+  uint64_t irq_entry_tsc;
+  uintptr_t irq_stack; // Top of the stack interrupt handlers run on
+  uint32_t irq_depth;  // Interrupts being handled, nested ones included
+} Cpu;
+
+extern Cpu cpus[MAX_CPUS];
+extern uint32_t no_cpus;
+
+Cpu *this_cpu();
+void cpu_init_bsp();
+void smp_init();
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef __SPINLOCK_H
+#define __SPINLOCK_H
+
+#include <stdint.h>
+
+/* A zeroed Spinlock is unlocked */
+typedef struct {
+  volatile uint32_t locked;
+} Spinlock;
+
+void spin_init(Spinlock *lock);
+void spin_lock(Spinlock *lock);
+int spin_trylock(Spinlock *lock);
+void spin_unlock(Spinlock *lock);
+uint32_t spin_lock_irqsave(Spinlock *lock);
+void spin_unlock_irqrestore(Spinlock *lock, uint32_t flags);
+
+#endif
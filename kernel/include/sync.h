@@ -0,0 +1,58 @@
+#ifndef __SYNC_H
+#define __SYNC_H
+
+#include "process.h"
+#include "spinlock.h"
+#include <stdint.h>
+
+/* FIFO of blocked threads. A zeroed WaitQueue is empty. */
+typedef struct {
+  Spinlock lock;
+  Thread *head;
+  Thread *tail;
+} WaitQueue;
+
+typedef struct {
+  Thread *owner; // NULL when unlocked
+  WaitQueue waiters;
+  uint32_t acquisitions;
+  uint32_t contentions; // Acquisitions that had to wait
+} Mutex;
+
+typedef struct {
+  int32_t count;
+  WaitQueue waiters;
+  uint32_t downs;
+  uint32_t contentions; // Downs that had to wait
+} Semaphore;
+
+typedef struct {
+  WaitQueue waiters;
+  uint32_t waits;
+  uint32_t signals;
+} CondVar;
+
+extern __thread uint32_t wait_queue_sleeps; // Of the running thread
+
+void wait_queue_init(WaitQueue *wq);
+void wait_queue_sleep(WaitQueue *wq);
+void wait_queue_sleep_locked(WaitQueue *wq, uint32_t flags);
+int wait_queue_wake_one(WaitQueue *wq);
+int wait_queue_wake_one_locked(WaitQueue *wq);
+int wait_queue_wake_all(WaitQueue *wq);
+
+void mutex_init(Mutex *mutex);
+void mutex_lock(Mutex *mutex);
+int mutex_trylock(Mutex *mutex);
+void mutex_unlock(Mutex *mutex);
+
+void semaphore_init(Semaphore *sem, int32_t count);
+void semaphore_down(Semaphore *sem);
+void semaphore_up(Semaphore *sem);
+
+void condvar_init(CondVar *cv);
+void condvar_wait(CondVar *cv, Mutex *mutex);
+void condvar_signal(CondVar *cv);
+void condvar_broadcast(CondVar *cv);
+
+#endif
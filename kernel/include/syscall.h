@@ -0,0 +1,84 @@
+#ifndef __SYSCALL_H
+#define __SYSCALL_H
+
+#include <stdint.h>
+
+#define SYSCALL_INT_NO 0x80
+
+/* System call numbers, passed in eax */
+#define SYS_EXIT 0
+#define SYS_WRITE 1 // (const char *buf, uint32_t len)
+#define SYS_YIELD 2
+#define SYS_SLEEP 3 // (uint32_t ms)
+#define SYS_GETPID 4
+#define SYS_GETTID 5
+#define SYS_NULL 6 // Does nothing, for measuring the cost of entry and exit
+#define NO_SYSCALLS 7
+
+void syscall_init();
+void syscall_init_cpu();
+
+/*
+
+User side
+
+User programs are either ELF executables (see elf.c) or functions linked into
+the kernel image. The latter must place their code and constants in the
+user-accessible .utext section. Both can only reach the kernel through these
+wrappers (always inlined, so they end up in .utext too). .utext is shared by
+all processes, so user mode may not write it: writable data goes on the
+thread's stack, or in pages mapped into its own process.
+
+syscallN() goes through int 0x80. fast_syscallN() uses SYSENTER, which is
+cheaper but only passes three arguments (ebx, esi, edi), as ecx and edx carry
+the user stack pointer and return address. It needs CPU support, see
+vdso_has_sysenter().
+
+*/
+
+#define USER_CODE __attribute__((section(".utext")))
+#define USER_RODATA __attribute__((section(".urodata")))
+
+extern int has_sysenter; // For the kernel, user mode reads the vDSO copy
+
+static inline __attribute__((always_inline)) uint32_t
+syscall0(uint32_t no) {
+  uint32_t ret;
+  __asm__ __volatile__("int $0x80" : "=a"(ret) : "a"(no) : "memory");
+  return ret;
+}
+
+static inline __attribute__((always_inline)) uint32_t
+syscall1(uint32_t no, uint32_t arg1) {
+  uint32_t ret;
+  __asm__ __volatile__("int $0x80"
+                       : "=a"(ret)
+                       : "a"(no), "b"(arg1)
+                       : "memory");
+  return ret;
+}
+
+static inline __attribute__((always_inline)) uint32_t
+syscall2(uint32_t no, uint32_t arg1, uint32_t arg2) {
+  uint32_t ret;
+  __asm__ __volatile__("int $0x80"
+                       : "=a"(ret)
+                       : "a"(no), "b"(arg1), "c"(arg2)
+                       : "memory");
+  return ret;
+}
+
+static inline __attribute__((always_inline)) uint32_t
+fast_syscall3(uint32_t no, uint32_t arg1, uint32_t arg2, uint32_t arg3) {
+  uint32_t ret;
+  __asm__ __volatile__("mov %%esp, %%ecx\n\t"
+                       "mov $1f, %%edx\n\t"
+                       "sysenter\n"
+                       "1:"
+                       : "=a"(ret)
+                       : "a"(no), "b"(arg1), "S"(arg2), "D"(arg3)
+                       : "ecx", "edx", "memory");
+  return ret;
+}
+
+#endif
@@ -3,5 +3,24 @@
 
 void test_scheduling();
 void test_vm();
+void test_sync();
+void test_smp();
+void test_user();
+void test_vdso();
+void test_fpu();
+void test_exit();
+void test_edf();
+void test_tls();
+void test_work();
+void test_ids();
+void test_elf();
+void test_fibers();
+void test_preempt();
+void test_lazy_tlb();
+void test_vectors();
+void test_latency();
+void test_nested_irqs();
+void test_ata();
+void test_virtio_blk();
 
 #endif
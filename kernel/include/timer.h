@@ -1,7 +1,38 @@
 #ifndef __TIMER_H
 #define __TIMER_H
 
+#include <stdint.h>
+
+/* Timer ticks per second, override with -DHZ=<rate> */
+#ifndef HZ
+#define HZ 100
+#endif
+
+/* Run in tickless mode (one-shot PIT) unless built with -DTICKLESS=0 */
+#ifndef TICKLESS
+#define TICKLESS 1
+#endif
+
+/* A callback to run from the timer IRQ once the tick counter reaches expires */
+typedef struct Timer {
+  uint64_t expires;
+  void (*fn)(uintptr_t arg);
+  uintptr_t arg;
+  struct Timer *next;
+} Timer;
+
 void timer_install();
-void timer_wait(double secs);
+void timer_wait_ms(uint32_t ms);
+void timer_wait_until(uint64_t ns);
+void timer_add(Timer *timer);
+void timer_del(Timer *timer);
+void timer_update();
+
+uint64_t rdtsc();
+uint64_t tsc_to_ns(uint64_t cycles);
+uint64_t clock_monotonic();
+void timer_delay_us(uint32_t us);
+
+extern uint32_t tsc_khz;
 
 #endif
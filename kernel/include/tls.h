@@ -0,0 +1,28 @@
+#ifndef __TLS_H
+#define __TLS_H
+
+#include "process.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Thread control block, at the thread pointer (the GS base) */
+typedef struct Tcb {
+  struct Tcb *self; // Must stay first, the compiler reads it from %gs:0
+  Thread *thread;   // Owner of the block, see thread_current()
+  void *block;      // Allocation the block was carved from
+} Tcb;
+
+struct Cpu;
+
+uintptr_t tls_alloc(Thread *thread);
+void tls_free(Thread *thread);
+void tls_switch(struct Cpu *cpu, Thread *next);
+
+/* The thread that owns the running TLS block, one GS-relative load */
+static inline Thread *tls_thread() {
+  Thread *thread;
+  __asm__("mov %%gs:%c1, %0" : "=r"(thread) : "i"(offsetof(Tcb, thread)));
+  return thread;
+}
+
+#endif
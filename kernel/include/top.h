@@ -0,0 +1,6 @@
+#ifndef __TOP_H
+#define __TOP_H
+
+void top_install();
+
+#endif
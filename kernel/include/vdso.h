@@ -0,0 +1,106 @@
+#ifndef __VDSO_H
+#define __VDSO_H
+
+#include "acpi.h"
+#include "gdt.h"
+#include "seqlock.h"
+#include <stdint.h>
+
+/* Where the page is mapped (read-only) in every process, below the kernel */
+#define VDSO_VA 0xBFFFF000
+
+/* Scheduler counters of one CPU, written under its run queue lock */
+typedef struct {
+  SeqCount seq;
+  uint32_t switches; // Context switches
+  uint32_t nr_ready; // Threads waiting in its run queue
+} VdsoCpu;
+
+/*
+The kernel's side of the clock, written by the timer IRQ under timer_lock. The
+time in ns is ticks * ns_per_tick or, if tsc_khz is not 0,
+((rdtsc() - tsc_base) * tsc_mult) >> tsc_shift.
+*/
+typedef struct {
+  SeqCount seq;
+  uint64_t ticks;
+  uint32_t ns_per_tick;
+  uint32_t tsc_khz;
+  uint32_t tsc_mult;
+  uint32_t tsc_shift;
+  uint64_t tsc_base;
+} VdsoClock;
+
+typedef struct {
+  VdsoClock clock;
+  VdsoCpu cpus[MAX_CPUS];
+  uint32_t has_sysenter; // Set once at boot, see syscall.h
+} VdsoData;
+
+uintptr_t vdso_frame();
+void vdso_set_clocksource(uint32_t ns_per_tick, uint32_t tsc_khz,
+                          uint32_t tsc_mult, uint32_t tsc_shift,
+                          uint64_t tsc_base);
+void vdso_set_ticks(uint64_t ticks);
+void vdso_set_cpu(uint32_t cpu, uint32_t switches, uint32_t nr_ready);
+void vdso_set_sysenter(uint32_t has_sysenter);
+
+/*
+
+Reading from user mode, without a system call. Always inlined so they end up
+in .utext with their callers.
+
+*/
+
+#define VDSO_INLINE static inline __attribute__((always_inline))
+#define VDSO ((const VdsoData *)VDSO_VA)
+
+/* Nanoseconds since boot, like clock_monotonic() */
+VDSO_INLINE uint64_t vdso_clock_ns() {
+  const VdsoClock *clock = &VDSO->clock;
+  uint32_t seq, lo, hi;
+  uint64_t ns;
+  do {
+    seq = seq_read_begin(&clock->seq);
+    if (clock->tsc_khz == 0) {
+      ns = clock->ticks * clock->ns_per_tick;
+      continue;
+    }
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    uint64_t cycles = ((uint64_t)hi << 32 | lo) - clock->tsc_base;
+    hi = cycles >> 32;
+    lo = cycles;
+    ns = (((uint64_t)hi * clock->tsc_mult) << (32 - clock->tsc_shift)) +
+         (((uint64_t)lo * clock->tsc_mult) >> clock->tsc_shift);
+  } while (seq_read_retry(&clock->seq, seq));
+  return ns;
+}
+
+/*
+Index of the CPU the caller is running on. Read with LSL from a descriptor
+whose limit is the CPU's index (see gdt.c), which user mode may do. The thread
+may move to another CPU right after.
+*/
+VDSO_INLINE uint32_t vdso_cpu() {
+  uint32_t cpu;
+  __asm__ __volatile__("lsl %1, %0" : "=r"(cpu) : "r"((uint32_t)CPU_ID_SEL));
+  return cpu;
+}
+
+/* Whether fast_syscallN() may be used */
+VDSO_INLINE uint32_t vdso_has_sysenter() { return VDSO->has_sysenter; }
+
+VDSO_INLINE VdsoCpu vdso_cpu_stats(uint32_t cpu) {
+  const VdsoCpu *stats = &VDSO->cpus[cpu];
+  VdsoCpu copy;
+  uint32_t seq;
+  do {
+    seq = seq_read_begin(&stats->seq);
+    copy.switches = stats->switches;
+    copy.nr_ready = stats->nr_ready;
+  } while (seq_read_retry(&stats->seq, seq));
+  copy.seq.seq = seq;
+  return copy;
+}
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef __VECTOR_H
+#define __VECTOR_H
+
+#include "idt.h"
+#include <stdint.h>
+
+#define NO_VECTORS 256
+#define NO_EXCEPTIONS 32      // Vectors 0-31 are the CPU's exceptions
+#define NO_VECTOR_HANDLERS 64 // Handlers installed on all vectors together
+
+/*
+Handles an interrupt on its vector. Returns 1 if it did: its device raised a
+shared IRQ, or it recovered from an exception (see vector.c).
+*/
+typedef int (*VectorHandler)(CpuContext *context);
+
+/* Acknowledges an interrupt once its handlers ran */
+typedef void (*VectorAck)(uint32_t vector);
+
+/* Interrupts a CPU took on one vector */
+typedef struct {
+  uint32_t count;
+  uint32_t unhandled; // Ones no handler claimed
+  uint64_t cycles;    // Spent in the handlers, see vector_dispatch()
+} VectorStats;
+
+int vector_add_handler(uint32_t vector, VectorHandler handler);
+void vector_set_ack(uint32_t vector, VectorAck ack);
+void vector_move(uint32_t from, uint32_t to);
+void print_vector_stats();
+
+#endif
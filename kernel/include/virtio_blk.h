@@ -0,0 +1,41 @@
+#ifndef __VIRTIO_BLK_H
+#define __VIRTIO_BLK_H
+
+#include <stdint.h>
+
+#define VIRTIO_BLK_SECTOR_SIZE 512
+#define VIRTIO_BLK_MAX_SECTORS 128 // Per request
+#define VIRTIO_BLK_PENDING 1       // Status of a request until it completes
+
+/* A request to the disk, queued with virtio_blk_submit() */
+typedef struct {
+  uint64_t sector;
+  uint32_t count; // Sectors, at most VIRTIO_BLK_MAX_SECTORS
+  void *buf;
+  int write;
+  volatile int status; // VIRTIO_BLK_PENDING, then 0, or -1 on an error
+  uint64_t submitted;  // clock_monotonic() when it was queued
+} VirtioBlkReq;
+
+/* What the disk did since boot, see virtio_blk.c */
+typedef struct {
+  uint32_t requests;
+  uint64_t sectors;
+  uint32_t errors;
+  uint32_t notifies;   // Times the device was told about new requests
+  uint32_t suppressed; // Batches the device did not need to be told about
+  uint32_t interrupts;
+  uint32_t max_in_flight;
+  uint64_t total_ns; // From the requests being queued to their completion
+  uint64_t max_ns;
+} VirtioBlkStats;
+
+uint32_t virtio_blk_init();
+uint64_t virtio_blk_sectors();
+int virtio_blk_submit(VirtioBlkReq *reqs, uint32_t count);
+int virtio_blk_wait(VirtioBlkReq *req);
+int virtio_blk_read(uint64_t sector, uint32_t count, void *buf);
+int virtio_blk_write(uint64_t sector, uint32_t count, const void *buf);
+void print_virtio_blk_stats();
+
+#endif
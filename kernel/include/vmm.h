@@ -46,12 +46,27 @@ typedef struct ProcessPd {
   Pd *pd_va;
   uintptr_t pd_pa;
   struct ProcessPd *next;
+  struct ProcessPd *prev;
+  volatile uint32_t dying; // Being freed, CPUs must stop borrowing it
 } ProcessPd;
 
+/* Flags of map_user_page_here() */
+#define UP_WRITE (1 << 0)  // User mode may write to the page
+#define UP_SHARED (1 << 1) // The frame is not freed along with the PD
+#define UP_FILL (1 << 2)   // Fill the page before user mode can see it
+
 ProcessPd *create_process_pd();
 void delete_process_pd(ProcessPd *process_pd);
 void load_pd(uintptr_t pd_pa);
 void vm_init();
+uintptr_t map_mmio(uintptr_t pa, uint32_t no_bytes);
+uintptr_t map_dma(uintptr_t pa, uint32_t no_bytes);
+void map_user_page(ProcessPd *process_pd, uintptr_t va, uintptr_t frame);
+void unmap_user_page(ProcessPd *process_pd, uintptr_t va);
+void map_user_page_here(uintptr_t va, uintptr_t frame, uint32_t flags,
+                        const uint8_t *src, uint32_t no_bytes);
+int is_user_range(uintptr_t va, uint32_t no_bytes);
+uintptr_t va_to_pa(uintptr_t va);
 uintptr_t kmalloc(uint32_t no_bytes);
 int kfree(void *va);
 
@@ -0,0 +1,24 @@
+#ifndef __WORK_H
+#define __WORK_H
+
+#include "sync.h"
+#include <stdint.h>
+
+/* Worker threads, one per priority */
+typedef enum { WORK_HIGH, WORK_LOW, NO_WORK_PRIOS } WorkPrio;
+
+/* A function to call from a worker thread. A zeroed Work is idle. */
+typedef struct Work {
+  void (*fn)(uintptr_t arg);
+  uintptr_t arg;
+  uint32_t pending;   // Queued and not yet started, protected by the queue
+  uint64_t queued_at; // clock_monotonic() when it was queued
+  struct Work *next;
+} Work;
+
+void work_init();
+void work_init_item(Work *work, void (*fn)(uintptr_t), uintptr_t arg);
+int work_queue(WorkPrio prio, Work *work);
+void print_work_stats();
+
+#endif
@@ -1,406 +1,54 @@
 [bits 32]
 
-%define MASTER_CMD_PORT 0x20
-%define SLAVE_CMD_PORT  0xA0
-%define EOI             0x20; End of interrupt (EOI) command used to notify PICs when interrupts have been serviced.
-
-global idt_load
-global isr0
-global isr1
-global isr2
-global isr3
-global isr4
-global isr5
-global isr6
-global isr7
-global isr8
-global isr9
-global isr10
-global isr11
-global isr12
-global isr13
-global isr14
-global isr15
-global isr16
-global isr17
-global isr18
-global isr19
-global isr20
-global isr21
-global isr22
-global isr23
-global isr24
-global isr25
-global isr26
-global isr27
-global isr28
-global isr29
-global isr30
-global isr31
-global irq0
-global irq1
-global irq2
-global irq3
-global irq4
-global irq5
-global irq6
-global irq7
-global irq8
-global irq9
-global irq10
-global irq11
-global irq12
-global irq13
-global irq14
-global irq15
-global irq_return
-
-extern isr_fault_handler
-extern irq_handler
-extern port_byte_out
-
-	;----------------------
-
-	; Exception-based Interrupt Service Routines
-
-	;----------------------
-
-isr0:
-	;    Division Error
-	;    Disable interrupts to prevent IRQs from firing while servicing another interrupt.
-	;    Otherwise problems could arise in kernel. This can probably be removed as a interrupt
-	;    gate automatically disables the interrupt bit in the flags register.
-	cli
-	;    Push dummy error code to maintain uniform stack frame. This is not always needed as
-	;    the processor will automatically push an error code for relevant interrupts.
-	push byte 0
-	push byte 0; Push interrupt vector number
-	jmp  exception_wrapper; Jump to generic ISR wrapper
-
-isr1:
-	;    Debug Exception
-	cli
-	push byte 0
-	push byte 1
-	jmp  exception_wrapper
-
-isr2:
-	;    Non-maskable Interrupt
-	cli
-	push byte 0
-	push byte 2
-	jmp  exception_wrapper
-
-isr3:
-	;    Breakpoint Exception
-	cli
-	push byte 0
-	push byte 3
-	jmp  exception_wrapper
-
-isr4:
-	;    Overflow Exception
-	cli
-	push byte 0
-	push byte 4
-	jmp  exception_wrapper
-
-isr5:
-	;    Bound Range Exceeded Exception
-	cli
-	push byte 0
-	push byte 5
-	jmp  exception_wrapper
-
-isr6:
-	;    Invalid Opcode Exception
-	cli
-	push byte 0
-	push byte 6
-	jmp  exception_wrapper
-
-isr7:
-	;    Device Not Available Exception
-	cli
-	push byte 0
-	push byte 7
-	jmp  exception_wrapper
-
-isr8:
-	;    Double Fault Exception
-	cli
-	push byte 8
-	jmp  exception_wrapper
-
-isr9:
-	;    Coprocessor Segment Overrun Exception
-	cli
-	push byte 0
-	push byte 9
-	jmp  exception_wrapper
-
-isr10:
-	;    Invalid TSS Exception
-	cli
-	push byte 10
-	jmp  exception_wrapper
-
-isr11:
-	;    Segment Not Present Exception
-	cli
-	push byte 11
-	jmp  exception_wrapper
-
-isr12:
-	;    Stack-Segment Fault Exception
-	cli
-	push byte 12
-	jmp  exception_wrapper
-
-isr13:
-	;    General Protection Exception
-	cli
-	push byte 13
-	jmp  exception_wrapper
-
-isr14:
-	;    Page Fault Exception
-	cli
-	push byte 14
-	jmp  exception_wrapper
-
-isr15:
-	;    Reserved Exception
-	cli
-	push byte 0
-	push byte 15
-	jmp  exception_wrapper
-
-isr16:
-	;    x87 Floating-Point Exception
-	cli
-	push byte 0
-	push byte 16
-	jmp  exception_wrapper
-
-isr17:
-	;    Alignment Check Exception
-	cli
-	push byte 17
-	jmp  exception_wrapper
-
-isr18:
-	;    Machine Check Exception
-	cli
-	push byte 0
-	push byte 18
-	jmp  exception_wrapper
-
-isr19:
-	;    SIMD Floating-Point Exception
-	cli
-	push byte 0
-	push byte 19
-	jmp  exception_wrapper
-
-isr20:
-	;    Virtualization Exception
-	cli
-	push byte 0
-	push byte 20
-	jmp  exception_wrapper
-
-isr21:
-	;    Control Protection Exception
-	cli
-	push byte 21
-	jmp  exception_wrapper
-
-isr22:
-	;    Reserved Exception
-	cli
-	push byte 0
-	push byte 22
-	jmp  exception_wrapper
-
-isr23:
-	;    Reserved Exception
-	cli
-	push byte 0
-	push byte 23
-	jmp  exception_wrapper
-
-isr24:
-	;    Reserved Exception
-	cli
-	push byte 0
-	push byte 24
-	jmp  exception_wrapper
-
-isr25:
-	;    Reserved Exception
-	cli
-	push byte 0
-	push byte 25
-	jmp  exception_wrapper
-
-isr26:
-	;    Reserved Exception
-	cli
-	push byte 0
-	push byte 26
-	jmp  exception_wrapper
+%define KERNEL_DS       0x10; Selectors, see gdt.h
+%define PERCPU_SEL      0x30
+%define TLS_SEL         0x40
+%define NO_SYSCALLS     7; See syscall.h
 
-isr27:
-	;    Reserved Exception
-	cli
-	push byte 0
-	push byte 27
-	jmp  exception_wrapper
-
-isr28:
-	;    Reserved Exception
-	cli
-	push byte 0
-	push byte 28
-	jmp  exception_wrapper
-
-isr29:
-	;    Hypervisor Injection Exception
-	cli
-	push byte 29
-	jmp  exception_wrapper
-
-isr30:
-	;    VMM Communication Exception
-	cli
-	push byte 30
-	jmp  exception_wrapper
+global vector_table
+global irq_return
+global syscall_int
+global sysenter_entry
+global spurious_int
 
-isr31:
-	;    Security Exception
-	cli
-	push byte 0
-	push byte 31
-	jmp  exception_wrapper
+extern vector_dispatch
+extern syscall_handler
+extern syscall_table
 
 	;----------------------
 
-	; IRQ-based ISRs
+	; Interrupt Service Routines, one per vector, generated. Each pushes a dummy error
+	; code unless the CPU pushes one (exceptions 8, 10-14, 17, 21, 29 and 30), then
+	; the vector number, and jumps to interrupt_wrapper. All IDT entries are interrupt
+	; gates, which clear the interrupt flag. vector_dispatch() sets it again while the
+	; handlers of an IRQ run, exceptions keep it clear until iret.
+	; vector_table holds their addresses, for idt_init().
 
 	;----------------------
 
-irq0:
-	;    Timer
-	cli
-	push byte 0; Push a dummy error code to maintain uniform stack frame
-	push byte 32
-	jmp  irq_wrapper
-
-irq1:
-	;    Keyboard
-	cli
-	push byte 0
-	push byte 33
-	jmp  irq_wrapper
-
-irq2:
-	;    Cascade for IRQs 8-15
-	cli
-	push byte 0
-	push byte 34
-	jmp  irq_wrapper
-
-irq3:
-	;    COM2/COM4
-	cli
-	push byte 0
-	push byte 35
-	jmp  irq_wrapper
-
-irq4:
-	;    COM1/COM3
-	cli
-	push byte 0
-	push byte 36
-	jmp  irq_wrapper
-
-irq5:
-	;    LPT2
-	cli
-	push byte 0
-	push byte 37
-	jmp  irq_wrapper
-
-irq6:
-	;    Floppy Disk
-	cli
-	push byte 0
-	push byte 38
-	jmp  irq_wrapper
-
-irq7:
-	;    LPT1
-	cli
-	push byte 0
-	push byte 39
-	jmp  irq_wrapper
-
-irq8:
-	;    CMOS Real-time Clock
-	cli
-	push byte 0
-	push byte 40
-	jmp  irq_wrapper
-
-irq9:
-	;    Free for peripherals / Open interrupt
-	cli
-	push byte 0
-	push byte 41
-	jmp  irq_wrapper
-
-irq10:
-	;    Free for peripherals / Open interrupt
-	cli
-	push byte 0
-	push byte 42
-	jmp  irq_wrapper
-
-irq11:
-	;    Free for peripherals / Open interrupt
-	cli
-	push byte 0
-	push byte 43
-	jmp  irq_wrapper
-
-irq12:
-	;    PS/2 Mouse
-	cli
-	push byte 0
-	push byte 44
-	jmp  irq_wrapper
-
-irq13:
-	;    FPU / Coprocessor / Inter-processor
-	cli
-	push byte 0
-	push byte 45
-	jmp  irq_wrapper
-
-irq14:
-	;    Primary ATA Hard Disk
-	cli
-	push byte 0
-	push byte 46
-	jmp  irq_wrapper
-
-irq15:
-	;    Secondary ATA Hard Disk
-	cli
-	push byte 0
-	push byte 47
-	jmp  irq_wrapper
+%macro VECTOR_STUB 1
+vector_%+%1:
+%if %1 != 8 && (%1 < 10 || %1 > 14) && %1 != 17 && %1 != 21 && %1 != 29 && %1 != 30
+	push byte 0
+%endif
+	push dword %1; Vectors from 128 do not fit a sign-extended byte
+	jmp  interrupt_wrapper
+%endmacro
+
+%assign i 0
+%rep 256
+	VECTOR_STUB i
+%assign i i+1
+%endrep
+
+section .rodata
+vector_table:
+%assign i 0
+%rep 256
+	dd vector_%+i
+%assign i i+1
+%endrep
+section .text
 
 	;----------------------
 
@@ -423,41 +71,109 @@ irq15:
 
 	extern print_hex
 
-exception_wrapper:
+	; Save the interrupted state (after int_no and err_code) as a CpuContext and load
+	; the kernel's data segments. The interrupted code may have been running in user
+	; mode with user segments loaded, FS must hold this CPU's per-CPU segment and GS
+	; the running thread's TLS segment.
+%macro SAVE_CONTEXT 0
+	push ds
+	push es
+	push fs
+	push gs
 	pusha
-	push esp
-	call isr_fault_handler
-	add  esp, 4; Start restoring stack
+	mov  ax, KERNEL_DS
+	mov  ds, ax
+	mov  es, ax
+	mov  ax, PERCPU_SEL
+	mov  fs, ax
+	mov  ax, TLS_SEL
+	mov  gs, ax
+%endmacro
+
+interrupt_wrapper:
+	SAVE_CONTEXT
+	mov  ebx, esp; The CpuContext, ebx is saved in it
+	rdtsc; Entry time, for latency tracing (see latency.c)
+	push edx
+	push eax
+	push ebx
+	call vector_dispatch; Runs the handlers and acknowledges IRQs (vector.c)
+	add  esp, 12
+
+irq_return:
+	;    Common exit of interrupts, also where new user threads first enter ring 3
 	popa
-	add  esp, 8; Pop the pushed error code and interrupt vector number (both 4B long).
+	pop gs
+	pop fs
+	pop es
+	pop ds
+	add esp, 8; Pop the pushed error code and interrupt vector number (both 4B long).
 	iret
 
-irq_wrapper:
-	pusha
+	;----------------------
+
+	; System calls from user mode (see syscall.c). The gate has DPL 3, and the CPU
+	; switches to the kernel stack in the TSS before pushing anything.
+
+	;----------------------
+
+syscall_int:
+	push byte 0
+	push dword 0x80
+	SAVE_CONTEXT
 	push esp
-	call irq_handler
+	call syscall_handler
 	add  esp, 4
+	jmp  irq_return
 
-irq_return:
-	popa
+	;----------------------
+
+	; Fast system calls through SYSENTER (see syscall.c). The CPU has loaded the kernel
+	; CS and SS and set ESP to the address of tss.esp0, with interrupts disabled. The
+	; user data segments are flat, so they stay loaded, only FS and GS are switched to
+	; the per-CPU and TLS segments. ecx and edx (user esp and eip) are saved for
+	; SYSEXIT, ebx, esi, edi and ebp are preserved by the C calling convention.
+
+	;----------------------
+
+sysenter_entry:
+	mov  esp, [esp]; The thread's kernel stack
+	push ecx
+	push edx
+	push fs
+	push gs
+	mov  cx, PERCPU_SEL
+	mov  fs, cx
+	mov  cx, TLS_SEL
+	mov  gs, cx
+	sti
+	cmp  eax, NO_SYSCALLS
+	jae  sysenter_bad
+	push edi
+	push esi
+	push ebx
+	call [syscall_table + eax * 4]
+	add  esp, 12
+
+sysenter_exit:
+	cli
+	pop  gs
+	pop  fs
+	pop  edx
+	pop  ecx
+	sti; Takes effect after sysexit
+	sysexit
+
+sysenter_bad:
+	mov eax, -1
+	jmp sysenter_exit
+
+	;----------------------
+
+	; Spurious local APIC interrupts (see lapic.c), raised when an interrupt is
+	; withdrawn before it is delivered. They must not be acknowledged.
+
+	;----------------------
 
-handle_interrupt:
-	;    The CPU tells the PIC that the interrupt is complete by writing an EOI byte to
-	;    the command port. In the case that the interrupt number is greater than 40
-	;    (IRQ 8 or higher), then the slave must be notified as well as the master.
-	cmp  [esp], dword 40
-	jl   notify_master_only
-	push SLAVE_CMD_PORT
-	push EOI
-	call port_byte_out
-	add  esp, 8
-
-notify_master_only:
-	push MASTER_CMD_PORT
-	push EOI
-	call port_byte_out
-	add  esp, 8
-
-irq_int_return:
-	add esp, 8
+spurious_int:
 	iret
@@ -9,3 +9,39 @@ uint8_t port_byte_in(uint16_t port) {
 void port_byte_out(uint16_t port, uint8_t data) {
   __asm__("out %%al, %%dx" : : "d"(port), "a"(data));
 }
+
+uint16_t port_word_in(uint16_t port) {
+  uint16_t result = 0;
+  __asm__ __volatile__("in %%dx, %%ax" : "=a"(result) : "d"(port));
+  return result;
+}
+
+void port_word_out(uint16_t port, uint16_t data) {
+  __asm__ __volatile__("out %%ax, %%dx" : : "d"(port), "a"(data));
+}
+
+uint32_t port_long_in(uint16_t port) {
+  uint32_t result = 0;
+  __asm__ __volatile__("in %%dx, %%eax" : "=a"(result) : "d"(port));
+  return result;
+}
+
+void port_long_out(uint16_t port, uint32_t data) {
+  __asm__ __volatile__("out %%eax, %%dx" : : "d"(port), "a"(data));
+}
+
+/* Read count words from port into dest, with a single rep insw */
+void port_words_in(uint16_t port, uint16_t *dest, uint32_t count) {
+  __asm__ __volatile__("rep insw"
+                       : "+D"(dest), "+c"(count)
+                       : "d"(port)
+                       : "memory");
+}
+
+/* Write count words from src to port, with a single rep outsw */
+void port_words_out(uint16_t port, const uint16_t *src, uint32_t count) {
+  __asm__ __volatile__("rep outsw"
+                       : "+S"(src), "+c"(count)
+                       : "d"(port)
+                       : "memory");
+}
@@ -0,0 +1,97 @@
+/*
+
+I/O APIC
+
+The I/O APIC takes the interrupt lines of the devices (its inputs, numbered
+from the global system interrupt (GSI) of input 0) and sends each as a message
+to the local APIC of a CPU, with a vector of its own. Which CPU, which vector,
+and the line's polarity and trigger mode are set in a 64-bit redirection
+entry per input. The interrupt is acknowledged through the local APIC that
+received it (lapic_eoi()).
+
+Its registers are reached indirectly: the index of a register is written to
+IOREGSEL, and the register is then read or written through IOWIN. The pair is
+shared by all CPUs, so each access holds ioapic_lock.
+
+*/
+
+#include "include/ioapic.h"
+#include "include/spinlock.h"
+#include "include/vmm.h"
+#include <stddef.h>
+
+#define IOREGSEL 0x00
+#define IOWIN 0x10
+
+#define IOAPIC_VER 0x01    // Bits 16-23: index of the last redirection entry
+#define IOAPIC_REDTBL 0x10 // Two registers per input, low half first
+
+#define REDIR_MASKED 0x10000
+
+static volatile uint32_t *ioapic = NULL;
+static uint32_t ioapic_gsi_base;
+static uint32_t ioapic_no_inputs;
+static Spinlock ioapic_lock;
+
+static uint32_t ioapic_read(uint32_t reg) {
+  ioapic[IOREGSEL / 4] = reg;
+  return ioapic[IOWIN / 4];
+}
+
+static void ioapic_write(uint32_t reg, uint32_t val) {
+  ioapic[IOREGSEL / 4] = reg;
+  ioapic[IOWIN / 4] = val;
+}
+
+/* Return the input gsi is wired to, or -1 if it is not one of ours */
+static int32_t ioapic_input(uint32_t gsi) {
+  if (ioapic == NULL || gsi < ioapic_gsi_base ||
+      gsi - ioapic_gsi_base >= ioapic_no_inputs) {
+    return -1;
+  }
+  return gsi - ioapic_gsi_base;
+}
+
+/* Map the I/O APIC registers and mask all of its inputs */
+void ioapic_install(uintptr_t ioapic_pa, uint32_t gsi_base) {
+  spin_init(&ioapic_lock);
+  ioapic = (uint32_t *)map_mmio(ioapic_pa, 0x1000);
+  ioapic_gsi_base = gsi_base;
+  ioapic_no_inputs = ((ioapic_read(IOAPIC_VER) >> 16) & 0xFF) + 1;
+  for (uint32_t i = 0; i < ioapic_no_inputs; i++) {
+    ioapic_write(IOAPIC_REDTBL + 2 * i, REDIR_MASKED);
+  }
+}
+
+/*
+Deliver gsi as vector to the CPU with the given local APIC ID, with the
+polarity and trigger mode in flags (IOAPIC_*). Return -1 if no input is wired
+to gsi.
+*/
+int ioapic_route(uint32_t gsi, uint8_t vector, uint32_t flags,
+                 uint8_t apic_id) {
+  int32_t input = ioapic_input(gsi);
+  if (input < 0) {
+    return -1;
+  }
+  uint32_t irq_flags = spin_lock_irqsave(&ioapic_lock);
+  ioapic_write(IOAPIC_REDTBL + 2 * input, REDIR_MASKED); // While half-written
+  ioapic_write(IOAPIC_REDTBL + 2 * input + 1, (uint32_t)apic_id << 24);
+  ioapic_write(IOAPIC_REDTBL + 2 * input,
+               vector | (flags & (IOAPIC_ACTIVE_LOW | IOAPIC_LEVEL)));
+  spin_unlock_irqrestore(&ioapic_lock, irq_flags);
+  return 0;
+}
+
+/* Stop delivering gsi. Return -1 if no input is wired to it. */
+int ioapic_mask(uint32_t gsi) {
+  int32_t input = ioapic_input(gsi);
+  if (input < 0) {
+    return -1;
+  }
+  uint32_t irq_flags = spin_lock_irqsave(&ioapic_lock);
+  uint32_t low = ioapic_read(IOAPIC_REDTBL + 2 * input);
+  ioapic_write(IOAPIC_REDTBL + 2 * input, low | REDIR_MASKED);
+  spin_unlock_irqrestore(&ioapic_lock, irq_flags);
+  return 0;
+}
@@ -1,26 +1,15 @@
+#include "include/irq.h"
+#include "include/acpi.h"
+#include "include/gdt.h"
 #include "include/idt.h"
 #include "include/io.h"
+#include "include/ioapic.h"
+#include "include/lapic.h"
+#include "include/screen.h"
+#include "include/smp.h"
+#include "include/timer.h"
 #include "stdint.h"
-
-/*
-The IRQ based ISRs defined in kernel_entry.asm.
-*/
-extern void irq0();
-extern void irq1();
-extern void irq2();
-extern void irq3();
-extern void irq4();
-extern void irq5();
-extern void irq6();
-extern void irq7();
-extern void irq8();
-extern void irq9();
-extern void irq10();
-extern void irq11();
-extern void irq12();
-extern void irq13();
-extern void irq14();
-extern void irq15();
+#include <stddef.h>
 
 /*
 I/O ports for the Programmable Interrupt Controllers (PIC or 8259).
@@ -47,9 +36,24 @@ correct system interrupt number.
 Additional info about environment (use 8086 mode instead of 8080)
 */
 #define INIT 0x11
-#define MASTER_OFFSET 0x20
-#define SLAVE_OFFSET 0x28
+#define MASTER_OFFSET IRQ_BASE_VECTOR
+#define SLAVE_OFFSET (IRQ_BASE_VECTOR + 8)
 #define PIC_ENV 0x01
+#define PIC_EOI 0x20      // End of interrupt, written to the command port
+#define PIC_CASCADE_IRQ 2 // Where the slave is connected to the master
+
+/*
+The Interrupt Mode Configuration Register of machines that start in PIC mode
+(MP specification), which connects the PIC straight to the boot CPU. Writing
+IMCR_APIC to it routes the PIC through the local APIC instead.
+*/
+#define IMCR_SEL_PORT 0x22
+#define IMCR_DATA_PORT 0x23
+#define IMCR_SEL 0x70
+#define IMCR_APIC 0x01
+
+/* Set once the ISA IRQs come through the I/O APIC, see irqs_use_ioapic() */
+static int irq_ioapic = 0;
 
 /*
 Remap the PIC IRQ numbers to 32-47.
@@ -71,44 +75,231 @@ void pic_remap() {
   port_byte_out(SLAVE_DATA_PORT, 0x0);  //  ^(all IRQs will be serviced)
 }
 
+/* Mask every IRQ of the PIC, once the I/O APIC delivers them */
+static void pic_disable() {
+  port_byte_out(MASTER_DATA_PORT, 0xFF);
+  port_byte_out(SLAVE_DATA_PORT, 0xFF);
+}
+
+/*
+Acknowledge an IRQ once its handlers ran, which lets IRQs of the same or a
+lower priority in again. With the PIC, IRQs 8-15 must be acknowledged to the
+slave as well as the master.
+*/
+static void irq_eoi(uint32_t vector) {
+  if (irq_ioapic) {
+    lapic_eoi();
+    return;
+  }
+  if (vector >= SLAVE_OFFSET) {
+    port_byte_out(SLAVE_CMD_PORT, PIC_EOI);
+  }
+  port_byte_out(MASTER_CMD_PORT, PIC_EOI);
+}
+
 /*
 Initialize IRQ based IRSs:
 1) remap the PIC to use interrups numbers 32-47
-2) set entries 32-47 in the IDT to IRQ based ISRs 0-15.
+2) acknowledge interrupts on vectors 32-47 as IRQs 0-15.
+The PIC delivers the IRQs until irqs_use_ioapic() takes over.
 */
 void irqs_init() {
   pic_remap();
-  idt_set_gate(32, (uintptr_t)irq0);
-  idt_set_gate(33, (uintptr_t)irq1);
-  idt_set_gate(34, (uintptr_t)irq2);
-  idt_set_gate(35, (uintptr_t)irq3);
-  idt_set_gate(36, (uintptr_t)irq4);
-  idt_set_gate(37, (uintptr_t)irq5);
-  idt_set_gate(38, (uintptr_t)irq6);
-  idt_set_gate(39, (uintptr_t)irq7);
-  idt_set_gate(40, (uintptr_t)irq8);
-  idt_set_gate(41, (uintptr_t)irq9);
-  idt_set_gate(42, (uintptr_t)irq10);
-  idt_set_gate(43, (uintptr_t)irq11);
-  idt_set_gate(44, (uintptr_t)irq12);
-  idt_set_gate(45, (uintptr_t)irq13);
-  idt_set_gate(46, (uintptr_t)irq14);
-  idt_set_gate(47, (uintptr_t)irq15);
-}
-
-/* An array of function pointers mapping IRQ numbers to handler functions */
-void *irq_handlers[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-
-void irq_install_handler(int irq_no, void (*handler)(CpuContext *context)) {
-  if (irq_no >= 0 && irq_no <= 15) { // There are only 16 different IRQs
-    irq_handlers[irq_no] = handler;
-  }
-}
-
-void irq_handler(CpuContext *context) {
-  void (*handler)(CpuContext *context); // Blank function pointer
-  handler = irq_handlers[context->int_no - 32];
-  if (handler != 0) {
-    handler(context);
+  for (int i = 0; i < NO_ISA_IRQS; i++) {
+    vector_set_ack(IRQ_BASE_VECTOR + i, irq_eoi);
+  }
+}
+
+/*
+The vector IRQ irq_no comes in on. The local APIC ranks vectors by class
+(vector / 16), so the timer IRQ gets a class above the other ISA IRQs and can
+interrupt their handlers, as it does with the PIC.
+*/
+static uint32_t irq_vector(int irq_no) {
+  return irq_ioapic && irq_no == 0 ? IRQ0_APIC_VECTOR
+                                   : IRQ_BASE_VECTOR + irq_no;
+}
+
+/*
+Run handler on every interrupt of IRQ irq_no, after the ones it has (the line
+may be shared). Return -1 if it cannot be installed.
+*/
+int irq_install_handler(int irq_no, VectorHandler handler) {
+  if (irq_no < 0 || irq_no >= NO_ISA_IRQS) {
+    return -1;
+  }
+  return vector_add_handler(irq_vector(irq_no), handler);
+}
+
+/* Deliver ISA IRQ irq_no to the CPU with the given local APIC ID */
+static int route_irq(int irq_no, uint8_t apic_id) {
+  uint16_t inti = platform.isa_flags[irq_no];
+  uint32_t flags =
+      ((inti & INTI_POLARITY_MASK) == INTI_ACTIVE_LOW ? IOAPIC_ACTIVE_LOW : 0) |
+      ((inti & INTI_TRIGGER_MASK) == INTI_LEVEL ? IOAPIC_LEVEL : 0);
+  return ioapic_route(platform.isa_gsi[irq_no], irq_vector(irq_no), flags,
+                      apic_id);
+}
+
+/*
+Take the ISA IRQs over from the PIC: the I/O APIC found by acpi_init() sends
+them to the local APIC with the given ID, on the same vectors except for the
+timer's (see irq_vector()), and they are acknowledged with a single write to
+the local APIC instead of I/O port writes to one or both PICs. Needs the heap
+and the local APIC. Interrupts must be disabled. Return 0 if there is no I/O
+APIC, the PIC is then kept.
+*/
+int irqs_use_ioapic(uint8_t apic_id) {
+  if (platform.ioapic_pa == 0) {
+    return 0;
+  }
+  if (platform.imcr) {
+    port_byte_out(IMCR_SEL_PORT, IMCR_SEL);
+    port_byte_out(IMCR_DATA_PORT, IMCR_APIC);
+  }
+  ioapic_install(platform.ioapic_pa, platform.ioapic_gsi_base);
+  vector_move(IRQ_BASE_VECTOR, IRQ0_APIC_VECTOR);
+  irq_ioapic = 1;
+  for (int i = 0; i < NO_ISA_IRQS; i++) {
+    if (i != PIC_CASCADE_IRQ) {
+      route_irq(i, apic_id);
+    }
+  }
+  pic_disable();
+  return 1;
+}
+
+/*
+Deliver ISA IRQ irq_no to another CPU. The timer IRQ (0) stays on the boot
+CPU, which timer.c relies on. Return -1 if the PIC delivers the IRQs, which
+only interrupts the boot CPU.
+*/
+int irq_set_cpu(int irq_no, uint32_t cpu_id) {
+  if (!irq_ioapic || irq_no <= 0 || irq_no >= NO_ISA_IRQS ||
+      irq_no == PIC_CASCADE_IRQ || cpu_id >= no_cpus) {
+    return -1;
+  }
+  return route_irq(irq_no, cpus[cpu_id].apic_id);
+}
+
+/*
+
+Interrupt flag
+
+- irq_save() disables interrupts and returns the previous EFLAGS, which
+  irq_restore() puts back. Sections nest: only the outermost one enables
+  interrupts again, and code that runs with interrupts disabled may use them.
+- Each CPU times how long its interrupts stay disabled, from the irq_save()
+  or IRQ that disabled them to the irq_restore() or return from the IRQ that
+  enables them again. That may be on another thread, when the scheduler
+  switched meanwhile, and the time is blamed on where they were disabled.
+  Sections that start on exception or system call entry are not timed.
+- A CPU keeps the IRQS_OFF_NO_SITES sites with the longest sections, each
+  with its worst and total time (print_irqs_off()). A section that is shorter
+  than all of them when the table is full is not kept.
+- Nothing is timed until the TSC is calibrated, or on a CPU that does not
+  have its per-CPU segment yet.
+
+*/
+
+static int can_trace() {
+  uint16_t fs;
+  __asm__ __volatile__("mov %%fs, %0" : "=r"(fs));
+  return TRACE_IRQS_OFF && tsc_khz != 0 && fs == PERCPU_SEL;
+}
+
+/* Interrupts were just disabled, by code at site */
+void irqs_off_begin(uintptr_t site) {
+  if (!can_trace()) {
+    return;
+  }
+  Cpu *cpu = this_cpu();
+  cpu->irqs_off_site = site;
+  cpu->irqs_off_since = rdtsc();
+}
+
+/* Interrupts are about to be enabled */
+void irqs_off_end() {
+  if (!can_trace() || this_cpu()->irqs_off_site == 0) {
+    return;
+  }
+  Cpu *cpu = this_cpu();
+  uint64_t cycles = rdtsc() - cpu->irqs_off_since;
+  IrqsOffSite *slot = NULL;
+  IrqsOffSite *shortest = &cpu->irqs_off[0];
+  for (int i = 0; i < IRQS_OFF_NO_SITES && slot == NULL; i++) {
+    if (cpu->irqs_off[i].site == cpu->irqs_off_site) {
+      slot = &cpu->irqs_off[i];
+    } else if (cpu->irqs_off[i].max_cycles < shortest->max_cycles) {
+      shortest = &cpu->irqs_off[i];
+    }
+  }
+  if (slot == NULL && cycles > shortest->max_cycles) {
+    slot = shortest;
+    *slot = (IrqsOffSite){cpu->irqs_off_site, 0, 0, 0};
+  }
+  if (slot != NULL) {
+    slot->count++;
+    slot->total_cycles += cycles;
+    if (cycles > slot->max_cycles) {
+      slot->max_cycles = cycles;
+    }
+  }
+  cpu->irqs_off_site = 0;
+}
+
+/* Disable interrupts, blaming the time on site. Return the previous EFLAGS. */
+uint32_t irq_save_from(uintptr_t site) {
+  uint32_t flags;
+  __asm__ __volatile__("pushf\n\tpop %0\n\tcli" : "=r"(flags) : : "memory");
+  if (flags & EFLAGS_IF) {
+    irqs_off_begin(site);
+  }
+  return flags;
+}
+
+/* Disable interrupts. Return the previous EFLAGS, for irq_restore(). */
+uint32_t irq_save() {
+  return irq_save_from((uintptr_t)__builtin_return_address(0));
+}
+
+void irq_restore(uint32_t flags) {
+  if (flags & EFLAGS_IF) {
+    irqs_off_end();
+  }
+  __asm__ __volatile__("push %0\n\tpopf" : : "r"(flags) : "memory", "cc");
+}
+
+int irqs_enabled() {
+  uint32_t flags;
+  __asm__ __volatile__("pushf\n\tpop %0" : "=r"(flags));
+  return (flags & EFLAGS_IF) != 0;
+}
+
+/* Print the longest interrupts-off sections of every CPU, worst first */
+void print_irqs_off() {
+  for (uint32_t i = 0; i < no_cpus; i++) {
+    IrqsOffSite sites[IRQS_OFF_NO_SITES];
+    for (int j = 0; j < IRQS_OFF_NO_SITES; j++) {
+      IrqsOffSite site = cpus[i].irqs_off[j]; // Racy, only for display
+      int k = j;
+      for (; k > 0 && sites[k - 1].max_cycles < site.max_cycles; k--) {
+        sites[k] = sites[k - 1];
+      }
+      sites[k] = site;
+    }
+    for (int j = 0; j < IRQS_OFF_NO_SITES && sites[j].site != 0; j++) {
+      print("cpu ");
+      print_int(i);
+      print(" ");
+      print_hex(sites[j].site);
+      print(": max ");
+      print_int(tsc_to_ns(sites[j].max_cycles) / 1000);
+      print(" us, avg ");
+      print_int(tsc_to_ns(sites[j].total_cycles / sites[j].count) / 1000);
+      print(" us, ");
+      print_int(sites[j].count);
+      print(" times\n");
+    }
   }
 }
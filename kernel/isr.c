@@ -1,85 +1,14 @@
+#include "include/isr.h"
 #include "include/idt.h"
+#include "include/process.h"
 #include "include/screen.h"
-
-/*
-The frist 32 ISR defined in kernel_entry.asm.
-Interrupt numbers 0-31 are reserved by Intel, and are designed to service
-exceptions.
-*/
-extern void isr0();
-extern void isr1();
-extern void isr2();
-extern void isr3();
-extern void isr4();
-extern void isr5();
-extern void isr6();
-extern void isr7();
-extern void isr8();
-extern void isr9();
-extern void isr10();
-extern void isr11();
-extern void isr12();
-extern void isr13();
-extern void isr14();
-extern void isr15();
-extern void isr16();
-extern void isr17();
-extern void isr18();
-extern void isr19();
-extern void isr20();
-extern void isr21();
-extern void isr22();
-extern void isr23();
-extern void isr24();
-extern void isr25();
-extern void isr26();
-extern void isr27();
-extern void isr28();
-extern void isr29();
-extern void isr30();
-extern void isr31();
+#include "include/vector.h"
 
 /* A Mapping from interrupt number to exception message */
 char *exception_messages[32];
 
-/*
- Initialize exception based ISRs:
-Set entries 0-32 in the IDT to exception based ISRs.
-*/
+/* Name the exceptions, their entry stubs are installed by idt_init() */
 void isrs_init() {
-  idt_set_gate(0, (uintptr_t)isr0);
-  idt_set_gate(1, (uintptr_t)isr1);
-  idt_set_gate(2, (uintptr_t)isr2);
-  idt_set_gate(3, (uintptr_t)isr3);
-  idt_set_gate(4, (uintptr_t)isr4);
-  idt_set_gate(5, (uintptr_t)isr5);
-  idt_set_gate(6, (uintptr_t)isr6);
-  idt_set_gate(7, (uintptr_t)isr7);
-  idt_set_gate(8, (uintptr_t)isr8);
-  idt_set_gate(9, (uintptr_t)isr9);
-  idt_set_gate(10, (uintptr_t)isr10);
-  idt_set_gate(11, (uintptr_t)isr11);
-  idt_set_gate(12, (uintptr_t)isr12);
-  idt_set_gate(13, (uintptr_t)isr13);
-  idt_set_gate(14, (uintptr_t)isr14);
-  idt_set_gate(15, (uintptr_t)isr15);
-  idt_set_gate(16, (uintptr_t)isr16);
-  idt_set_gate(17, (uintptr_t)isr17);
-  idt_set_gate(18, (uintptr_t)isr18);
-  idt_set_gate(19, (uintptr_t)isr19);
-  idt_set_gate(20, (uintptr_t)isr20);
-  idt_set_gate(21, (uintptr_t)isr21);
-  idt_set_gate(22, (uintptr_t)isr22);
-  idt_set_gate(23, (uintptr_t)isr23);
-  idt_set_gate(24, (uintptr_t)isr24);
-  idt_set_gate(25, (uintptr_t)isr25);
-  idt_set_gate(26, (uintptr_t)isr26);
-  idt_set_gate(27, (uintptr_t)isr27);
-  idt_set_gate(28, (uintptr_t)isr28);
-  idt_set_gate(29, (uintptr_t)isr29);
-  idt_set_gate(30, (uintptr_t)isr30);
-  idt_set_gate(31, (uintptr_t)isr31);
-
   exception_messages[0] = "Division By Zero";
   exception_messages[1] = "Debug";
   exception_messages[2] = "Non Maskable Interrupt";
@@ -125,12 +54,26 @@ void isr_install_handler(int isr_no, void (*handler)(CpuContext *context)) {
 }
 
 /*
-Generic fault handler called by all exception based ISRs.
-For now, display a message and halt the CPU.
+Fixups resolve an exception that is part of normal operation (e.g. #NM for
+lazy FPU switching). They return 1 if the faulting instruction can simply be
+retried, or 0 to treat the exception as a fault. Several may be installed on
+one exception, they are tried in order (see vector.c).
+*/
+void isr_install_fixup(int isr_no, int (*fixup)(CpuContext *context)) {
+  if (isr_no >= 0 && isr_no <= 31) {
+    vector_add_handler(isr_no, fixup);
+  }
+}
+
+/*
+Generic fault handler, for exceptions no fixup recovered from.
+A fault in user mode only kills the faulting thread. For now, any other fault
+displays a message and halts the CPU.
 */
 void isr_fault_handler(CpuContext *context) {
   if (context->int_no < 32) {
-    print("\nSystem Halted!\n");
+    int user_mode = (context->cs & 3) == 3;
+    print(user_mode ? "\nUser thread killed!\n" : "\nSystem Halted!\n");
 
     print("Exception: ");
     print(exception_messages[context->int_no]);
@@ -150,6 +93,9 @@ void isr_fault_handler(CpuContext *context) {
       handler(context);
     }
 
+    if (user_mode) {
+      thread_exit();
+    }
     while (1) {
     }
   }
@@ -1,7 +1,9 @@
 #include "include/io.h"
 #include "include/irq.h"
+#include "include/work.h"
 
 #define NUM_OBSERVERS 5
+#define KEY_BUF_SIZE 64 // Keys pressed faster than the worker drains them
 /*
 Anything the keyboard is trying to send to the computer is sent through the data
 register. The keyboard raises IRQ1 when it has data available for reading.
@@ -41,18 +43,22 @@ void deregister_kb_observer(void *fn) {
 }
 
 /*
-Keyboard IRQ handler
+Pressed keys, from the IRQ handler to the observers. There is one producer (the
+IRQ, delivered to the BSP only) and one consumer (the WORK_HIGH worker), so the
+indices need no lock.
 */
-void kb_handler(CpuContext *context) {
-  unsigned char scancode = port_byte_in(KB_DATA_PORT);
-
-  if (scancode & 0x80) {
-    // Key has been released if top bit of byte is set
-  } else {
-    // Key has been pressed
-
-    char c = kb_us_keymap[scancode];
-
+static char key_buf[KEY_BUF_SIZE];
+static volatile uint32_t key_head; // Next key to hand to the observers
+static volatile uint32_t key_tail; // Where the next key goes
+static uint32_t keys_dropped;
+static Work key_work;
+
+/* Call the observers for every buffered key, from a worker thread */
+static void kb_notify(uintptr_t arg) {
+  while (key_head != key_tail) {
+    char c = key_buf[key_head % KEY_BUF_SIZE];
+    __asm__ __volatile__("" : : : "memory"); // Read before the slot is freed
+    key_head++;
     for (int i = 0; i < NUM_OBSERVERS; i++) {
       if (observers[i] == 0) {
         break;
@@ -64,6 +70,29 @@ void kb_handler(CpuContext *context) {
   }
 }
 
+/*
+Keyboard IRQ handler. Only buffers the key, the observers are called later by
+kb_notify() with interrupts enabled.
+*/
+int kb_handler(CpuContext *context) {
+  unsigned char scancode = port_byte_in(KB_DATA_PORT);
+
+  if (scancode & 0x80) {
+    // Key has been released if top bit of byte is set
+  } else {
+    // Key has been pressed
+    if (key_tail - key_head == KEY_BUF_SIZE) {
+      keys_dropped++;
+      return 1;
+    }
+    key_buf[key_tail % KEY_BUF_SIZE] = kb_us_keymap[scancode];
+    __asm__ __volatile__("" : : : "memory"); // Written before it is visible
+    key_tail++;
+    work_queue(WORK_HIGH, &key_work);
+  }
+  return 1;
+}
+
 /*
 
 Add the kb handler to the IRQ based interrupt mapping
@@ -166,5 +195,8 @@ void kb_install() {
     observers[i] = 0;
   }
 
+  key_head = 0;
+  key_tail = 0;
+  work_init_item(&key_work, kb_notify, 0);
   irq_install_handler(1, kb_handler);
 }
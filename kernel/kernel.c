@@ -1,12 +1,22 @@
+#include "include/ata.h"
+#include "include/elf.h"
+#include "include/fpu.h"
 #include "include/idt.h"
 #include "include/irq.h"
 #include "include/isr.h"
 #include "include/kb.h"
+#include "include/pci.h"
 #include "include/pmm.h"
+#include "include/process.h"
 #include "include/screen.h"
+#include "include/smp.h"
+#include "include/syscall.h"
 #include "include/test.h"
 #include "include/timer.h"
+#include "include/top.h"
+#include "include/virtio_blk.h"
 #include "include/vmm.h"
+#include "include/work.h"
 
 void kmain() {
   print("\nEntered into 32-bit Protected Mode.\n");
@@ -22,9 +32,11 @@ void kmain() {
   print_hex((uintptr_t)&endkernel);
   print("\n");
 
+  cpu_init_bsp();
   idt_init();
-  print("IDT initialized.\n");
+  print("GDT and IDT initialized.\n");
   isrs_init();
+  fpu_init();
   irqs_init();
   timer_install();
   kb_install();
@@ -34,11 +46,24 @@ void kmain() {
   vm_init();
   print("Physical and virtual memory managers initialized.\n");
 
+  sched_init();
+  work_init();
+  syscall_init();
+  elf_init();
+  top_install();
+  pci_init();
+  ata_init();
+  virtio_blk_init();
+  print("Scheduler and system calls initialized.\n");
+
+  smp_init();
+
   __asm__ __volatile__("sti"); // Re-enable interrups after the IDT and
                                // interrupt handlers have been initialized
 
   test_vm();
 
   while (1) {
+    __asm__ __volatile__("hlt"); // Idle until the next interrupt
   }
 }
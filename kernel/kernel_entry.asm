@@ -1,7 +1,15 @@
 [bits 32]
 
 extern kmain
+extern startbss
+extern endkernel
 
 _start:
+	;   The boot sector only loads the kernel image, so zero the uninitialized data here
+	mov edi, startbss
+	mov ecx, endkernel
+	sub ecx, edi
+	xor eax, eax
+	rep stosb
 	call kmain
 	jmp  $
@@ -0,0 +1,143 @@
+/*
+
+Local APIC
+
+Every CPU has a local APIC (Advanced Programmable Interrupt Controller). It
+receives interrupts for its CPU, sends inter-processor interrupts (IPIs) to
+other CPUs, and has a timer of its own. Its registers are memory mapped (at the
+same physical address on every CPU, each CPU sees its own APIC there) and are
+32 bits wide, spaced 16 bytes apart.
+
+The timer counts down at the bus clock divided by a configurable divisor, a
+rate that is not reported anywhere. It is calibrated once against the TSC and
+then used in periodic mode to preempt threads on the application processors
+(the PIT only interrupts the boot CPU).
+
+*/
+
+#include "include/lapic.h"
+#include "include/idt.h"
+#include "include/irq.h"
+#include "include/process.h"
+#include "include/smp.h"
+#include "include/timer.h"
+#include "include/vector.h"
+#include "include/vmm.h"
+#include <stddef.h>
+
+#define LAPIC_ID 0x20
+#define LAPIC_TPR 0x80 // Task priority
+#define LAPIC_EOI 0xB0
+#define LAPIC_SVR 0xF0 // Spurious interrupt vector
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310 // Bits 24-31: destination APIC ID
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_ERROR 0x370
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+
+#define SVR_ENABLE 0x100
+#define LVT_MASKED 0x10000
+#define LVT_TIMER_PERIODIC 0x20000
+#define ICR_INIT 0x500
+#define ICR_STARTUP 0x600
+#define ICR_LEVEL_ASSERT 0x4000
+#define ICR_PENDING 0x1000 // Delivery status, cleared once the IPI was sent
+#define TIMER_DIVIDE_16 0x3
+
+#define CALIBRATE_US 10000
+
+volatile uint32_t *lapic = NULL;
+static uint32_t lapic_timer_count; // Timer counts per tick (1/HZ)
+
+extern void spurious_int();
+
+static uint32_t lapic_read(uint32_t reg) { return lapic[reg / 4]; }
+
+static void lapic_write(uint32_t reg, uint32_t val) {
+  lapic[reg / 4] = val;
+  lapic_read(LAPIC_ID); // Wait for the write to complete
+}
+
+/* Count timer decrements over CALIBRATE_US. Interrupts must be disabled. */
+static void lapic_timer_calibrate() {
+  lapic_write(LAPIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+  lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+  lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+  timer_delay_us(CALIBRATE_US);
+  uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+  lapic_write(LAPIC_TIMER_INIT, 0);
+
+  lapic_timer_count = (uint64_t)elapsed * 1000000 / CALIBRATE_US / HZ;
+}
+
+/* Acknowledge one of the local APIC's own interrupts */
+static void lapic_ack(uint32_t vector) { lapic_eoi(); }
+
+/*
+Handler for the local APIC timer and the reschedule IPI. The switch happens
+once the interrupt returns, see vector.c.
+*/
+static int lapic_handler(CpuContext *context) {
+  this_cpu()->need_resched = 1;
+  return 1;
+}
+
+/*
+Map the local APIC registers, install its interrupt handlers and calibrate its
+timer. Called once, on the boot CPU.
+*/
+void lapic_install(uintptr_t lapic_pa) {
+  lapic = (uint32_t *)map_mmio(lapic_pa, 0x1000);
+  vector_set_ack(LAPIC_TIMER_VECTOR, lapic_ack);
+  vector_add_handler(LAPIC_TIMER_VECTOR, lapic_handler);
+  vector_set_ack(RESCHED_VECTOR, lapic_ack);
+  vector_add_handler(RESCHED_VECTOR, lapic_handler);
+  idt_set_gate(LAPIC_SPURIOUS_VECTOR, (uintptr_t)spurious_int);
+  lapic_init();
+  lapic_timer_calibrate();
+}
+
+/* Enable the calling CPU's local APIC and accept interrupts of any priority */
+void lapic_init() {
+  lapic_write(LAPIC_TPR, 0);
+  lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+  lapic_write(LAPIC_LVT_ERROR, LVT_MASKED);
+  lapic_write(LAPIC_SVR, SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+  lapic_write(LAPIC_EOI, 0);
+}
+
+uint8_t lapic_id() { return lapic_read(LAPIC_ID) >> 24; }
+
+/* A single write, nothing depends on it having completed */
+void lapic_eoi() { lapic[LAPIC_EOI / 4] = 0; }
+
+static void lapic_send_icr(uint8_t apic_id, uint32_t icr) {
+  lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+  lapic_write(LAPIC_ICR_LOW, icr); // Writing the low half sends the IPI
+  while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) {
+    __asm__ __volatile__("pause");
+  }
+}
+
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector) {
+  lapic_send_icr(apic_id, vector);
+}
+
+/* Reset a CPU, it then waits for a STARTUP IPI */
+void lapic_send_init(uint8_t apic_id) {
+  lapic_send_icr(apic_id, ICR_INIT | ICR_LEVEL_ASSERT);
+}
+
+/* Start a CPU in real mode at entry_pa, which must be page aligned below 1MiB */
+void lapic_send_startup(uint8_t apic_id, uintptr_t entry_pa) {
+  lapic_send_icr(apic_id, ICR_STARTUP | entry_pa >> 12);
+}
+
+/* Preempt the calling CPU every tick */
+void lapic_timer_start() {
+  lapic_write(LAPIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+  lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+  lapic_write(LAPIC_TIMER_INIT, lapic_timer_count);
+}
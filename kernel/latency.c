@@ -0,0 +1,147 @@
+/*
+
+Interrupt latency tracing
+
+- The entry stub of every vector reads the TSC right after saving the
+  interrupted state (int.asm), and passes it to vector_dispatch(). That is as
+  close to the device raising the IRQ as the CPU can tell.
+- vector_dispatch() records, for every interrupt outside the exceptions, how
+  long it took from the stub to the first handler (switching to the
+  interrupt stack included), and how long the handlers ran.
+- While the handlers run, the CPU remembers the vector and its entry time. A
+  thread they wake carries both until schedule_next() switches to it, right
+  before swtch(), which records the interrupt-to-thread latency. Wake-ups after
+  a handler itself switched threads are not attributed to the interrupt.
+- Each of these goes into a histogram per vector, with count, minimum, average
+  and maximum, and buckets by powers of two of TSC cycles that the
+  percentiles are estimated from. print_latency() dumps them, in ns.
+- The first LATENCY_NO_VECTORS vectors recorded get histograms, later ones
+  are not traced. Each histogram has its own lock, so CPUs only contend when
+  they record the same vector.
+- Nothing is recorded until the TSC is calibrated.
+
+*/
+
+#include "include/latency.h"
+#include "include/screen.h"
+#include "include/spinlock.h"
+#include "include/timer.h"
+#include <stddef.h>
+
+typedef struct {
+  uint32_t vector;
+  Spinlock lock;
+  LatencyHist hists[LAT_NO_KINDS];
+} LatencySlot;
+
+static LatencySlot slots[LATENCY_NO_VECTORS];
+static uint32_t no_slots;
+static uint8_t slot_of[256]; // 1 + index into slots, 0 if none yet
+static Spinlock slots_lock;  // Serializes handing out slots
+
+static const char *kind_names[LAT_NO_KINDS] = {"irq->handler", "handler",
+                                               "irq->thread"};
+
+/* Return the slot of vector, giving it one if there is one left */
+static LatencySlot *find_slot(uint32_t vector) {
+  uint8_t slot = __atomic_load_n(&slot_of[vector], __ATOMIC_ACQUIRE);
+  if (slot != 0) {
+    return &slots[slot - 1];
+  }
+  spin_lock(&slots_lock);
+  if (slot_of[vector] == 0 && no_slots < LATENCY_NO_VECTORS) {
+    slots[no_slots].vector = vector;
+    spin_init(&slots[no_slots].lock);
+    for (int i = 0; i < LAT_NO_KINDS; i++) {
+      slots[no_slots].hists[i] = (LatencyHist){0};
+      slots[no_slots].hists[i].min = 0xFFFFFFFF;
+    }
+    no_slots++;
+    __atomic_store_n(&slot_of[vector], no_slots, __ATOMIC_RELEASE);
+  }
+  slot = slot_of[vector];
+  spin_unlock(&slots_lock);
+  return slot != 0 ? &slots[slot - 1] : NULL;
+}
+
+/* Add cycles to a histogram of vector. Interrupts must be disabled. */
+void latency_record(uint32_t vector, LatencyKind kind, uint64_t cycles) {
+  if (!TRACE_LATENCY || tsc_khz == 0 || vector > 0xFF) {
+    return;
+  }
+  LatencySlot *slot = find_slot(vector);
+  if (slot == NULL) {
+    return;
+  }
+  uint32_t c = cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)cycles;
+  uint32_t bucket = 31 - __builtin_clz(c | 1);
+  LatencyHist *hist = &slot->hists[kind];
+  spin_lock(&slot->lock);
+  hist->count++;
+  hist->total += c;
+  if (c < hist->min) {
+    hist->min = c;
+  }
+  if (c > hist->max) {
+    hist->max = c;
+  }
+  hist->buckets[bucket]++;
+  spin_unlock(&slot->lock);
+}
+
+/* Clear every histogram, e.g. before a measurement */
+void latency_reset() {
+  for (uint32_t i = 0; i < no_slots; i++) {
+    uint32_t flags = spin_lock_irqsave(&slots[i].lock);
+    for (int j = 0; j < LAT_NO_KINDS; j++) {
+      slots[i].hists[j] = (LatencyHist){0};
+      slots[i].hists[j].min = 0xFFFFFFFF;
+    }
+    spin_unlock_irqrestore(&slots[i].lock, flags);
+  }
+}
+
+/* Upper bound, in cycles, of the bucket the given per mille falls in */
+static uint64_t percentile(LatencyHist *hist, uint32_t per_mille) {
+  uint64_t rank = ((uint64_t)hist->count * per_mille + 999) / 1000;
+  uint64_t seen = 0;
+  for (int i = 0; i < LATENCY_NO_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= rank) {
+      uint64_t bound = ((uint64_t)2 << i) - 1;
+      return bound < hist->max ? bound : hist->max;
+    }
+  }
+  return hist->max;
+}
+
+static void print_ns(const char *label, uint64_t cycles) {
+  print(label);
+  print_int(tsc_to_ns(cycles));
+}
+
+/* Print the histograms of every traced vector, in ns */
+void print_latency() {
+  for (uint32_t i = 0; i < no_slots; i++) {
+    for (int j = 0; j < LAT_NO_KINDS; j++) {
+      uint32_t flags = spin_lock_irqsave(&slots[i].lock);
+      LatencyHist hist = slots[i].hists[j];
+      spin_unlock_irqrestore(&slots[i].lock, flags);
+      if (hist.count == 0) {
+        continue;
+      }
+      print("vector ");
+      print_int(slots[i].vector);
+      print(" ");
+      print(kind_names[j]);
+      print(": ");
+      print_int(hist.count);
+      print_ns(" times, min ", hist.min);
+      print_ns(" avg ", hist.total / hist.count);
+      print_ns(" p50 ", percentile(&hist, 500));
+      print_ns(" p99 ", percentile(&hist, 990));
+      print_ns(" max ", hist.max);
+      print(" ns\n");
+    }
+  }
+}
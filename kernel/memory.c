@@ -11,3 +11,13 @@ void mem_set(uint8_t *dest, uint8_t val, uint32_t no_bytes) {
     *(dest + i) = val;
   }
 }
+
+/* Return 0 if the two buffers hold the same bytes */
+int mem_cmp(const uint8_t *a, const uint8_t *b, uint32_t no_bytes) {
+  for (int i = 0; i < no_bytes; ++i) {
+    if (a[i] != b[i]) {
+      return a[i] - b[i];
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,192 @@
+/*
+
+PCI
+
+Devices on the PCI bus are set up through their configuration space: 256
+bytes per function, with their IDs, class, base address registers (BARs) and
+interrupt line. Configuration mechanism #1 reaches it through two I/O ports:
+the bus, slot, function and register (a dword) are written to CONFIG_ADDRESS,
+then the register is read or written through CONFIG_DATA. The pair is shared
+by all CPUs, so each access holds pci_lock.
+
+pci_init() enumerates the functions once at boot, from bus 0 and through the
+PCI-to-PCI bridges to the buses behind them, into a table that drivers look
+their devices up in. A slot whose function 0 is absent is empty, and only
+multi-function devices (header type bit 7) are probed past function 0.
+
+*/
+
+#include "include/pci.h"
+#include "include/io.h"
+#include "include/screen.h"
+#include "include/spinlock.h"
+
+#define CONFIG_ADDRESS 0xCF8
+#define CONFIG_DATA 0xCFC
+#define CONFIG_ENABLE 0x80000000
+
+#define NO_SLOTS 32
+#define NO_FUNCS 8
+#define HEADER_MULTI_FUNC 0x800000 // In the header type register
+#define BRIDGE_BUSES 0x18          // Secondary bus number in bits 8-15
+
+#define PCI_CLASS_BRIDGE 0x06
+#define PCI_SUBCLASS_PCI_BRIDGE 0x04
+
+static Spinlock pci_lock;
+static PciDevice devices[PCI_MAX_DEVICES];
+static uint32_t no_devices;
+
+static uint32_t config_address(uint8_t bus, uint8_t slot, uint8_t func,
+                               uint8_t offset) {
+  return CONFIG_ENABLE | (uint32_t)bus << 16 | (uint32_t)slot << 11 |
+         (uint32_t)func << 8 | (offset & 0xFC);
+}
+
+static uint32_t config_read(uint8_t bus, uint8_t slot, uint8_t func,
+                            uint8_t offset) {
+  uint32_t flags = spin_lock_irqsave(&pci_lock);
+  port_long_out(CONFIG_ADDRESS, config_address(bus, slot, func, offset));
+  uint32_t value = port_long_in(CONFIG_DATA);
+  spin_unlock_irqrestore(&pci_lock, flags);
+  return value;
+}
+
+uint32_t pci_read(const PciDevice *device, uint8_t offset) {
+  return config_read(device->bus, device->slot, device->func, offset);
+}
+
+void pci_write(const PciDevice *device, uint8_t offset, uint32_t value) {
+  uint32_t flags = spin_lock_irqsave(&pci_lock);
+  port_long_out(CONFIG_ADDRESS, config_address(device->bus, device->slot,
+                                               device->func, offset));
+  port_long_out(CONFIG_DATA, value);
+  spin_unlock_irqrestore(&pci_lock, flags);
+}
+
+/* Read the IDs, class and interrupt line of a function */
+static void read_device(uint8_t bus, uint8_t slot, uint8_t func,
+                        PciDevice *device) {
+  uint32_t ids = config_read(bus, slot, func, PCI_VENDOR_ID);
+  uint32_t class = config_read(bus, slot, func, PCI_CLASS);
+  device->bus = bus;
+  device->slot = slot;
+  device->func = func;
+  device->vendor_id = ids & 0xFFFF;
+  device->device_id = ids >> 16;
+  device->class = class >> 24;
+  device->subclass = class >> 16 & 0xFF;
+  device->prog_if = class >> 8 & 0xFF;
+  device->irq = config_read(bus, slot, func, PCI_INTERRUPT) & 0xFF;
+}
+
+static int is_present(uint8_t bus, uint8_t slot, uint8_t func) {
+  return (config_read(bus, slot, func, PCI_VENDOR_ID) & 0xFFFF) != 0xFFFF;
+}
+
+static void scan_bus(uint8_t bus);
+
+/* Add a function to the table, then the ones behind it if it is a bridge */
+static void add_function(uint8_t bus, uint8_t slot, uint8_t func) {
+  if (no_devices == PCI_MAX_DEVICES) {
+    return;
+  }
+  PciDevice *device = &devices[no_devices++];
+  read_device(bus, slot, func, device);
+  if (device->class == PCI_CLASS_BRIDGE &&
+      device->subclass == PCI_SUBCLASS_PCI_BRIDGE) {
+    uint8_t secondary = config_read(bus, slot, func, BRIDGE_BUSES) >> 8;
+    if (secondary > bus) { // Buses are numbered depth first, never loops
+      scan_bus(secondary);
+    }
+  }
+}
+
+static void scan_bus(uint8_t bus) {
+  for (uint8_t slot = 0; slot < NO_SLOTS; slot++) {
+    if (!is_present(bus, slot, 0)) {
+      continue;
+    }
+    add_function(bus, slot, 0);
+    if (!(config_read(bus, slot, 0, PCI_HEADER_TYPE) & HEADER_MULTI_FUNC)) {
+      continue;
+    }
+    for (uint8_t func = 1; func < NO_FUNCS; func++) {
+      if (is_present(bus, slot, func)) {
+        add_function(bus, slot, func);
+      }
+    }
+  }
+}
+
+/* Enumerate the PCI functions. Return how many were found. */
+uint32_t pci_init() {
+  scan_bus(0);
+  return no_devices;
+}
+
+/*
+Find the first function of the given class and subclass. Return 1 and fill in
+device if there is one.
+*/
+int pci_find_class(uint8_t class, uint8_t subclass, PciDevice *device) {
+  for (uint32_t i = 0; i < no_devices; i++) {
+    if (devices[i].class == class && devices[i].subclass == subclass) {
+      *device = devices[i];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+Find the first function with the given vendor and device IDs. Return 1 and
+fill in device if there is one.
+*/
+int pci_find_device(uint16_t vendor_id, uint16_t device_id,
+                    PciDevice *device) {
+  for (uint32_t i = 0; i < no_devices; i++) {
+    if (devices[i].vendor_id == vendor_id &&
+        devices[i].device_id == device_id) {
+      *device = devices[i];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Base of the I/O ports or memory range in BAR bar, without its flag bits */
+uint32_t pci_bar(const PciDevice *device, int bar) {
+  uint32_t value = pci_read(device, PCI_BAR0 + bar * 4);
+  return value & PCI_BAR_IO ? value & ~0x3 : value & ~0xF;
+}
+
+/* Set the given PCI_COMMAND_* bits, e.g. to let the device do DMA */
+void pci_enable(const PciDevice *device, uint32_t command) {
+  uint32_t value = pci_read(device, PCI_COMMAND) & 0xFFFF; // Status is RW1C
+  pci_write(device, PCI_COMMAND, value | command);
+}
+
+/* Print every function found, as bus:slot.func, vendor:device and class */
+void print_pci() {
+  for (uint32_t i = 0; i < no_devices; i++) {
+    PciDevice *device = &devices[i];
+    print("pci ");
+    print_int(device->bus);
+    print(":");
+    print_int(device->slot);
+    print(".");
+    print_int(device->func);
+    print(" ");
+    print_hex(device->vendor_id);
+    print(":");
+    print_hex(device->device_id);
+    print(" class ");
+    print_hex(device->class << 8 | device->subclass);
+    if (device->irq != 0xFF) {
+      print(", irq ");
+      print_int(device->irq);
+    }
+    print("\n");
+  }
+}
@@ -7,11 +7,13 @@ Manages and allocated RAM through a page frame allocater
   - Consider implementing a frame stack (constant time allocation and freeing)
   - Could initialize all memory as reserved, and implement a function to set a
 region of memory as useable (call during initialization to record usable memory)
-- The PMM does not guarantee specific or contigous frames
+- The PMM does not guarantee specific or contigous frames, except through
+  alloc_frames() for devices that need a physically contiguous range
 
 */
 
 #include "include/memory.h"
+#include "include/spinlock.h"
 #include <stdint.h>
 
 #define FREE_START 0x100000
@@ -24,6 +26,8 @@ Bit map where each byte represents status of 8 contiguous frames.
 0 = free, 1 = taken.
 */
 uint8_t frame_map[NO_FRAMES];
+static Spinlock frame_map_lock;
+static uint32_t no_frames_used;
 
 void pmm_init() {
   mem_set(frame_map, 0x00, NO_FRAMES / FRAME_MAP_BITS_PER_ROW);
@@ -34,9 +38,11 @@ Allocate and return a physcial address that is free for use.
 Return 0 if no physcial memory is available.
 */
 uintptr_t alloc_frame() {
+  uint32_t flags = spin_lock_irqsave(&frame_map_lock);
   int row = 0;
   while (frame_map[row] == ((1 << FRAME_MAP_BITS_PER_ROW) - 1)) {
     if (row == NO_FRAMES) {
+      spin_unlock_irqrestore(&frame_map_lock, flags);
       return 0;
     }
     row++;
@@ -48,12 +54,46 @@ uintptr_t alloc_frame() {
   }
 
   frame_map[row] = frame_map[row] | (1 << col);
+  no_frames_used++;
+  spin_unlock_irqrestore(&frame_map_lock, flags);
   return FREE_START + (row * FRAME_MAP_BITS_PER_ROW + col) * FRAME_SIZE;
 }
 
+/*
+Allocate no_frames physically contiguous frames, for devices that are given a
+single physical address for them. Return the address of the first, or 0 if no
+free run is long enough.
+*/
+uintptr_t alloc_frames(uint32_t no_frames) {
+  uint32_t flags = spin_lock_irqsave(&frame_map_lock);
+  uint32_t run = 0;
+  for (uint32_t i = 0; i < NO_FRAMES; i++) {
+    if (frame_map[i / FRAME_MAP_BITS_PER_ROW] &
+        1 << i % FRAME_MAP_BITS_PER_ROW) {
+      run = 0;
+    } else if (++run == no_frames) {
+      for (uint32_t j = i + 1 - no_frames; j <= i; j++) {
+        frame_map[j / FRAME_MAP_BITS_PER_ROW] |=
+            1 << j % FRAME_MAP_BITS_PER_ROW;
+      }
+      no_frames_used += no_frames;
+      spin_unlock_irqrestore(&frame_map_lock, flags);
+      return FREE_START + (i + 1 - no_frames) * FRAME_SIZE;
+    }
+  }
+  spin_unlock_irqrestore(&frame_map_lock, flags);
+  return 0;
+}
+
 void free_frame(uintptr_t phys_addr) {
   int frame_map_loc = (phys_addr - FREE_START) / FRAME_SIZE;
   int col = frame_map_loc % FRAME_MAP_BITS_PER_ROW;
   int row = (frame_map_loc - col) / FRAME_MAP_BITS_PER_ROW;
+  uint32_t flags = spin_lock_irqsave(&frame_map_lock);
   frame_map[row] = frame_map[row] & ~(1 << col);
+  no_frames_used--;
+  spin_unlock_irqrestore(&frame_map_lock, flags);
 }
+
+/* Number of frames currently allocated, for leak checks */
+uint32_t pmm_frames_used() { return no_frames_used; }
@@ -6,187 +6,1134 @@ Round-robin Scheduling
 Each process has their own page directory, and each thread has their own stack
 (however each thread shares the kernel head for now).
 
+Kernel threads run in ring 0. User threads run in ring 3 on a stack mapped
+into their process' PD, and enter the kernel (onto their kernel stack, which
+the TSS points to while they run) through interrupts and system calls.
+
+- Every CPU has its own FIFO run queue of READY threads. On every time slice
+  the running thread goes to the back and the thread at the front is switched
+  in.
+- New threads go to the least loaded CPU. A CPU whose run queue is empty
+  steals the front thread of the busiest other queue before going idle.
+- BLOCKED threads are on no run queue (they sit on a wait queue, see sync.c)
+  until thread_wake() puts them back on the run queue of the CPU they last ran
+  on. An idle CPU is woken with an IPI when a thread is queued on it.
+- When nothing is READY the CPU's idle thread halts it.
+- Periodic real-time threads (sched_set_periodic()) run ahead of every
+  best-effort thread, earliest deadline first (EDF). Each is admitted on one
+  CPU only while the budgets of the real-time threads there add up to at most
+  RT_UTIL_MAX of its time, which is what lets EDF meet every deadline. Their
+  jobs are released by the timer wheel and preempt at once, and a job that
+  uses up its budget runs as best-effort until the next one. They are never
+  stolen.
+- Exited threads are put on a zombie list and switched away from for good.
+  The reaper, a kernel thread, frees them (and processes left without
+  threads) in batches, so no memory is freed from interrupt context.
+- Threads give up the CPU voluntarily through yield(), which calls the
+  scheduler directly. Switching (swtch()) only saves the callee-saved
+  registers and swaps kernel stacks, whether the scheduler was entered from
+  an IRQ or a thread. A preempted thread's interrupt frame stays further up
+  its stack and is unwound once it is switched back in. GS is rebased on the
+  next thread's TLS block.
+- Lazy TLB: CR3 is only reloaded for a thread of a process with user threads
+  whose PD is not loaded yet. Other threads (the reaper, workers, the idle
+  threads) only touch kernel memory, which every PD maps alike, so they borrow
+  the loaded PD and leave its TLB entries alone. A borrowed PD is dropped
+  before its process is freed.
+- Preemption can be held off without disabling interrupts (preempt_disable()).
+  A CPU's count is checked by schedule(), which then only sets need_resched,
+  and the switch happens in preempt_enable().
+
+Locking
+- A CPU's run queue lock is held from the start of schedule() until the next
+  thread's stack is loaded (swtch() releases it). Until then the previous
+  thread can neither be woken nor stolen by another CPU, so no two CPUs ever
+  run on the same stack.
+- Stealing only ever try-locks the other queue, so two CPUs stealing from
+  each other cannot deadlock.
+- scheduler.lock protects the process list and each process' thread list.
+  Both are doubly linked with a tail pointer, so adding to the end and
+  unlinking do not walk them.
+- It also protects pid and tid allocation (ids.c) and the hash tables that
+  find a process or thread by its ID. IDs are dense, so the low bits spread
+  them evenly over the buckets.
+
 ---------------------
 */
 
 #include "include/process.h"
+#include "include/elf.h"
+#include "include/fpu.h"
+#include "include/gdt.h"
 #include "include/idt.h"
+#include "include/ids.h"
+#include "include/irq.h"
+#include "include/lapic.h"
+#include "include/latency.h"
+#include "include/pmm.h"
 #include "include/screen.h"
+#include "include/smp.h"
+#include "include/sync.h"
+#include "include/timer.h"
+#include "include/tls.h"
+#include "include/vdso.h"
 #include "include/vmm.h"
 #include <stddef.h>
 
 #define STACK_SIZE (4096 * 4)
 
-uint8_t next_pid = 0;
-uint8_t next_tid = 0;
+#define USER_STACK_TOP VDSO_VA // User stacks grow down from the vDSO page
+#define USER_STACK_SIZE (4096 * 4)
+#define PAGE_SIZE 4096
+
+#define ID_HASH_SIZE 1024
+#define ID_BUCKET(id) ((id) & (ID_HASH_SIZE - 1))
 
 typedef struct {
+  Spinlock lock;
   Process *head_process;
-  Process *curr_running_process;
+  Process *tail_process;
+  Process *kernel_process;
 } Scheduler;
 
-Scheduler scheduler = {NULL, NULL};
+Scheduler scheduler = {{0}, NULL, NULL, NULL};
 
-Process *create_process() {
-  __asm__ __volatile__("cli");
+/* Protected by scheduler.lock */
+static IdAllocator pids;
+static IdAllocator tids;
+static Process *pid_hash[ID_HASH_SIZE];
+static Thread *tid_hash[ID_HASH_SIZE];
+
+/* Exited threads waiting to be freed by the reaper thread */
+static struct {
+  WaitQueue wq;    // The reaper sleeps here, wq.lock also protects zombies
+  Thread *zombies; // Linked through queue_next
+  Thread *thread;
+} reaper;
+
+extern ProcessPd *process_pds;
+extern void user_thread_entry();
+extern void kthread_entry();
+extern void irq_return();
+extern void swtch(uintptr_t *prev_sp, uintptr_t next_sp,
+                  volatile uint32_t *lock);
+
+#define RT_UTIL_MAX (RT_UTIL_ONE / 10 * 9) // Leaves time for IRQs and the rest
+#define RT_MIN_PERIOD (1000000000 / HZ)   // Jobs are released on timer ticks
+
+/* What swtch() leaves on the stack of a thread that is switched out */
+typedef struct {
+  uint32_t edi, esi, ebx, ebp;
+  uint32_t eip; // Where swtch() returns to
+} SwitchFrame;
+
+/*
+
+Run queue
+
+*/
+
+/* Whether thread is scheduled by its deadline rather than as best-effort */
+static int rt_eligible(Thread *thread) {
+  return thread->rt.period != 0 && !thread->rt.throttled;
+}
+
+/* rq->lock must be held for these */
+static void run_queue_push(RunQueue *rq, Thread *thread) {
+  thread->status = READY;
+  thread->last_switch = clock_monotonic();
+  thread->queue_next = NULL;
+  if (rt_eligible(thread)) {
+    // Behind those with the same deadline, so ties run in FIFO order
+    Thread **link = &rq->rt_head;
+    while (*link != NULL && (*link)->rt.deadline <= thread->rt.deadline) {
+      link = &(*link)->queue_next;
+    }
+    thread->queue_next = *link;
+    *link = thread;
+    rq->nr_rt++;
+    return;
+  }
+  if (rq->tail == NULL) {
+    rq->head = thread;
+  } else {
+    rq->tail->queue_next = thread;
+  }
+  rq->tail = thread;
+  rq->nr_ready++;
+}
+
+static Thread *run_queue_pop(RunQueue *rq) {
+  Thread *thread = rq->head;
+  if (thread != NULL) {
+    rq->head = thread->queue_next;
+    if (rq->head == NULL) {
+      rq->tail = NULL;
+    }
+    thread->queue_next = NULL;
+    rq->nr_ready--;
+  }
+  return thread;
+}
+
+/* Take the real-time thread with the earliest deadline */
+static Thread *rt_queue_pop(RunQueue *rq) {
+  Thread *thread = rq->rt_head;
+  if (thread != NULL) {
+    rq->rt_head = thread->queue_next;
+    thread->queue_next = NULL;
+    rq->nr_rt--;
+  }
+  return thread;
+}
+
+/* Update cpu's counters in the vDSO page. cpu->rq.lock must be held. */
+static void sched_publish(Cpu *cpu) {
+  vdso_set_cpu(cpu->id, cpu->switches, cpu->rq.nr_ready + cpu->rq.nr_rt);
+}
+
+/* Start a job of a real-time thread whose run time so far is run_ns */
+static void rt_new_job(Thread *thread, uint64_t release, uint64_t run_ns) {
+  thread->rt.release = release;
+  thread->rt.deadline = release + thread->rt.period;
+  thread->rt.job_run = run_ns;
+  thread->rt.throttled = 0;
+}
+
+/*
+Queue a thread on cpu and make sure cpu notices: an idle CPU is woken with an
+IPI, and the PIT needs to time a slice on the BSP. A real-time thread preempts
+right away, through an IPI or need_resched (checked when an interrupt
+returns, see vector.c). Interrupts must be disabled.
+*/
+static void sched_enqueue(Cpu *cpu, Thread *thread) {
+  spin_lock(&cpu->rq.lock);
+  thread->cpu = cpu;
+  // Woken after its deadline (not by its period), so its old job is over
+  uint64_t now = clock_monotonic();
+  if (thread->rt.period != 0 && now >= thread->rt.deadline) {
+    rt_new_job(thread, now, thread->run_ns);
+  }
+  int preempt = rt_eligible(thread);
+  run_queue_push(&cpu->rq, thread);
+  sched_publish(cpu);
+  spin_unlock(&cpu->rq.lock);
+
+  if (cpu == this_cpu()) {
+    cpu->need_resched |= preempt;
+  } else if (preempt || cpu->curr_thread == cpu->idle_thread) {
+    lapic_send_ipi(cpu->apic_id, RESCHED_VECTOR);
+  }
+  if (cpu == &cpus[0]) {
+    timer_update();
+  }
+}
+
+/* Threads READY or running on cpu, besides its idle thread */
+static uint32_t cpu_load(Cpu *cpu) {
+  return cpu->rq.nr_ready + cpu->rq.nr_rt +
+         (cpu->curr_thread != cpu->idle_thread);
+}
+
+static Cpu *least_loaded_cpu() {
+  Cpu *best = this_cpu();
+  for (uint32_t i = 0; i < no_cpus; i++) {
+    if (cpus[i].online && cpu_load(&cpus[i]) < cpu_load(best)) {
+      best = &cpus[i];
+    }
+  }
+  return best;
+}
+
+/*
+Take a READY thread from the CPU with the most of them. The other queue is only
+try-locked, since this CPU already holds its own. Return NULL if there was
+nothing to steal.
+*/
+static Thread *steal_thread(Cpu *cpu) {
+  Cpu *victim = NULL;
+  uint32_t most = 0;
+  for (uint32_t i = 0; i < no_cpus; i++) {
+    if (&cpus[i] != cpu && cpus[i].rq.nr_ready > most) {
+      victim = &cpus[i];
+      most = victim->rq.nr_ready;
+    }
+  }
+  if (victim == NULL || !spin_trylock(&victim->rq.lock)) {
+    return NULL;
+  }
+  Thread *thread = run_queue_pop(&victim->rq);
+  sched_publish(victim);
+  spin_unlock(&victim->rq.lock);
+  if (thread != NULL) {
+    cpu->steals++;
+  }
+  return thread;
+}
+
+/*
+
+Creation
+
+*/
+
+/* Return NULL if every pid is in use. scheduler.lock must be held. */
+static Process *new_process(ProcessPd *pd) {
+  int32_t pid = id_alloc(&pids);
+  if (pid < 0) {
+    return NULL;
+  }
   Process *process = (Process *)kmalloc(sizeof(Process));
-  process->pid = next_pid++;
-  process->pd = create_process_pd();
-  process->next = NULL;
+  process->pid = pid;
+  process->pd = pd;
   process->head_thread = NULL;
-  process->curr_running_thread = NULL;
-  if (scheduler.head_process == NULL) {
-    scheduler.head_process = process;
+  process->tail_thread = NULL;
+  process->user_stack_top = USER_STACK_TOP;
+  process->image = NULL;
+  process->user_space = 0;
+  process->hash_next = pid_hash[ID_BUCKET(pid)];
+  pid_hash[ID_BUCKET(pid)] = process;
+  process->next = NULL;
+  process->prev = scheduler.tail_process;
+  if (process->prev != NULL) {
+    process->prev->next = process;
   } else {
-    Process *tail_process = scheduler.head_process;
-    while (tail_process->next != NULL) {
-      tail_process = tail_process->next;
-    }
-    tail_process->next = process;
+    scheduler.head_process = process;
   }
-  __asm__ __volatile__("sti");
+  scheduler.tail_process = process;
   return process;
 }
 
-Thread *create_thread(Process *process, void (*function)(uintptr_t),
-                      uintptr_t arg) {
-  __asm__ __volatile__("cli");
+/* Give thread a tid, or return -1 if every one is in use. scheduler.lock must
+ * be held. */
+static int add_thread(Process *process, Thread *thread) {
+  int32_t tid = id_alloc(&tids);
+  if (tid < 0) {
+    return -1;
+  }
+  thread->tid = tid;
+  thread->hash_next = tid_hash[ID_BUCKET(tid)];
+  tid_hash[ID_BUCKET(tid)] = thread;
+  thread->next = NULL;
+  thread->prev = process->tail_thread;
+  if (thread->prev != NULL) {
+    thread->prev->next = thread;
+  } else {
+    process->head_thread = thread;
+  }
+  process->tail_thread = thread;
+  return 0;
+}
+
+static void init_accounting(Thread *thread) {
+  thread->run_ns = 0;
+  thread->wait_ns = 0;
+  thread->last_switch = clock_monotonic();
+  thread->nr_voluntary = 0;
+  thread->nr_involuntary = 0;
+  thread->wake_vector = 0;
+}
+
+/* Push a SwitchFrame that makes swtch() return to eip. Return the new sp. */
+static uintptr_t push_switch_frame(uintptr_t sp, uintptr_t eip) {
+  SwitchFrame *frame = (SwitchFrame *)(sp - sizeof(SwitchFrame));
+  frame->edi = 0;
+  frame->esi = 0;
+  frame->ebx = 0;
+  frame->ebp = 0;
+  frame->eip = eip;
+  return (uintptr_t)frame;
+}
+
+/*
+Create a thread whose first time slice starts executing function(arg). Its
+stack is set up as if function had been called by kthread_entry, which swtch()
+returns to. Return NULL if every tid is in use. scheduler.lock must be held.
+*/
+static Thread *new_thread(Process *process, void (*function)(uintptr_t),
+                          uintptr_t arg) {
   Thread *thread = (Thread *)kmalloc(sizeof(Thread));
-  thread->tid = next_tid++;
+  if (add_thread(process, thread) != 0) {
+    kfree(thread);
+    return NULL;
+  }
   thread->status = READY;
   thread->process = process;
-  thread->next = NULL;
+  thread->queue_next = NULL;
+  thread->cpu = NULL;
+  thread->fpu_state = NULL;
+  thread->fpu_cpu = NULL;
+  init_accounting(thread);
+  thread->rt = (RtParams){0};
+  thread->tls = tls_alloc(thread);
   thread->k_stack = kmalloc(STACK_SIZE);
-  uintptr_t new_stack = (uintptr_t)thread->k_stack + STACK_SIZE;
-  thread->context =
-      (CpuContext *)(new_stack - sizeof(CpuContext) -
-                     8); // - 8 (store return addr of 0 and arg at top of stack)
-  thread->context->edi = 0;
-  thread->context->esi = 0;
-  thread->context->ebp = new_stack;
-  thread->context->esp = (uintptr_t)&thread->context->int_no;
-  thread->context->ebx = 0;
-  thread->context->edx = 0;
-  thread->context->ecx = 0;
-  thread->context->eax = 0;
-  thread->context->int_no = 32;
-  thread->context->err_code = 0;
-  thread->context->eip = (uintptr_t)function;
-  thread->context->cs = 0x8;
-  thread->context->eflags = 0x202;
-  *(uintptr_t *)((uintptr_t)thread->context + sizeof(CpuContext)) = 0;
-  *(uintptr_t *)((uintptr_t)thread->context + sizeof(CpuContext) + 4) = arg;
-  if (process->head_thread == NULL) {
-    process->head_thread = thread;
-  } else {
-    Thread *tail_thread = process->head_thread;
-    while (tail_thread->next != NULL) {
-      tail_thread = tail_thread->next;
+  uintptr_t *sp = (uintptr_t *)(thread->k_stack + STACK_SIZE);
+  *--sp = arg;
+  *--sp = 0; // Return address, threads end with thread_exit()
+  *--sp = (uintptr_t)function;
+  thread->k_esp = push_switch_frame((uintptr_t)sp, (uintptr_t)kthread_entry);
+  return thread;
+}
+
+/*
+Turn a new thread into one that starts in user mode, on a fresh stack mapped
+into its process' PD. It starts in user_thread_entry (see user_entry.asm),
+which calls function(arg) and exits the thread once it returns. It gets there
+through an interrupt frame at the top of its kernel stack, which swtch()
+returns into. A page is left unmapped below each stack so an overflow faults.
+Return -1, with nothing mapped, if there is no memory for the stack.
+scheduler.lock must be held.
+*/
+static int make_user_thread(Thread *thread, void (*function)(uintptr_t),
+                            uintptr_t arg) {
+  Process *process = thread->process;
+  uintptr_t stack_top = process->user_stack_top;
+  for (uintptr_t va = stack_top - USER_STACK_SIZE; va < stack_top;
+       va += PAGE_SIZE) {
+    uintptr_t frame = alloc_frame();
+    if (frame == 0) {
+      for (uintptr_t done = stack_top - USER_STACK_SIZE; done < va;
+           done += PAGE_SIZE) {
+        unmap_user_page(process->pd, done);
+      }
+      return -1;
     }
-    tail_thread->next = thread;
+    map_user_page(process->pd, va, frame);
   }
-  __asm__ __volatile__("sti");
+  process->user_space = 1;
+  process->user_stack_top -= USER_STACK_SIZE + PAGE_SIZE;
+
+  CpuContext *context = (CpuContext *)((uintptr_t)thread->k_stack +
+                                       STACK_SIZE - sizeof(CpuContext));
+  context->edi = 0;
+  context->esi = 0;
+  context->ebp = 0;
+  context->esp = 0;
+  context->ebx = (uintptr_t)function;
+  context->edx = 0;
+  context->ecx = 0;
+  context->eax = arg;
+  context->gs = USER_DS;
+  context->fs = USER_DS;
+  context->es = USER_DS;
+  context->ds = USER_DS;
+  context->int_no = 32;
+  context->err_code = 0;
+  context->eip = (uintptr_t)user_thread_entry;
+  context->cs = USER_CS;
+  context->eflags = 0x202;
+  context->useresp = stack_top;
+  context->ss = USER_DS;
+  thread->k_esp = push_switch_frame((uintptr_t)context, (uintptr_t)irq_return);
+  return 0;
+}
+
+/* Adopt the code running on the calling CPU as a thread of the kernel */
+static Thread *adopt_thread() {
+  Thread *thread = (Thread *)kmalloc(sizeof(Thread));
+  add_thread(scheduler.kernel_process, thread); // Only fails with no IDs left
+  thread->status = RUNNING;
+  thread->process = scheduler.kernel_process;
+  thread->queue_next = NULL;
+  thread->cpu = this_cpu();
+  thread->fpu_state = NULL;
+  thread->fpu_cpu = NULL;
+  init_accounting(thread);
+  thread->rt = (RtParams){0};
+  thread->tls = tls_alloc(thread);
+  thread->k_esp = 0; // Saved on the first switch
+  thread->k_stack = 0;    // Boot stacks are not freed
   return thread;
 }
 
-extern ProcessPd *process_pds;
+/* Return NULL if every pid is in use */
+Process *create_process() {
+  ProcessPd *pd = create_process_pd();
+  uint32_t flags = spin_lock_irqsave(&scheduler.lock);
+  Process *process = new_process(pd);
+  spin_unlock_irqrestore(&scheduler.lock, flags);
+  if (process == NULL) {
+    delete_process_pd(pd);
+  }
+  return process;
+}
+
+/* Return NULL if every tid is in use */
+Thread *create_thread(Process *process, void (*function)(uintptr_t),
+                      uintptr_t arg) {
+  uint32_t flags = spin_lock_irqsave(&scheduler.lock);
+  Thread *thread = new_thread(process, function, arg);
+  spin_unlock(&scheduler.lock);
+  if (thread != NULL) {
+    sched_enqueue(least_loaded_cpu(), thread);
+  }
+  irq_restore(flags);
+  return thread;
+}
+
+static void unlink_thread(Thread *thread);
+
+/*
+Create a thread that runs function(arg) in user mode (ring 3). Return NULL if
+every tid is in use or there is no memory for its stack.
+*/
+Thread *create_user_thread(Process *process, void (*function)(uintptr_t),
+                           uintptr_t arg) {
+  uint32_t flags = spin_lock_irqsave(&scheduler.lock);
+  Thread *thread = new_thread(process, function, arg);
+  if (thread != NULL && make_user_thread(thread, function, arg) != 0) {
+    unlink_thread(thread);
+    spin_unlock_irqrestore(&scheduler.lock, flags);
+    tls_free(thread);
+    kfree((void *)thread->k_stack);
+    kfree(thread);
+    return NULL;
+  }
+  spin_unlock(&scheduler.lock);
+  if (thread != NULL) {
+    sched_enqueue(least_loaded_cpu(), thread);
+  }
+  irq_restore(flags);
+  return thread;
+}
+
+static void idle_loop() {
+  while (1) {
+    __asm__ __volatile__("hlt");
+  }
+}
+
+static void reaper_loop();
+
+/*
+Create the kernel process (which uses the kernel PD), adopt the code that is
+currently running (kmain) as its first thread, and create the BSP's idle
+thread and the reaper. Interrupts must be disabled.
+*/
+void sched_init() {
+  Cpu *cpu = this_cpu();
+  cpu->active_pd = process_pds;
+  scheduler.kernel_process = new_process(process_pds);
+  cpu->curr_thread = adopt_thread();
+  tls_switch(cpu, cpu->curr_thread);
+  cpu->idle_thread = new_thread(scheduler.kernel_process, idle_loop, 0);
+  cpu->idle_thread->cpu = cpu;
+
+  wait_queue_init(&reaper.wq);
+  reaper.zombies = NULL;
+  reaper.thread = new_thread(scheduler.kernel_process, reaper_loop, 0);
+  sched_enqueue(cpu, reaper.thread);
+}
+
+/*
+Join the scheduler on an AP. The code running on it (ap_main) is adopted as
+its idle thread. Interrupts must be disabled.
+*/
+void sched_init_ap() {
+  Cpu *cpu = this_cpu();
+  spin_lock(&scheduler.lock);
+  Thread *idle_thread = adopt_thread();
+  spin_unlock(&scheduler.lock);
+  cpu->idle_thread = idle_thread;
+  cpu->curr_thread = idle_thread;
+  cpu->active_pd = process_pds; // Loaded by the trampoline
+  tls_switch(cpu, idle_thread);
+}
+
+/*
 
-void delete_process() {
-  if (scheduler.head_process == scheduler.curr_running_process) {
-    scheduler.head_process = scheduler.curr_running_process->next;
+Deletion
+
+*/
+
+/*
+Return 1 while a CPU may still be on the stack of an exited thread. The CPU
+holds its run queue lock from before it stops being the current thread until
+swtch() has left its stack.
+*/
+static int thread_on_cpu(Thread *thread) {
+  Cpu *cpu = thread->cpu;
+  uint32_t flags = spin_lock_irqsave(&cpu->rq.lock);
+  int on_cpu = cpu->curr_thread == thread;
+  spin_unlock_irqrestore(&cpu->rq.lock, flags);
+  return on_cpu;
+}
+
+/*
+Remove a thread or process from its hash chain, which only holds the few IDs
+that share its bucket. scheduler.lock must be held.
+*/
+static void tid_hash_del(Thread *thread) {
+  Thread **link = &tid_hash[ID_BUCKET(thread->tid)];
+  while (*link != thread) {
+    link = &(*link)->hash_next;
+  }
+  *link = thread->hash_next;
+}
+
+static void pid_hash_del(Process *process) {
+  Process **link = &pid_hash[ID_BUCKET(process->pid)];
+  while (*link != process) {
+    link = &(*link)->hash_next;
+  }
+  *link = process->hash_next;
+}
+
+/* scheduler.lock must be held */
+static void unlink_thread(Thread *thread) {
+  Process *process = thread->process;
+  if (thread->prev != NULL) {
+    thread->prev->next = thread->next;
   } else {
-    Process *prev = scheduler.head_process;
-    while (prev->next != scheduler.curr_running_process) {
-      prev = prev->next;
-    }
-    prev->next = scheduler.curr_running_process->next;
+    process->head_thread = thread->next;
+  }
+  if (thread->next != NULL) {
+    thread->next->prev = thread->prev;
+  } else {
+    process->tail_thread = thread->prev;
   }
-  load_pd(process_pds->pd_pa);
-  delete_process_pd(scheduler.curr_running_process->pd);
-  kfree(scheduler.curr_running_process);
-  scheduler.curr_running_process = NULL;
+  tid_hash_del(thread);
+  id_free(&tids, thread->tid);
 }
 
-void *stack_to_delete = NULL;
+/* Give back the CPU time a real-time thread was admitted with. scheduler.lock
+ * must be held. */
+static void rt_release(Thread *thread) {
+  if (thread->rt.cpu != NULL) {
+    thread->rt.cpu->rt_util -= thread->rt.util;
+  }
+  thread->rt.period = 0;
+  thread->rt.util = 0;
+  thread->rt.throttled = 0;
+  thread->rt.cpu = NULL;
+}
 
-void delete_thread() {
-  if (scheduler.curr_running_process->head_thread ==
-      scheduler.curr_running_process->curr_running_thread) {
-    scheduler.curr_running_process->head_thread =
-        scheduler.curr_running_process->curr_running_thread->next;
+/* scheduler.lock must be held */
+static void unlink_process(Process *process) {
+  if (process->prev != NULL) {
+    process->prev->next = process->next;
+  } else {
+    scheduler.head_process = process->next;
+  }
+  if (process->next != NULL) {
+    process->next->prev = process->prev;
   } else {
-    Thread *prev = scheduler.curr_running_process->head_thread;
-    while (prev->next != scheduler.curr_running_process->curr_running_thread) {
-      prev = prev->next;
+    scheduler.tail_process = process->prev;
+  }
+  pid_hash_del(process);
+  id_free(&pids, process->pid);
+}
+
+/* Switch the calling CPU to the kernel PD if it borrows a dying one */
+static void drop_dying_pd(Cpu *cpu) {
+  if (cpu->active_pd->dying) {
+    load_pd(process_pds->pd_pa);
+    cpu->active_pd = process_pds;
+    cpu->cr3_loads++;
+  }
+}
+
+/*
+Wait until no CPU has pd loaded, now that none of its threads run. A kernel
+thread may still borrow it: the CPU is sent a reschedule IPI and drops it in
+schedule_next(). No CPU loads a dying PD again.
+*/
+static void release_pd(ProcessPd *pd) {
+  pd->dying = 1;
+  __sync_synchronize();
+  uint32_t flags = irq_save();
+  drop_dying_pd(this_cpu());
+  irq_restore(flags);
+  for (uint32_t i = 0; i < no_cpus; i++) {
+    if (cpus[i].active_pd == pd) {
+      lapic_send_ipi(cpus[i].apic_id, RESCHED_VECTOR);
+      while (cpus[i].active_pd == pd) {
+        __asm__ __volatile__("pause");
+      }
     }
-    prev->next = scheduler.curr_running_process->curr_running_thread->next;
   }
-  stack_to_delete =
-      (void *)scheduler.curr_running_process->curr_running_thread->k_stack;
-  scheduler.curr_running_process->curr_running_thread = NULL;
+}
+
+/* Free an unlinked process, its PD and user pages */
+static void free_process(Process *process) {
+  release_pd(process->pd);
+  delete_process_pd(process->pd);
+  elf_exit(process);
+  kfree(process);
+}
+
+/* Free a process that has no threads, e.g. when creating its first failed */
+void delete_process(Process *process) {
+  uint32_t flags = spin_lock_irqsave(&scheduler.lock);
+  unlink_process(process);
+  spin_unlock_irqrestore(&scheduler.lock, flags);
+  free_process(process);
+}
+
+/*
+Free an exited thread, and its process (PD, user pages) if it was the last
+one. Runs in the reaper with interrupts enabled, except while locks are held.
+*/
+static void reap_thread(Thread *thread) {
+  while (thread_on_cpu(thread)) {
+    __asm__ __volatile__("pause"); // thread_exit() is about to switch away
+  }
 
-  if (scheduler.curr_running_process->head_thread == NULL) {
-    delete_process();
+  uint32_t flags = spin_lock_irqsave(&scheduler.lock);
+  Process *process = thread->process;
+  rt_release(thread);
+  unlink_thread(thread);
+  int last_thread = process->head_thread == NULL;
+  if (last_thread) {
+    unlink_process(process);
+  }
+  spin_unlock_irqrestore(&scheduler.lock, flags);
+
+  fpu_free(thread);
+  tls_free(thread);
+  kfree((void *)thread->k_stack);
+  kfree(thread);
+  if (last_thread) {
+    free_process(process);
   }
 }
 
-extern void swtch(CpuContext *new);
+/* Take every zombie at once, and sleep while there are none */
+static void reaper_loop() {
+  while (1) {
+    uint32_t flags = spin_lock_irqsave(&reaper.wq.lock);
+    while (reaper.zombies == NULL) {
+      wait_queue_sleep_locked(&reaper.wq, flags);
+      flags = spin_lock_irqsave(&reaper.wq.lock);
+    }
+    Thread *batch = reaper.zombies;
+    reaper.zombies = NULL;
+    spin_unlock_irqrestore(&reaper.wq.lock, flags);
 
-void schedule(CpuContext *context) {
-  if (stack_to_delete != NULL) {
-    kfree(stack_to_delete);
-    stack_to_delete = NULL;
+    while (batch != NULL) {
+      Thread *thread = batch;
+      batch = batch->queue_next;
+      reap_thread(thread);
+    }
   }
+}
+
+/*
 
-  if (scheduler.head_process == NULL) {
+Scheduling
+
+*/
+
+/*
+Charge the time since the last switch to prev (running) and next (waiting), and
+count why prev gave up the CPU. cpu->rq.lock must be held.
+*/
+static void account_switch(Cpu *cpu, Thread *prev, Thread *next,
+                           int voluntary) {
+  uint64_t now = clock_monotonic();
+  prev->run_ns += now - prev->last_switch;
+  prev->last_switch = now;
+  if (voluntary || prev->status != RUNNING) {
+    prev->nr_voluntary++;
+  } else {
+    prev->nr_involuntary++;
+  }
+  if (next != cpu->idle_thread) { // Idle threads are never queued
+    next->wait_ns += now - next->last_switch;
+  }
+  next->last_switch = now;
+}
+
+/*
+Throttle a running real-time thread whose job has used up its budget, checked
+on every tick. It is best-effort until its next job, so it cannot take the time
+the other real-time threads were admitted with.
+*/
+static void rt_check_budget(Thread *thread) {
+  if (!rt_eligible(thread)) {
     return;
   }
+  uint64_t now = clock_monotonic();
+  uint64_t job_ns = thread->run_ns + (now - thread->last_switch) -
+                    thread->rt.job_run;
+  if (job_ns >= thread->rt.budget) {
+    thread->rt.throttled = 1;
+    thread->rt.overruns++;
+  }
+}
 
-  if (scheduler.curr_running_process != NULL &&
-      scheduler.curr_running_process->head_thread == NULL) {
-    delete_process();
+/*
+Choose the thread to run after prev: the real-time thread with the earliest
+deadline, else the front best-effort thread, else one stolen from another CPU.
+Return NULL if prev should keep running. cpu->rq.lock must be held.
+*/
+static Thread *pick_next(Cpu *cpu, Thread *prev) {
+  int prev_runs = prev->status == RUNNING && prev != cpu->idle_thread;
+  if (prev_runs) {
+    rt_check_budget(prev);
   }
-  if (scheduler.curr_running_process != NULL &&
-      scheduler.curr_running_process->curr_running_thread != NULL) {
-    if (scheduler.curr_running_process->curr_running_thread->status == DEAD) {
-      delete_thread();
-    } else {
-      scheduler.curr_running_process->curr_running_thread->context = context;
-    }
+  int prev_rt = prev_runs && rt_eligible(prev);
+  Thread *rt = cpu->rq.rt_head;
+  if (rt != NULL && (!prev_rt || rt->rt.deadline < prev->rt.deadline)) {
+    return rt_queue_pop(&cpu->rq);
+  }
+  if (prev_rt) {
+    return NULL; // Ahead of every best-effort thread
   }
+  Thread *next = run_queue_pop(&cpu->rq);
+  if (next == NULL && !prev_runs) {
+    next = steal_thread(cpu);
+  }
+  return next;
+}
 
-  Process *next_process = scheduler.curr_running_process == NULL ||
-                                  scheduler.curr_running_process->next == NULL
-                              ? scheduler.head_process
-                              : scheduler.curr_running_process->next;
-  if (next_process == NULL) {
+/*
+Load the PD of next's process, unless it is loaded already or the process has
+no user threads, whose PD nothing needs: next then borrows the loaded one, as
+it only touches kernel memory. Switching from a user process to such a thread
+and back thus reloads nothing and keeps the user TLB entries.
+*/
+static void switch_pd(Cpu *cpu, Thread *prev, Thread *next) {
+  ProcessPd *pd = next->process->pd;
+  if (!next->process->user_space || cpu->active_pd == pd) {
+    if (next->process != prev->process) {
+      cpu->cr3_skips++;
+    }
     return;
   }
-  if (next_process != scheduler.curr_running_process) {
-    load_pd(next_process->pd->pd_pa);
+  load_pd(pd->pd_pa);
+  cpu->active_pd = pd;
+  cpu->cr3_loads++;
+}
+
+/*
+Record how long next took to run since the interrupt that woke it, right before
+swtch(). The running handlers, if any, are switched away from, so threads they
+would wake from now on are not theirs to blame.
+*/
+static void trace_wakeup(Cpu *cpu, Thread *next) {
+  if (next->wake_vector != 0) {
+    latency_record(next->wake_vector, LAT_WAKEUP, rdtsc() - next->wake_tsc);
+    next->wake_vector = 0;
   }
+  cpu->irq_vector = 0;
+}
 
-  Thread *next_thread = next_process->curr_running_thread == NULL ||
-                                next_process->curr_running_thread->next == NULL
-                            ? next_process->head_thread
-                            : next_process->curr_running_thread->next;
-  if (next_thread == NULL) {
+/*
+Switch to the next thread, if there is one. Interrupts must be disabled. Returns
+once the calling thread is switched back in, possibly on another CPU. voluntary
+is set when the thread asked to give up the CPU.
+*/
+static void schedule_next(int voluntary) {
+  Cpu *cpu = this_cpu();
+  Thread *prev = cpu->curr_thread;
+  if (prev == NULL) {
     return;
   }
+  if (!voluntary && cpu->preempt_count != 0 && prev->status == RUNNING) {
+    cpu->need_resched = 1; // See preempt_enable()
+    return;
+  }
+  drop_dying_pd(cpu); // Even without a switch, see release_pd()
+
+  spin_lock(&cpu->rq.lock);
+  cpu->need_resched = 0;
+
+  Thread *next = pick_next(cpu, prev);
+  if (next == NULL) {
+    if (prev->status == RUNNING) {
+      spin_unlock(&cpu->rq.lock);
+      return; // Nothing else wants the CPU
+    }
+    next = cpu->idle_thread;
+  }
+
+  account_switch(cpu, prev, next, voluntary);
+  if (prev->status == RUNNING) {
+    if (prev == cpu->idle_thread) {
+      prev->status = READY;
+    } else {
+      run_queue_push(&cpu->rq, prev);
+    }
+  }
+
+  switch_pd(cpu, prev, next);
+  next->status = RUNNING;
+  next->cpu = cpu;
+  cpu->curr_thread = next;
+  cpu->tss.esp0 = next->k_stack ? next->k_stack + STACK_SIZE : cpu->stack;
+  cpu->switches++;
+  sched_publish(cpu);
+  fpu_switch(cpu, prev, next);
+  tls_switch(cpu, next);
+  if (TRACE_LATENCY) {
+    trace_wakeup(cpu, next);
+  }
+  swtch(&prev->k_esp, next->k_esp, &cpu->rq.lock.locked);
+}
+
+/* Preempt the running thread, on the way out of an interrupt (vector.c) */
+void schedule() { schedule_next(0); }
+
+/*
+Return 1 if a thread other than the running one is waiting for the BSP. Used
+to time slices with the PIT, which only interrupts the BSP.
+*/
+int schedule_pending() {
+  return cpus[0].rq.head != NULL || cpus[0].rq.rt_head != NULL;
+}
+
+/*
+Keep the running thread on its CPU until the matching preempt_enable(), for
+code that must not be switched away from but need not keep IRQs out (e.g. it
+loaded another PD). IRQ handlers still run, a switch they ask for is deferred.
+Sections nest. The thread must not block or yield meanwhile, as the count
+belongs to the CPU. The increment is a single instruction, so it cannot be
+split by a switch to another CPU.
+*/
+void preempt_disable() {
+  __asm__ __volatile__("incl %%fs:%c0"
+                       :
+                       : "i"(offsetof(Cpu, preempt_count))
+                       : "memory");
+}
+
+/* Run a switch deferred meanwhile, unless interrupts are disabled */
+void preempt_enable() {
+  __asm__ __volatile__("decl %%fs:%c0"
+                       :
+                       : "i"(offsetof(Cpu, preempt_count))
+                       : "memory");
+  Cpu *cpu = this_cpu();
+  if (cpu->preempt_count == 0 && cpu->need_resched && irqs_enabled()) {
+    uint32_t flags = irq_save();
+    schedule_next(0);
+    irq_restore(flags);
+  }
+}
+
+/* Give up the CPU */
+void yield() {
+  uint32_t flags = irq_save();
+  schedule_next(1);
+  irq_restore(flags);
+}
+
+/* The TLS block moves with the thread, so this is safe to preempt */
+Thread *thread_current() { return tls_thread(); }
+
+/*
+Take the running thread off the CPU until thread_wake() is called for it.
+Interrupts must be disabled, and are still disabled when this returns.
+*/
+void thread_block() {
+  thread_current()->status = BLOCKED;
+  yield();
+}
 
-  scheduler.curr_running_process = next_process;
-  scheduler.curr_running_process->curr_running_thread = next_thread;
-  swtch(next_thread->context);
+/*
+Make a blocked thread runnable again. Interrupts must be disabled. A thread
+that has not yet switched away since it blocked simply keeps running.
+*/
+void thread_wake(Thread *thread) {
+  if (thread->status != BLOCKED) {
+    return;
+  }
+  Cpu *cpu = thread->cpu;
+  spin_lock(&cpu->rq.lock);
+  if (cpu->curr_thread == thread) {
+    thread->status = RUNNING;
+    spin_unlock(&cpu->rq.lock);
+    return;
+  }
+  spin_unlock(&cpu->rq.lock);
+  Cpu *waker = this_cpu();
+  if (TRACE_LATENCY && waker->irq_vector != 0) { // Woken by an interrupt
+    thread->wake_vector = waker->irq_vector;
+    thread->wake_tsc = waker->irq_entry_tsc;
+  }
+  // A real-time thread goes back to the CPU it was admitted on
+  sched_enqueue(thread->rt.cpu != NULL ? thread->rt.cpu : cpu, thread);
 }
 
+/*
+End the running thread. It is handed to the reaper, which frees it once this
+CPU has switched away from it for the last time.
+*/
 void thread_exit() {
-  scheduler.curr_running_process->curr_running_thread->status = DEAD;
+  spin_lock_irqsave(&reaper.wq.lock); // Interrupts stay disabled from here
+  Thread *thread = thread_current();
+  thread->status = DEAD;
+  thread->queue_next = reaper.zombies;
+  reaper.zombies = thread;
+  wait_queue_wake_one_locked(&reaper.wq);
+  spin_unlock(&reaper.wq.lock);
+  schedule(); // Does not return to a DEAD thread
   while (1) {
   }
 }
 
 /*
 
+Real-time threads
+
+*/
+
+/*
+Admit util more real-time load on this CPU if it fits, else on the online CPU
+with the least. Return NULL if it fits nowhere. scheduler.lock must be held.
+*/
+static Cpu *rt_admit(uint32_t util) {
+  Cpu *cpu = this_cpu();
+  if (cpu->rt_util + util <= RT_UTIL_MAX) {
+    return cpu;
+  }
+  for (uint32_t i = 0; i < no_cpus; i++) {
+    if (cpus[i].online && cpus[i].rt_util < cpu->rt_util) {
+      cpu = &cpus[i];
+    }
+  }
+  return cpu->rt_util + util <= RT_UTIL_MAX ? cpu : NULL;
+}
+
+/*
+Make the calling thread periodic: a job is released every period_ns, may run
+for budget_ns, and should be done by the start of the next period. The thread
+ends each job with sched_wait_period(). Return -1, and leave the thread as it
+was, if the period is shorter than a tick or no CPU has the capacity left. The
+thread moves to the CPU it was admitted on the next time it sleeps.
+*/
+int sched_set_periodic(uint64_t period_ns, uint64_t budget_ns) {
+  if (period_ns < RT_MIN_PERIOD || budget_ns == 0 || budget_ns > period_ns) {
+    return -1;
+  }
+  uint32_t util = budget_ns * RT_UTIL_ONE / period_ns;
+
+  uint32_t flags = spin_lock_irqsave(&scheduler.lock);
+  Thread *thread = this_cpu()->curr_thread;
+  Cpu *old_cpu = thread->rt.cpu;
+  if (old_cpu != NULL) {
+    old_cpu->rt_util -= thread->rt.util; // Replaced, not added to
+  }
+  Cpu *cpu = rt_admit(util);
+  if (cpu == NULL) {
+    if (old_cpu != NULL) {
+      old_cpu->rt_util += thread->rt.util;
+    }
+    spin_unlock_irqrestore(&scheduler.lock, flags);
+    return -1;
+  }
+  cpu->rt_util += util;
+  thread->rt.period = period_ns;
+  thread->rt.budget = budget_ns;
+  thread->rt.util = util;
+  thread->rt.cpu = cpu;
+  uint64_t now = clock_monotonic();
+  rt_new_job(thread, now, thread->run_ns + (now - thread->last_switch));
+  spin_unlock_irqrestore(&scheduler.lock, flags);
+  return 0;
+}
+
+/* Make the calling thread best-effort again */
+void sched_clear_periodic() {
+  uint32_t flags = spin_lock_irqsave(&scheduler.lock);
+  rt_release(this_cpu()->curr_thread);
+  spin_unlock_irqrestore(&scheduler.lock, flags);
+}
+
+/*
+End the current job of the calling periodic thread and sleep until the next one
+is released. A job done after its deadline counts as a miss, and periods it ran
+into are skipped rather than released late one after another. Return 1 if the
+job met its deadline, 0 if it missed it and -1 if the thread is not periodic.
+*/
+int sched_wait_period() {
+  uint32_t flags = irq_save();
+  Thread *thread = this_cpu()->curr_thread;
+  if (thread->rt.period == 0) {
+    irq_restore(flags);
+    return -1;
+  }
+  uint64_t now = clock_monotonic();
+  uint64_t period = thread->rt.period;
+  int met = now <= thread->rt.deadline;
+  if (!met) {
+    thread->rt.misses++;
+  }
+  uint64_t release = thread->rt.deadline;
+  if (release + period <= now) {
+    release += (now - release) / period * period;
+  }
+  rt_new_job(thread, release, thread->run_ns + (now - thread->last_switch));
+  irq_restore(flags);
+
+  timer_wait_until(release);
+  return met;
+}
+
+/*
+
+Lookup
+
+*/
+
+/*
+Find a live process by pid. Return NULL if there is none. Nothing keeps it
+from exiting once this returns, so callers must know it cannot (e.g. it is
+their own) or only use it as an identity.
+*/
+Process *find_process(uint32_t pid) {
+  uint32_t flags = spin_lock_irqsave(&scheduler.lock);
+  Process *process = pid_hash[ID_BUCKET(pid)];
+  while (process != NULL && process->pid != pid) {
+    process = process->hash_next;
+  }
+  spin_unlock_irqrestore(&scheduler.lock, flags);
+  return process;
+}
+
+/* Find a thread by tid, see find_process() */
+Thread *find_thread(uint32_t tid) {
+  uint32_t flags = spin_lock_irqsave(&scheduler.lock);
+  Thread *thread = tid_hash[ID_BUCKET(tid)];
+  while (thread != NULL && thread->tid != tid) {
+    thread = thread->hash_next;
+  }
+  spin_unlock_irqrestore(&scheduler.lock, flags);
+  return thread;
+}
+
+/*
+Copy the accounting of up to max threads into stats and return how many were
+copied. Counters of threads running on other CPUs may be slightly stale.
+*/
+uint32_t sched_snapshot(ThreadStats *stats, uint32_t max) {
+  uint32_t n = 0;
+  uint32_t flags = spin_lock_irqsave(&scheduler.lock);
+  uint64_t now = clock_monotonic();
+  for (Process *p = scheduler.head_process; p != NULL; p = p->next) {
+    for (Thread *t = p->head_thread; t != NULL && n < max; t = t->next) {
+      ThreadStats *s = &stats[n++];
+      s->thread = t;
+      s->pid = p->pid;
+      s->tid = t->tid;
+      s->status = t->status;
+      s->cpu = t->cpu != NULL ? t->cpu->id : 0;
+      s->run_ns = t->run_ns;
+      if (t->status == RUNNING && t->cpu != NULL && t->cpu->curr_thread == t) {
+        s->run_ns += now - t->last_switch;
+      }
+      s->wait_ns = t->wait_ns;
+      s->nr_voluntary = t->nr_voluntary;
+      s->nr_involuntary = t->nr_involuntary;
+    }
+  }
+  spin_unlock_irqrestore(&scheduler.lock, flags);
+  return n;
+}
+
+/*
+
 Helper Methods
 
 */
@@ -199,6 +1146,9 @@ void print_thread_status(ThreadStatus status) {
   case RUNNING:
     print("RUNNING");
     break;
+  case BLOCKED:
+    print("BLOCKED");
+    break;
   case DEAD:
     print("DEAD");
     break;
@@ -224,9 +1174,31 @@ void print_thread(Thread *thread) {
   print("next: ");
   print_hex((uintptr_t)thread->next);
   print(", ");
-  print("cpu context: **");
-  print_cpu_context(thread->context);
-  print("**");
+  print("k_esp: ");
+  print_hex(thread->k_esp);
+  print(", ");
+  print("cpu: ");
+  print_int(thread->cpu != NULL ? thread->cpu->id : 0);
+  print(", ");
+  print("run: ");
+  print_int(thread->run_ns / 1000000);
+  print(" ms, ");
+  print("wait: ");
+  print_int(thread->wait_ns / 1000000);
+  print(" ms, ");
+  print("switches: ");
+  print_int(thread->nr_voluntary);
+  print(" voluntary, ");
+  print_int(thread->nr_involuntary);
+  print(" involuntary");
+  if (thread->rt.period != 0) {
+    print(", ");
+    print("deadline misses: ");
+    print_int(thread->rt.misses);
+    print(", ");
+    print("overruns: ");
+    print_int(thread->rt.overruns);
+  }
 }
 
 void print_process(Process *process) {
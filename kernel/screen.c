@@ -1,6 +1,7 @@
 #include "include/screen.h"
 #include "include/io.h"
 #include "include/memory.h"
+#include "include/spinlock.h"
 #include "include/string.h"
 #include <stdint.h>
 
@@ -56,6 +57,8 @@ Screen s = {
     .pos_backup = (uint8_t *)(TXT_BUF_BASE + COL_END * 2 * ROW_END * 2),
 };
 
+static Spinlock screen_lock; // Every CPU prints
+
 static int get_offset(int x, int y) { return (y * COL_END + x) * 2; }
 
 static uint8_t get_char_attr(VgaTextColor fg, VgaTextColor bg) {
@@ -134,6 +137,7 @@ static void print_char(char c, VgaTextColor fg, VgaTextColor bg) {
 }
 
 void print_at(const char *a, int x, int y, VgaTextColor fg, VgaTextColor bg) {
+  uint32_t flags = spin_lock_irqsave(&screen_lock);
   y += ROW_START;
   if (x >= COL_START && x < COL_END) {
     s.x = x;
@@ -147,6 +151,7 @@ void print_at(const char *a, int x, int y, VgaTextColor fg, VgaTextColor bg) {
     print_char(a[i++], fg, bg);
   }
   set_cursor(s.x, s.y);
+  spin_unlock_irqrestore(&screen_lock, flags);
 }
 
 void print(const char *a) { print_at(a, -1, -1, WHITE, BLACK); }
@@ -0,0 +1,167 @@
+/*
+
+Symmetric multiprocessing
+
+The BIOS only starts one CPU, the bootstrap processor (BSP). The others, the
+application processors (APs), are found through the firmware tables (see
+acpi.c) and started by the BSP with the INIT-SIPI-SIPI sequence:
+- An INIT IPI resets the AP, which then waits for a STARTUP IPI (SIPI).
+- A SIPI starts the AP in real mode at a page aligned address below 1MiB. The
+  trampoline in ap_boot.asm is copied there, and takes the AP to protected mode
+  with paging and onto its own stack, then calls ap_main().
+- A second SIPI is sent in case the first was missed.
+
+Every CPU has its own GDT, TSS, stacks (to boot on and to handle interrupts
+on, see vector.c) and run queue (see Cpu). Once started, an AP joins the
+scheduler: its boot context becomes its idle thread and its local APIC timer
+preempts it every tick.
+
+*/
+
+#include "include/smp.h"
+#include "include/acpi.h"
+#include "include/fpu.h"
+#include "include/gdt.h"
+#include "include/idt.h"
+#include "include/lapic.h"
+#include "include/memory.h"
+#include "include/process.h"
+#include "include/screen.h"
+#include "include/syscall.h"
+#include "include/timer.h"
+#include "include/vmm.h"
+#include <stddef.h>
+
+#define AP_BOOT_PA 0x70000
+#define AP_BOOT_VA (0xC0000000 + AP_BOOT_PA)
+#define BOOT_STACK_VA 0xC0090000 // See boot/protected_mode.asm
+#define KERNEL_PT_PA 0x7F000     // Maps physical 0-1MiB
+#define PD_RECURSIVE_VA 0xFFFFF000
+#define CPU_STACK_SIZE (4096 * 4)
+
+#define INIT_DELAY_US 10000
+#define STARTUP_DELAY_US 200
+#define ONLINE_TIMEOUT_US 100000
+
+Cpu cpus[MAX_CPUS];
+uint32_t no_cpus = 1;
+
+extern uint8_t ap_boot_start[];
+extern uint8_t ap_boot_end[];
+extern uint32_t ap_boot_stack;
+extern uint32_t ap_boot_cpu;
+extern ProcessPd *process_pds;
+
+/* The running CPU's Cpu, whose first field points to itself */
+Cpu *this_cpu() {
+  Cpu *cpu;
+  __asm__ __volatile__("mov %%fs:0, %0" : "=r"(cpu));
+  return cpu;
+}
+
+/*
+Give the BSP its GDT, TSS and per-CPU segment. Must run before anything calls
+this_cpu().
+*/
+void cpu_init_bsp() {
+  Cpu *cpu = &cpus[0];
+  cpu->self = cpu;
+  cpu->id = 0;
+  cpu->online = 1;
+  cpu->stack = BOOT_STACK_VA;
+  gdt_init_cpu(cpu);
+}
+
+/* Entered by each AP from the trampoline, on its own stack */
+void ap_main(uint32_t id) {
+  Cpu *cpu = &cpus[id];
+  gdt_init_cpu(cpu);
+  idt_load();
+  syscall_init_cpu();
+  fpu_init_cpu();
+  lapic_init();
+  sched_init_ap();
+  lapic_timer_start();
+  cpu->online = 1;
+
+  __asm__ __volatile__("sti");
+  while (1) {
+    __asm__ __volatile__("hlt"); // Idle until the scheduler has something
+  }
+}
+
+/* Write a value into the copy of the trampoline at AP_BOOT_PA */
+static void set_ap_boot_param(uint32_t *param, uint32_t val) {
+  *(uint32_t *)(AP_BOOT_VA + ((uintptr_t)param - (uintptr_t)ap_boot_start)) =
+      val;
+}
+
+static void wait_online(Cpu *cpu, uint32_t timeout_us) {
+  uint64_t end = clock_monotonic() + (uint64_t)timeout_us * 1000;
+  while (!cpu->online && clock_monotonic() < end) {
+    __asm__ __volatile__("pause");
+  }
+}
+
+/* Start the AP with the given APIC ID as cpus[id]. Return 1 once it is up. */
+static int start_ap(uint32_t id, uint8_t apic_id) {
+  Cpu *cpu = &cpus[id];
+  cpu->self = cpu;
+  cpu->id = id;
+  cpu->apic_id = apic_id;
+  cpu->online = 0;
+  cpu->stack = kmalloc(CPU_STACK_SIZE) + CPU_STACK_SIZE;
+  cpu->irq_stack = kmalloc(IRQ_STACK_SIZE) + IRQ_STACK_SIZE;
+
+  set_ap_boot_param(&ap_boot_stack, cpu->stack);
+  set_ap_boot_param(&ap_boot_cpu, id);
+
+  lapic_send_init(apic_id);
+  timer_delay_us(INIT_DELAY_US);
+  for (int i = 0; i < 2 && !cpu->online; i++) {
+    lapic_send_startup(apic_id, AP_BOOT_PA);
+    wait_online(cpu, i == 0 ? STARTUP_DELAY_US : ONLINE_TIMEOUT_US);
+  }
+  return cpu->online;
+}
+
+/*
+Give the boot CPU its interrupt stack, then find the other CPUs and start them.
+Needs the heap, the scheduler and a calibrated TSC. Interrupts must be disabled.
+*/
+void smp_init() {
+  cpus[0].irq_stack = kmalloc(IRQ_STACK_SIZE) + IRQ_STACK_SIZE;
+  if (!acpi_init() || tsc_khz == 0) {
+    print("No multiprocessor tables found, running on one CPU.\n");
+    return;
+  }
+  lapic_install(platform.lapic_pa);
+  cpus[0].apic_id = lapic_id();
+  if (irqs_use_ioapic(cpus[0].apic_id)) {
+    print("IRQs routed through the I/O APIC.\n");
+  }
+
+  /* The trampoline runs at its physical address right after enabling paging */
+  mem_cpy(ap_boot_start, (uint8_t *)AP_BOOT_VA, ap_boot_end - ap_boot_start);
+  Pd *pd = (Pd *)PD_RECURSIVE_VA;
+  pd->pts[0] = (Pt *)(KERNEL_PT_PA | 0x3); // Present, writable
+
+  for (uint32_t i = 0; i < platform.no_cpus; i++) {
+    if (platform.apic_ids[i] == cpus[0].apic_id) {
+      continue;
+    }
+    if (start_ap(no_cpus, platform.apic_ids[i])) {
+      no_cpus++;
+    } else {
+      print("CPU with APIC ID ");
+      print_int(platform.apic_ids[i]);
+      print(" did not start.\n");
+    }
+  }
+
+  pd->pts[0] = NULL;
+  load_pd(process_pds->pd_pa); // Flush the TLB
+
+  print_int(no_cpus);
+  print(" CPU(s) online.\n");
+}
@@ -1,11 +1,15 @@
 #include "include/kb.h"
 #include "include/random.h"
 #include "include/screen.h"
+#include "include/sync.h"
 #include "include/timer.h"
 #include "include/vmm.h"
 
 #define INIT_L 5 // Initial length of snake
 
+#define FRAME_NS 50000000       // A move every 50 ms
+#define FRAME_BUDGET_NS 5000000 // Moving and drawing take well under 5 ms
+
 typedef enum {
   UP,
   LEFT,
@@ -40,6 +44,7 @@ typedef struct {
   int curr_score;
   int running;
   int quitted;
+  Semaphore started; // Upped when a game starts or the player quits
   Snake s;
   Food f;
 } Game;
@@ -117,6 +122,7 @@ static void user_in(char pressed) {
   if (pressed == 'q') {
     g.quitted = 1;
     game_over();
+    semaphore_up(&g.started);
     return;
   }
 
@@ -124,6 +130,9 @@ static void user_in(char pressed) {
     return;
   }
 
+  if (!g.running) {
+    semaphore_up(&g.started);
+  }
   g.running = 1;
   g.s.curr_dir = pressed == 'w'   ? UP
                  : pressed == 'a' ? LEFT
@@ -271,12 +280,26 @@ void snake_start() {
   g.quitted = 0;
   g.best_score = 0;
   g.curr_score = 0;
+  semaphore_init(&g.started, 0);
   init_game();
   register_kb_observer(&user_in);
+  // Frames come at a steady rate when the game loop is a real-time thread
+  int periodic = sched_set_periodic(FRAME_NS, FRAME_BUDGET_NS) == 0;
   while (!g.quitted) {
-    timer_wait(0.01);
+    if (!g.running) {
+      semaphore_down(&g.started); // Sleep until a key starts the game
+      continue;
+    }
+    if (periodic) {
+      sched_wait_period();
+    } else {
+      timer_wait_ms(50);
+    }
     if (g.running) {
       move();
     }
   }
+  if (periodic) {
+    sched_clear_periodic();
+  }
 }
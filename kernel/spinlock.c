@@ -0,0 +1,52 @@
+/*
+
+Spinlocks
+
+- Mutual exclusion between CPUs for short critical sections. A CPU that finds
+  the lock taken busy-waits (with the PAUSE hint) until it is released.
+- xchg with a memory operand is implicitly locked, so it atomically takes the
+  lock and acts as a full memory barrier.
+- A lock that is also taken by IRQ handlers must be held with interrupts
+  disabled (spin_lock_irqsave), otherwise a handler on the same CPU would spin
+  on a lock its own CPU holds forever. That goes for the handlers too, which
+  run with interrupts enabled (see vector.c).
+
+*/
+
+#include "include/spinlock.h"
+#include "include/irq.h"
+
+static uint32_t xchg(volatile uint32_t *addr, uint32_t val) {
+  __asm__ __volatile__("xchg %0, %1" : "+m"(*addr), "+r"(val) : : "memory");
+  return val;
+}
+
+void spin_init(Spinlock *lock) { lock->locked = 0; }
+
+void spin_lock(Spinlock *lock) {
+  while (xchg(&lock->locked, 1) != 0) {
+    while (lock->locked) {
+      __asm__ __volatile__("pause");
+    }
+  }
+}
+
+/* Take the lock only if it is free. Return 1 on success. */
+int spin_trylock(Spinlock *lock) { return xchg(&lock->locked, 1) == 0; }
+
+void spin_unlock(Spinlock *lock) {
+  __asm__ __volatile__("" : : : "memory"); // Stores are not reordered on x86
+  lock->locked = 0;
+}
+
+/* The time interrupts are disabled is blamed on the caller (see irq.c) */
+uint32_t spin_lock_irqsave(Spinlock *lock) {
+  uint32_t flags = irq_save_from((uintptr_t)__builtin_return_address(0));
+  spin_lock(lock);
+  return flags;
+}
+
+void spin_unlock_irqrestore(Spinlock *lock, uint32_t flags) {
+  spin_unlock(lock);
+  irq_restore(flags);
+}
@@ -1,9 +1,57 @@
 [bits 32]
 
 global swtch
+global kthread_entry
+global call_on_stack
 
-extern irq_return
+	; swtch(uintptr_t *prev_sp, uintptr_t next_sp, volatile uint32_t *lock)
+	; Switch kernel stacks. Only the registers the C calling convention expects to be
+	; preserved are saved on the previous thread's stack (its stack pointer goes to
+	; *prev_sp), the caller-saved ones are already dead. Returns into the next thread
+	; wherever it called swtch() itself, or into the entry of a new thread. An
+	; interrupted thread resumes through its interrupt frame once its schedule() call
+	; returns, so there is no frame to fake for a voluntary switch.
+	; The scheduler holds its run queue lock until here, so no other CPU can pick up
+	; the previous thread while its stack is still in use. The lock is released once
+	; off that stack.
 
 swtch:
-	mov esp, [esp+4]
-	jmp irq_return
+	mov  eax, [esp+4]
+	mov  edx, [esp+8]
+	mov  ecx, [esp+12]
+	push ebp
+	push ebx
+	push esi
+	push edi
+	mov  [eax], esp
+	mov  esp, edx
+	mov  dword [ecx], 0
+	pop  edi
+	pop  esi
+	pop  ebx
+	pop  ebp
+	ret
+
+	; First return of a new kernel thread out of swtch(). The scheduler runs with
+	; interrupts disabled, threads start with them enabled. Returns into the thread's
+	; function, whose argument is above its (null) return address.
+
+kthread_entry:
+	sti
+	ret
+
+	; call_on_stack(uintptr_t stack, void (*fn)(void *), void *arg)
+	; Call fn(arg) with esp at stack, then return on the caller's stack. Interrupt
+	; handlers run on their CPU's interrupt stack this way (see vector.c).
+
+call_on_stack:
+	push ebp
+	mov  ebp, esp
+	mov  eax, [ebp+12]
+	mov  ecx, [ebp+16]
+	mov  esp, [ebp+8]
+	push ecx
+	call eax
+	mov  esp, ebp
+	pop  ebp
+	ret
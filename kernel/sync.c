@@ -0,0 +1,232 @@
+/*
+
+Blocking synchronization primitives
+
+- A wait queue is a FIFO of threads that are BLOCKED on some event. Sleeping
+  takes the thread off the run queue, so waiting costs no CPU time.
+- Mutexes, counting semaphores and condition variables are built on wait
+  queues. Waiters are woken in the order they went to sleep.
+- Ownership is handed directly to the first waiter on mutex_unlock() and
+  semaphore_up(), so a woken thread never has to compete for it again.
+- Each wait queue has a spinlock, which also protects the state of the
+  primitive built on it. Checking a condition and going to sleep is atomic
+  because the lock is only released once the thread is on the queue, and
+  waking requires taking it off the queue under the same lock.
+- Wake-ups never block and can be done from IRQ handlers. Sleeping and locking
+  must only be done from threads.
+- Each thread counts how often it slept, in a thread-local variable (see tls.c).
+
+*/
+
+#include "include/sync.h"
+#include "include/irq.h"
+#include "include/process.h"
+#include <stddef.h>
+
+__thread uint32_t wait_queue_sleeps;
+
+/*
+
+Wait queues
+
+*/
+
+void wait_queue_init(WaitQueue *wq) {
+  spin_init(&wq->lock);
+  wq->head = NULL;
+  wq->tail = NULL;
+}
+
+/*
+Block the running thread until it is woken through wq. The caller holds
+wq->lock, taken with spin_lock_irqsave() which returned flags. The lock is
+released once the thread is queued, flags are restored once it is woken.
+*/
+void wait_queue_sleep_locked(WaitQueue *wq, uint32_t flags) {
+  Thread *thread = thread_current();
+  thread->queue_next = NULL;
+  if (wq->tail == NULL) {
+    wq->head = thread;
+  } else {
+    wq->tail->queue_next = thread;
+  }
+  wq->tail = thread;
+  thread->status = BLOCKED;
+  wait_queue_sleeps++;
+  spin_unlock(&wq->lock);
+  yield();
+  irq_restore(flags);
+}
+
+/* Block the running thread until it is woken through wq */
+void wait_queue_sleep(WaitQueue *wq) {
+  wait_queue_sleep_locked(wq, spin_lock_irqsave(&wq->lock));
+}
+
+/* Take the longest waiting thread off wq. wq->lock must be held. */
+static Thread *wait_queue_pop(WaitQueue *wq) {
+  Thread *thread = wq->head;
+  if (thread != NULL) {
+    wq->head = thread->queue_next;
+    if (wq->head == NULL) {
+      wq->tail = NULL;
+    }
+    thread->queue_next = NULL;
+  }
+  return thread;
+}
+
+/* Like wait_queue_wake_one(), for callers that hold wq->lock */
+int wait_queue_wake_one_locked(WaitQueue *wq) {
+  Thread *thread = wait_queue_pop(wq);
+  if (thread != NULL) {
+    thread_wake(thread);
+  }
+  return thread != NULL;
+}
+
+/* Wake the longest waiting thread. Return 0 if there was none. */
+int wait_queue_wake_one(WaitQueue *wq) {
+  uint32_t flags = spin_lock_irqsave(&wq->lock);
+  int woken = wait_queue_wake_one_locked(wq);
+  spin_unlock_irqrestore(&wq->lock, flags);
+  return woken;
+}
+
+/* Wake every waiting thread. Return how many were woken. */
+int wait_queue_wake_all(WaitQueue *wq) {
+  int woken = 0;
+  while (wait_queue_wake_one(wq)) {
+    woken++;
+  }
+  return woken;
+}
+
+/*
+
+Mutexes
+
+*/
+
+void mutex_init(Mutex *mutex) {
+  mutex->owner = NULL;
+  wait_queue_init(&mutex->waiters);
+  mutex->acquisitions = 0;
+  mutex->contentions = 0;
+}
+
+void mutex_lock(Mutex *mutex) {
+  uint32_t flags = spin_lock_irqsave(&mutex->waiters.lock);
+  Thread *thread = thread_current();
+  mutex->acquisitions++;
+  if (mutex->owner == NULL) {
+    mutex->owner = thread;
+  } else {
+    mutex->contentions++;
+    while (mutex->owner != thread) {
+      wait_queue_sleep_locked(&mutex->waiters, flags);
+      flags = spin_lock_irqsave(&mutex->waiters.lock);
+    }
+  }
+  spin_unlock_irqrestore(&mutex->waiters.lock, flags);
+}
+
+/* Lock the mutex only if that does not require waiting. Return 1 on success. */
+int mutex_trylock(Mutex *mutex) {
+  uint32_t flags = spin_lock_irqsave(&mutex->waiters.lock);
+  int locked = mutex->owner == NULL;
+  if (locked) {
+    mutex->owner = thread_current();
+    mutex->acquisitions++;
+  }
+  spin_unlock_irqrestore(&mutex->waiters.lock, flags);
+  return locked;
+}
+
+void mutex_unlock(Mutex *mutex) {
+  uint32_t flags = spin_lock_irqsave(&mutex->waiters.lock);
+  Thread *next_owner = wait_queue_pop(&mutex->waiters);
+  mutex->owner = next_owner;
+  if (next_owner != NULL) {
+    thread_wake(next_owner);
+  }
+  spin_unlock_irqrestore(&mutex->waiters.lock, flags);
+}
+
+/*
+
+Semaphores
+
+*/
+
+void semaphore_init(Semaphore *sem, int32_t count) {
+  sem->count = count;
+  wait_queue_init(&sem->waiters);
+  sem->downs = 0;
+  sem->contentions = 0;
+}
+
+void semaphore_down(Semaphore *sem) {
+  uint32_t flags = spin_lock_irqsave(&sem->waiters.lock);
+  sem->downs++;
+  if (sem->count > 0) {
+    sem->count--;
+    spin_unlock_irqrestore(&sem->waiters.lock, flags);
+  } else {
+    sem->contentions++;
+    // semaphore_up() hands its unit over
+    wait_queue_sleep_locked(&sem->waiters, flags);
+  }
+}
+
+void semaphore_up(Semaphore *sem) {
+  uint32_t flags = spin_lock_irqsave(&sem->waiters.lock);
+  Thread *thread = wait_queue_pop(&sem->waiters);
+  if (thread != NULL) {
+    thread_wake(thread);
+  } else {
+    sem->count++;
+  }
+  spin_unlock_irqrestore(&sem->waiters.lock, flags);
+}
+
+/*
+
+Condition variables
+
+*/
+
+void condvar_init(CondVar *cv) {
+  wait_queue_init(&cv->waiters);
+  cv->waits = 0;
+  cv->signals = 0;
+}
+
+/* Atomically release mutex and sleep, then re-acquire mutex once signalled */
+void condvar_wait(CondVar *cv, Mutex *mutex) {
+  uint32_t flags = spin_lock_irqsave(&cv->waiters.lock);
+  cv->waits++;
+  mutex_unlock(mutex);
+  wait_queue_sleep_locked(&cv->waiters, flags);
+  mutex_lock(mutex);
+}
+
+void condvar_signal(CondVar *cv) {
+  uint32_t flags = spin_lock_irqsave(&cv->waiters.lock);
+  cv->signals++;
+  Thread *thread = wait_queue_pop(&cv->waiters);
+  if (thread != NULL) {
+    thread_wake(thread);
+  }
+  spin_unlock_irqrestore(&cv->waiters.lock, flags);
+}
+
+void condvar_broadcast(CondVar *cv) {
+  uint32_t flags = spin_lock_irqsave(&cv->waiters.lock);
+  cv->signals++;
+  Thread *thread;
+  while ((thread = wait_queue_pop(&cv->waiters)) != NULL) {
+    thread_wake(thread);
+  }
+  spin_unlock_irqrestore(&cv->waiters.lock, flags);
+}
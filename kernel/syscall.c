@@ -0,0 +1,140 @@
+/*
+
+System calls
+
+User threads (ring 3) enter the kernel through int 0x80. Its IDT gate has DPL
+3 so user mode may raise it, and the CPU switches to the thread's kernel stack
+(from the TSS) before the wrapper in int.asm saves a CpuContext.
+
+Arguments are passed in registers: eax holds the system call number, ebx, ecx,
+edx, esi and edi up to five arguments. The result is returned in eax, which
+is -1 for an unknown system call.
+
+SYSENTER/SYSEXIT
+- A faster entry that skips the IDT, the privilege checks of a gate and the
+  stack switch through the TSS. SYSENTER loads CS, EIP and ESP from MSRs
+  (SS and, on SYSEXIT, the user selectors follow from CS, see gdt.h), and
+  SYSEXIT returns to the EIP in edx on the stack in ecx.
+- Each CPU's SYSENTER_ESP points at the esp0 field of its TSS, which the entry
+  code in int.asm dereferences to get onto the thread's kernel stack. It only
+  saves what SYSEXIT and the kernel need, and calls straight into
+  syscall_table with the arguments from ebx, esi and edi.
+- Both paths share syscall_table, so every system call is available through
+  either.
+
+Pointers from user mode are only dereferenced after checking that they point
+to user-accessible pages, so a bad pointer cannot crash the kernel.
+
+*/
+
+#include "include/syscall.h"
+#include "include/elf.h"
+#include "include/gdt.h"
+#include "include/idt.h"
+#include "include/process.h"
+#include "include/screen.h"
+#include "include/smp.h"
+#include "include/timer.h"
+#include "include/vdso.h"
+#include "include/vmm.h"
+#include <stddef.h>
+
+#define WRITE_CHUNK 64
+
+#define MSR_SYSENTER_CS 0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+typedef uint32_t (*Syscall)(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
+
+extern void syscall_int();
+extern void sysenter_entry();
+
+int has_sysenter;
+
+static uint32_t sys_exit() {
+  thread_exit();
+  return 0;
+}
+
+static uint32_t sys_write(uint32_t buf, uint32_t len) {
+  elf_fault_in(buf, len);
+  if (!is_user_range(buf, len)) {
+    return -1;
+  }
+  char chunk[WRITE_CHUNK + 1];
+  for (uint32_t done = 0; done < len; done += WRITE_CHUNK) {
+    uint32_t n = len - done < WRITE_CHUNK ? len - done : WRITE_CHUNK;
+    for (uint32_t i = 0; i < n; i++) {
+      chunk[i] = ((const char *)buf)[done + i];
+    }
+    chunk[n] = 0;
+    print(chunk);
+  }
+  return len;
+}
+
+static uint32_t sys_yield() {
+  yield();
+  return 0;
+}
+
+static uint32_t sys_sleep(uint32_t ms) {
+  timer_wait_ms(ms);
+  return 0;
+}
+
+static uint32_t sys_getpid() { return thread_current()->process->pid; }
+
+static uint32_t sys_gettid() { return thread_current()->tid; }
+
+static uint32_t sys_null() { return 0; }
+
+/* Also indexed by sysenter_entry, which checks against NO_SYSCALLS */
+Syscall syscall_table[NO_SYSCALLS] = {
+    [SYS_EXIT] = (Syscall)sys_exit,     [SYS_WRITE] = (Syscall)sys_write,
+    [SYS_YIELD] = (Syscall)sys_yield,   [SYS_SLEEP] = (Syscall)sys_sleep,
+    [SYS_GETPID] = (Syscall)sys_getpid, [SYS_GETTID] = (Syscall)sys_gettid,
+    [SYS_NULL] = (Syscall)sys_null,
+};
+
+void syscall_handler(CpuContext *context) {
+  if (context->eax >= NO_SYSCALLS || syscall_table[context->eax] == NULL) {
+    context->eax = -1;
+    return;
+  }
+  __asm__ __volatile__("sti"); // Preemptible, like any other thread code
+  context->eax = syscall_table[context->eax](
+      context->ebx, context->ecx, context->edx, context->esi, context->edi);
+  __asm__ __volatile__("cli");
+}
+
+static void wrmsr(uint32_t msr, uint64_t val) {
+  __asm__ __volatile__("wrmsr"
+                       :
+                       : "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+/* CPUID leaf 1, edx bit 11: SYSENTER/SYSEXIT */
+static int cpu_has_sep() {
+  uint32_t eax = 1, ebx, ecx, edx;
+  __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+  return (edx >> 11) & 1;
+}
+
+/* Point the calling CPU's SYSENTER MSRs at the kernel */
+void syscall_init_cpu() {
+  if (!has_sysenter) {
+    return;
+  }
+  wrmsr(MSR_SYSENTER_CS, KERNEL_CS);
+  wrmsr(MSR_SYSENTER_ESP, (uintptr_t)&this_cpu()->tss.esp0);
+  wrmsr(MSR_SYSENTER_EIP, (uintptr_t)sysenter_entry);
+}
+
+void syscall_init() {
+  idt_set_user_gate(SYSCALL_INT_NO, (uintptr_t)syscall_int);
+  has_sysenter = cpu_has_sep();
+  vdso_set_sysenter(has_sysenter); // Read-only for user mode
+  syscall_init_cpu();
+}
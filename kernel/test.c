@@ -1,35 +1,50 @@
+#include "include/ata.h"
+#include "include/elf.h"
+#include "include/fiber.h"
+#include "include/irq.h"
+#include "include/isr.h"
+#include "include/latency.h"
+#include "include/memory.h"
+#include "include/pmm.h"
 #include "include/process.h"
 #include "include/screen.h"
+#include "include/smp.h"
 #include "include/snake.h"
+#include "include/sync.h"
+#include "include/syscall.h"
 #include "include/timer.h"
+#include "include/tls.h"
+#include "include/vdso.h"
+#include "include/virtio_blk.h"
+#include "include/work.h"
 
 void t_one(int *a) {
-  timer_wait(0.1);
+  timer_wait_ms(100);
   print_int(*a);
   print("\n");
   thread_exit();
 }
 
 void t_one_two() {
-  timer_wait(2);
+  timer_wait_ms(2000);
   print("1-2\n");
   thread_exit();
 }
 
 void t_two() {
-  timer_wait(0.1);
+  timer_wait_ms(100);
   print("2\n");
   thread_exit();
 }
 
 void t_three() {
-  timer_wait(1);
+  timer_wait_ms(1000);
   print("3\n");
   thread_exit();
 }
 
 void t_three_two() {
-  timer_wait(0.1);
+  timer_wait_ms(100);
   print("3-2\n");
   thread_exit();
 }
@@ -48,3 +63,841 @@ void test_scheduling() {
 }
 
 void test_vm() { snake_start(); }
+
+/* A bounded buffer shared by a producer and a consumer thread */
+#define BUF_SIZE 4
+#define NO_ITEMS 16
+
+static struct {
+  int items[BUF_SIZE];
+  int head, count;
+  Mutex lock;
+  CondVar not_empty;
+  CondVar not_full;
+} buf;
+
+void t_producer() {
+  for (int i = 0; i < NO_ITEMS; i++) {
+    mutex_lock(&buf.lock);
+    while (buf.count == BUF_SIZE) {
+      condvar_wait(&buf.not_full, &buf.lock);
+    }
+    buf.items[(buf.head + buf.count++) % BUF_SIZE] = i;
+    condvar_signal(&buf.not_empty);
+    mutex_unlock(&buf.lock);
+  }
+  thread_exit();
+}
+
+void t_consumer() {
+  int sum = 0;
+  for (int i = 0; i < NO_ITEMS; i++) {
+    mutex_lock(&buf.lock);
+    while (buf.count == 0) {
+      condvar_wait(&buf.not_empty, &buf.lock);
+    }
+    sum += buf.items[buf.head];
+    buf.head = (buf.head + 1) % BUF_SIZE;
+    buf.count--;
+    condvar_signal(&buf.not_full);
+    mutex_unlock(&buf.lock);
+    timer_wait_ms(50); // Producer fills the buffer and sleeps meanwhile
+  }
+  print("consumed sum: ");
+  print_int(sum);
+  print(" (expected 120), lock contentions: ");
+  print_int(buf.lock.contentions);
+  print(", waits: ");
+  print_int(buf.not_empty.waits + buf.not_full.waits);
+  print("\n");
+  thread_exit();
+}
+
+void test_sync() {
+  mutex_init(&buf.lock);
+  condvar_init(&buf.not_empty);
+  condvar_init(&buf.not_full);
+  buf.head = 0;
+  buf.count = 0;
+
+  Process *p = create_process();
+  create_thread(p, t_producer, 0);
+  create_thread(p, t_consumer, 0);
+}
+
+/* CPU-bound workers, the elapsed time should drop with more CPUs (-smp N) */
+#define NO_WORKERS 8
+#define WORK_ITERATIONS 20000000
+
+static uint64_t smp_start;
+static volatile uint32_t workers_done;
+
+void t_worker() {
+  volatile uint32_t x = 0;
+  for (uint32_t i = 0; i < WORK_ITERATIONS; i++) {
+    x += i;
+  }
+  if (__sync_add_and_fetch(&workers_done, 1) == NO_WORKERS) {
+    print_int(NO_WORKERS);
+    print(" workers on ");
+    print_int(no_cpus);
+    print(" CPU(s) took ");
+    print_int((clock_monotonic() - smp_start) / 1000000);
+    print(" ms, steals per CPU:");
+    for (uint32_t i = 0; i < no_cpus; i++) {
+      print(" ");
+      print_int(cpus[i].steals);
+    }
+    print("\n");
+  }
+  thread_exit();
+}
+
+void test_smp() {
+  workers_done = 0;
+  smp_start = clock_monotonic();
+  Process *p = create_process();
+  for (int i = 0; i < NO_WORKERS; i++) {
+    create_thread(p, t_worker, 0);
+  }
+}
+
+/* User threads that print through system calls, one crashes without harm */
+USER_RODATA static const char user_msg[] = "hello from ring 3\n";
+USER_RODATA static const char user_bad_msg[] = "about to fault\n";
+
+USER_CODE void t_user(uintptr_t times) {
+  for (uint32_t i = 0; i < times; i++) {
+    syscall2(SYS_WRITE, (uint32_t)user_msg, sizeof(user_msg) - 1);
+    syscall1(SYS_SLEEP, 100);
+  }
+}
+
+USER_CODE void t_user_bad() {
+  syscall2(SYS_WRITE, (uint32_t)user_bad_msg, sizeof(user_bad_msg) - 1);
+  if (syscall2(SYS_WRITE, 0xC0010000, 16) != (uint32_t)-1) { // Kernel memory
+    return;
+  }
+  *(volatile uint32_t *)0xC0010000 = 0; // Page fault, kills only this thread
+}
+
+void test_user() {
+  Process *p = create_process();
+  create_user_thread(p, t_user, 3);
+  create_user_thread(p, (void (*)(uintptr_t))t_user_bad, 0);
+}
+
+/* A user thread checks the vDSO clock against a sleep, without system calls */
+USER_RODATA static const char vdso_ok_msg[] = "vdso clock and cpu ok\n";
+USER_RODATA static const char vdso_bad_msg[] = "vdso clock or cpu wrong\n";
+
+USER_CODE void t_vdso() {
+  uint64_t start = vdso_clock_ns();
+  syscall1(SYS_SLEEP, 100);
+  uint64_t elapsed_ms = (uint32_t)(vdso_clock_ns() - start) / 1000000;
+  uint32_t cpu = vdso_cpu();
+  VdsoCpu stats = vdso_cpu_stats(cpu);
+  if (elapsed_ms >= 90 && elapsed_ms < 200 && cpu < MAX_CPUS &&
+      stats.switches > 0) {
+    syscall2(SYS_WRITE, (uint32_t)vdso_ok_msg, sizeof(vdso_ok_msg) - 1);
+  } else {
+    syscall2(SYS_WRITE, (uint32_t)vdso_bad_msg, sizeof(vdso_bad_msg) - 1);
+  }
+}
+
+void test_vdso() { create_user_thread(create_process(), t_vdso, 0); }
+
+/* Threads keep values in x87 and SSE registers across context switches */
+#define FPU_ROUNDS 100
+
+void t_fpu(uintptr_t id) {
+  uint32_t in[4] = {id, id + 1, id + 2, id + 3};
+  uint32_t out[4];
+  double x = id * 0.5, y;
+  int ok = 1;
+  for (int i = 0; i < FPU_ROUNDS; i++) {
+    __asm__ __volatile__("movups %0, %%xmm0" : : "m"(in));
+    __asm__ __volatile__("fldl %0" : : "m"(x));
+    yield();
+    __asm__ __volatile__("fstpl %0" : "=m"(y));
+    __asm__ __volatile__("movups %%xmm0, %0" : "=m"(out));
+    ok &= y == x && mem_cmp((uint8_t *)in, (uint8_t *)out, sizeof(in)) == 0;
+  }
+  print("fpu thread ");
+  print_int(id);
+  print(ok ? ": ok\n" : ": state corrupted\n");
+  thread_exit();
+}
+
+void test_fpu() {
+  Process *p = create_process();
+  for (int i = 0; i < 4; i++) {
+    create_thread(p, t_fpu, i);
+  }
+}
+
+/*
+Many threads exit at once and the reaper frees them. The second round should
+reuse what the first freed, so no frames stay allocated.
+*/
+#define NO_EXITING_THREADS 16
+
+USER_CODE void t_user_exit() {}
+
+void t_kernel_exit() { thread_exit(); }
+
+static void exit_round() {
+  Process *p = create_process();
+  for (int i = 0; i < NO_EXITING_THREADS; i++) {
+    create_user_thread(p, (void (*)(uintptr_t))t_user_exit, 0);
+    create_thread(p, (void (*)(uintptr_t))t_kernel_exit, 0);
+  }
+  timer_wait_ms(500);
+}
+
+void t_exit() {
+  exit_round(); // Lets the heap grow to what a round needs
+  uint32_t frames_used = pmm_frames_used();
+  exit_round();
+  uint32_t leaked = pmm_frames_used() - frames_used;
+  print_int(leaked);
+  print(" frames leaked by exited threads\n");
+  thread_exit();
+}
+
+void test_exit() { create_thread(create_process(), t_exit, 0); }
+
+/*
+Periodic threads meet their deadlines while best-effort threads hog every CPU,
+and a set that would overload a CPU is not admitted
+*/
+#define EDF_JOBS 50
+#define EDF_HOG_MS 1500
+
+static const struct {
+  uint32_t period_ms;
+  uint32_t budget_ms;
+} edf_tasks[] = {{20, 4}, {50, 10}, {100, 30}};
+
+void t_edf(uintptr_t i) {
+  uint64_t period = (uint64_t)edf_tasks[i].period_ms * 1000000;
+  uint64_t budget = (uint64_t)edf_tasks[i].budget_ms * 1000000;
+  if (sched_set_periodic(period, budget) != 0) {
+    print("edf thread not admitted\n");
+    thread_exit();
+  }
+  Thread *thread = thread_current();
+  uint64_t max_jitter = 0;
+  for (int job = 0; job < EDF_JOBS; job++) {
+    timer_delay_us(edf_tasks[i].budget_ms * 1000 / 2);
+    sched_wait_period();
+    uint64_t jitter = clock_monotonic() - thread->rt.release;
+    if (jitter > max_jitter) {
+      max_jitter = jitter;
+    }
+  }
+  print("edf thread ");
+  print_int(i);
+  print(": ");
+  print_int(thread->rt.misses);
+  print(" misses, ");
+  print_int(thread->rt.overruns);
+  print(" overruns, max jitter ");
+  print_int((uint32_t)max_jitter / 1000);
+  print(" us\n");
+  thread_exit();
+}
+
+void t_edf_hog() {
+  timer_delay_us(EDF_HOG_MS * 1000);
+  thread_exit();
+}
+
+void t_edf_admission() {
+  int whole_cpu = sched_set_periodic(10000000, 10000000);
+  int too_short = sched_set_periodic(1000, 100);
+  print(whole_cpu != 0 && too_short != 0 ? "edf admission ok\n"
+                                         : "edf admitted an overload\n");
+  thread_exit();
+}
+
+void test_edf() {
+  Process *p = create_process();
+  create_thread(p, t_edf_admission, 0);
+  for (uint32_t i = 0; i < no_cpus * 2; i++) {
+    create_thread(p, (void (*)(uintptr_t))t_edf_hog, 0);
+  }
+  for (uint32_t i = 0; i < sizeof(edf_tasks) / sizeof(edf_tasks[0]); i++) {
+    create_thread(p, t_edf, i);
+  }
+}
+
+/* Every thread sees its own copy of TLS variables, from their initial values */
+#define TLS_ROUNDS 100
+
+static __thread uint32_t tls_value = 0x1234; // In .tdata
+static __thread uint32_t tls_count;          // In .tbss
+
+void t_tls(uintptr_t id) {
+  int ok = tls_value == 0x1234 && tls_count == 0;
+  for (uint32_t i = 0; i < TLS_ROUNDS; i++) {
+    tls_value = id + i;
+    tls_count++;
+    yield();
+    ok &= tls_value == id + i && tls_count == i + 1;
+  }
+  uint32_t sleeps = wait_queue_sleeps;
+  timer_wait_ms(10);
+  ok &= wait_queue_sleeps == sleeps + 1;
+  Tcb *tcb = (Tcb *)thread_current()->tls; // Variables sit right below it
+  ok &= tcb->self == tcb && (uintptr_t)&tls_value < (uintptr_t)tcb &&
+        (uintptr_t)&tls_count < (uintptr_t)tcb;
+  print("tls thread ");
+  print_int(id);
+  print(ok ? ": ok\n" : ": wrong values\n");
+  thread_exit();
+}
+
+void test_tls() {
+  Process *p = create_process();
+  for (int i = 0; i < 4; i++) {
+    create_thread(p, t_tls, i * TLS_ROUNDS);
+  }
+}
+
+/*
+Work queued from the timer IRQ runs in the workers, with interrupts enabled,
+and an item queued twice before it ran only runs once
+*/
+#define NO_TEST_WORK 8
+
+static Work work_items[NO_TEST_WORK];
+static volatile uint32_t work_ran;
+static volatile uint32_t work_irqs_on;
+
+static void w_test(uintptr_t i) {
+  uint32_t eflags;
+  __asm__ __volatile__("pushf\n\tpop %0" : "=r"(eflags));
+  work_irqs_on += (eflags >> 9) & 1;
+  work_ran++;
+}
+
+static void queue_test_work(uintptr_t arg) {
+  for (int i = 0; i < NO_TEST_WORK; i++) {
+    WorkPrio prio = i % 2 ? WORK_LOW : WORK_HIGH;
+    work_queue(prio, &work_items[i]);
+    work_queue(prio, &work_items[i]); // Still pending, batched with the first
+  }
+}
+
+void t_work() {
+  for (int i = 0; i < NO_TEST_WORK; i++) {
+    work_init_item(&work_items[i], w_test, i);
+  }
+  Timer timer = {.expires = 0, .fn = queue_test_work, .arg = 0, .next = NULL};
+  timer_add(&timer); // Fires on the next tick
+  timer_wait_ms(100);
+  print(work_ran == NO_TEST_WORK && work_irqs_on == NO_TEST_WORK
+            ? "deferred work ok\n"
+            : "deferred work wrong\n");
+  print_work_stats();
+  thread_exit();
+}
+
+void test_work() { create_thread(create_process(), t_work, 0); }
+
+/*
+More threads than 8-bit IDs could tell apart are live at once, each found by
+its tid, and their IDs are freed once they are reaped
+*/
+#define NO_ID_THREADS 300
+
+static Thread *id_threads[NO_ID_THREADS];
+static Semaphore ids_release;
+
+void t_id_wait() {
+  semaphore_down(&ids_release);
+  thread_exit();
+}
+
+void t_ids() {
+  Process *p = create_process();
+  semaphore_init(&ids_release, 0);
+  for (int i = 0; i < NO_ID_THREADS; i++) {
+    id_threads[i] = create_thread(p, t_id_wait, 0);
+  }
+  int found = 0;
+  for (int i = 0; i < NO_ID_THREADS; i++) {
+    found += id_threads[i] != NULL &&
+             find_thread(id_threads[i]->tid) == id_threads[i];
+  }
+  uint32_t pid = p->pid;
+  int process_found = find_process(pid) == p;
+  for (int i = 0; i < NO_ID_THREADS; i++) {
+    semaphore_up(&ids_release);
+  }
+  timer_wait_ms(500); // The reaper frees them, and the last one's process
+  print_int(found);
+  print(" threads found by tid, process ");
+  print(process_found && find_process(pid) == NULL ? "found then freed\n"
+                                                   : "lookup wrong\n");
+  thread_exit();
+}
+
+void test_ids() { create_thread(create_process(), t_ids, 0); }
+
+/*
+Two processes run the same ELF image and load only the pages they touch: its
+first code page, the page with a message it passes to SYS_WRITE, one page of
+data and one of .bss (of 14). The second reuses the first's code pages.
+*/
+#define ELF_TEXT_VA 0x08049000
+#define ELF_DATA_VA 0x0804E000
+#define ELF_BSS_VA 0x08050000
+#define ELF_IMAGE_SIZE 0x7000
+
+static const char elf_msg[] = "elf text page shared\n";
+static const char elf_data[] = "elf ok\n";
+
+static const uint8_t elf_code[] = {
+    0xA1, 0x00, 0xE0, 0x04, 0x08,        // mov eax, [ELF_DATA_VA]
+    0xA3, 0x00, 0x00, 0x05, 0x08,        // mov [ELF_BSS_VA], eax
+    0xA1, 0x04, 0xE0, 0x04, 0x08,        // mov eax, [ELF_DATA_VA + 4]
+    0xA3, 0x04, 0x00, 0x05, 0x08,        // mov [ELF_BSS_VA + 4], eax
+    0xB8, SYS_WRITE, 0, 0, 0,            // mov eax, SYS_WRITE
+    0xBB, 0x00, 0x00, 0x05, 0x08,        // mov ebx, ELF_BSS_VA
+    0xB9, sizeof(elf_data) - 1, 0, 0, 0, // mov ecx, length
+    0xCD, 0x80,                          // int 0x80
+    0xB8, SYS_WRITE, 0, 0, 0,            // mov eax, SYS_WRITE
+    0xBB, 0x00, 0xB0, 0x04, 0x08,        // mov ebx, ELF_TEXT_VA + 0x2000
+    0xB9, sizeof(elf_msg) - 1, 0, 0, 0,  // mov ecx, length
+    0xCD, 0x80,                          // int 0x80
+    0xC3,                                // ret
+};
+
+static void elf_segment(ElfProgramHeader *ph, uint32_t offset, uintptr_t va,
+                        uint32_t filesz, uint32_t memsz, uint32_t flags) {
+  mem_set((uint8_t *)ph, 0x0, sizeof(ElfProgramHeader));
+  ph->type = ELF_PT_LOAD;
+  ph->offset = offset;
+  ph->vaddr = va;
+  ph->filesz = filesz;
+  ph->memsz = memsz;
+  ph->flags = flags;
+  ph->align = 0x1000;
+}
+
+static uint8_t *elf_build() {
+  uint8_t *data = (uint8_t *)kmalloc(ELF_IMAGE_SIZE);
+  mem_set(data, 0x0, ELF_IMAGE_SIZE);
+  ElfHeader *header = (ElfHeader *)data;
+  mem_cpy((uint8_t *)"\x7F" "ELF\x01\x01\x01", header->ident, 7);
+  header->type = 2;
+  header->machine = 3;
+  header->version = 1;
+  header->entry = ELF_TEXT_VA;
+  header->phoff = sizeof(ElfHeader);
+  header->ehsize = sizeof(ElfHeader);
+  header->phentsize = sizeof(ElfProgramHeader);
+  header->phnum = 2;
+
+  ElfProgramHeader *phs = (ElfProgramHeader *)(data + sizeof(ElfHeader));
+  elf_segment(&phs[0], 0x1000, ELF_TEXT_VA, 0x4000, 0x4000, 5); // r-x
+  elf_segment(&phs[1], 0x5000, ELF_DATA_VA, 0x2000, 0xA000, 6); // rw-
+  mem_cpy((uint8_t *)elf_code, data + 0x1000, sizeof(elf_code));
+  mem_cpy((uint8_t *)elf_msg, data + 0x3000, sizeof(elf_msg));
+  mem_cpy((uint8_t *)elf_data, data + 0x5000, sizeof(elf_data));
+  return data;
+}
+
+void t_elf() {
+  uint8_t *data = elf_build();
+  ElfImage *image = elf_open(data, ELF_IMAGE_SIZE);
+  if (image == NULL) {
+    print("elf image rejected\n");
+    thread_exit();
+  }
+  elf_exec(image, 0);
+  elf_exec(image, 0);
+  while (((volatile ElfImage *)image)->processes != 0) {
+    timer_wait_ms(100); // Until the reaper freed both
+  }
+  print("elf: ");
+  print_int(image->pages_read);
+  print(" pages read, ");
+  print_int(image->pages_reused);
+  print(" reused\n");
+  print(elf_open(data, 16) == NULL && elf_close(image) == 0
+            ? "elf closed\n"
+            : "elf close failed\n");
+  kfree(data);
+  thread_exit();
+}
+
+void test_elf() { create_thread(create_process(), t_elf, 0); }
+
+/*
+Ten thousand fibers on one thread take turns a few times and fit in a few MiB,
+one of them waits for a fiber it created
+*/
+#define NO_FIBERS 10000
+#define FIBER_ROUNDS 3
+
+static uint32_t fiber_sum;
+static uint32_t fiber_peak_frames;
+
+void f_child(uintptr_t arg) {
+  fiber_yield();
+  fiber_sum += arg;
+}
+
+void f_task(uintptr_t i) {
+  if (i == 0) {
+    fiber_join(fiber_create(f_child, 1));
+  }
+  for (int round = 0; round < FIBER_ROUNDS; round++) {
+    fiber_sum += i;
+    fiber_yield();
+    if (i == NO_FIBERS - 1 && round == 0) {
+      fiber_peak_frames = pmm_frames_used(); // Every fiber has switched out
+    }
+  }
+}
+
+void t_fibers() {
+  uint32_t frames = pmm_frames_used();
+  Fiber **fibers = (Fiber **)kmalloc(NO_FIBERS * sizeof(Fiber *));
+  fiber_sum = 0;
+  for (uint32_t i = 0; i < NO_FIBERS; i++) {
+    fibers[i] = fiber_create(f_task, i);
+  }
+  int joined = 0;
+  for (uint32_t i = 0; i < NO_FIBERS; i++) {
+    joined += fibers[i] != NULL && fiber_join(fibers[i]) == 0;
+  }
+  kfree(fibers);
+  print_int(joined);
+  print(" fibers joined, ");
+  uint32_t expected = FIBER_ROUNDS * (NO_FIBERS * (NO_FIBERS - 1) / 2) + 1;
+  print(fiber_sum == expected ? "sum ok, " : "sum wrong, ");
+  print_int((fiber_peak_frames - frames) * 4);
+  print(" KiB at most\n");
+  thread_exit();
+}
+
+void test_fibers() { create_thread(create_process(), t_fibers, 0); }
+
+/*
+A thread that disabled preemption keeps its CPU through several time slices
+while others wait for it, and a long interrupts-off section shows up among the
+worst ones
+*/
+#define PREEMPT_HOLD_US 50000
+#define IRQS_OFF_HOLD_US 2000
+
+void t_preempt_hog() {
+  timer_delay_us(PREEMPT_HOLD_US * 2);
+  thread_exit();
+}
+
+void t_preempt() {
+  Thread *thread = thread_current();
+  preempt_disable();
+  Cpu *cpu = this_cpu();
+  uint32_t switches = thread->nr_involuntary;
+  timer_delay_us(PREEMPT_HOLD_US);
+  int kept = thread->nr_involuntary == switches && this_cpu() == cpu;
+  preempt_enable();
+
+  uint32_t flags = irq_save();
+  timer_delay_us(IRQS_OFF_HOLD_US);
+  irq_restore(flags);
+
+  print(kept ? "preemption deferred\n" : "preempted while disabled\n");
+  print_irqs_off();
+  thread_exit();
+}
+
+void test_preempt() {
+  Process *p = create_process();
+  for (uint32_t i = 0; i < no_cpus * 2; i++) {
+    create_thread(p, (void (*)(uintptr_t))t_preempt_hog, 0);
+  }
+  create_thread(p, (void (*)(uintptr_t))t_preempt, 0);
+}
+
+/*
+A user thread and kernel threads take turns on the CPUs. The kernel threads
+borrow the user PD rather than loading their own, so switching between them
+mostly reloads nothing.
+*/
+#define LAZY_TLB_ROUNDS 1000
+
+USER_CODE void t_lazy_tlb_user() {
+  for (int i = 0; i < LAZY_TLB_ROUNDS; i++) {
+    syscall0(SYS_YIELD);
+  }
+}
+
+void t_lazy_tlb_kernel() {
+  for (int i = 0; i < LAZY_TLB_ROUNDS; i++) {
+    yield();
+  }
+  thread_exit();
+}
+
+static void count_cr3(uint32_t *loads, uint32_t *skips) {
+  *loads = 0;
+  *skips = 0;
+  for (uint32_t i = 0; i < no_cpus; i++) {
+    *loads += cpus[i].cr3_loads;
+    *skips += cpus[i].cr3_skips;
+  }
+}
+
+void t_lazy_tlb() {
+  uint32_t loads, skips, loads_after, skips_after;
+  count_cr3(&loads, &skips);
+  create_user_thread(create_process(), (void (*)(uintptr_t))t_lazy_tlb_user,
+                     0);
+  for (uint32_t i = 0; i < no_cpus; i++) {
+    create_thread(thread_current()->process,
+                  (void (*)(uintptr_t))t_lazy_tlb_kernel, 0);
+  }
+  timer_wait_ms(1000);
+  count_cr3(&loads_after, &skips_after);
+  print_int(loads_after - loads);
+  print(" CR3 reloads, ");
+  print_int(skips_after - skips);
+  print(" avoided\n");
+  thread_exit();
+}
+
+void test_lazy_tlb() { create_thread(create_process(), t_lazy_tlb, 0); }
+
+/*
+Two handlers share a vector and both run on each interrupt, and an invalid
+opcode is recovered from by a handler that skips it
+*/
+#define TEST_VECTOR 0x90
+
+static volatile uint32_t vector_hits[2];
+
+static int h_vector_one(CpuContext *context) {
+  vector_hits[0]++;
+  return 1;
+}
+
+static int h_vector_two(CpuContext *context) {
+  vector_hits[1]++;
+  return 0; // Not its device
+}
+
+extern uint8_t test_ud2[];
+static volatile int ud2_skipped;
+
+static int h_skip_ud2(CpuContext *context) {
+  if (context->eip != (uintptr_t)test_ud2) {
+    return 0;
+  }
+  context->eip += 2; // ud2 is 2 bytes long
+  ud2_skipped = 1;
+  return 1;
+}
+
+void t_vectors() {
+  vector_add_handler(TEST_VECTOR, h_vector_one);
+  vector_add_handler(TEST_VECTOR, h_vector_two);
+  isr_install_fixup(6, h_skip_ud2); // #UD
+  __asm__ __volatile__("int %0" : : "i"(TEST_VECTOR));
+  __asm__ __volatile__("int %0" : : "i"(TEST_VECTOR));
+  __asm__ __volatile__("test_ud2: ud2");
+  print(vector_hits[0] == 2 && vector_hits[1] == 2 ? "shared vector ok\n"
+                                                   : "shared vector wrong\n");
+  print(ud2_skipped ? "invalid opcode fixup ok\n"
+                    : "invalid opcode fixup wrong\n");
+  print_vector_stats();
+  thread_exit();
+}
+
+void test_vectors() { create_thread(create_process(), t_vectors, 0); }
+
+/*
+A thread sleeps on the timer many times, so the timer IRQ's latencies to its
+handler and to the woken thread show up, along with whatever else came in
+*/
+#define LATENCY_SLEEPS 50
+
+void t_latency() {
+  latency_reset();
+  for (int i = 0; i < LATENCY_SLEEPS; i++) {
+    timer_wait_ms(10);
+  }
+  print_latency();
+  thread_exit();
+}
+
+void test_latency() { create_thread(create_process(), t_latency, 0); }
+
+/*
+A handler on a software vector waits for a timer with interrupts enabled: the
+timer IRQ, and whatever else this CPU takes meanwhile, nest in it on the
+interrupt stack
+*/
+#define TEST_NEST_VECTOR 0x91
+#define NEST_TIMEOUT_NS 100000000
+
+static Timer nest_timer; // Outlives the handler if the IRQ never comes
+static volatile int nest_timer_fired;
+static uint32_t nested_irqs;
+static int nest_on_irq_stack;
+
+static void nest_timer_fn(uintptr_t arg) { nest_timer_fired = 1; }
+
+static uint32_t irqs_taken(Cpu *cpu) {
+  uint32_t count = 0;
+  for (uint32_t no = NO_EXCEPTIONS; no < NO_VECTORS; no++) {
+    count += cpu->vectors[no].count;
+  }
+  return count;
+}
+
+static int h_nest(CpuContext *context) {
+  Cpu *cpu = this_cpu();
+  uintptr_t sp = (uintptr_t)&cpu;
+  nest_on_irq_stack = cpu->irq_stack - sp < IRQ_STACK_SIZE;
+  uint32_t taken = irqs_taken(cpu);
+  nest_timer = (Timer){.expires = 0, .fn = nest_timer_fn, .arg = 0};
+  timer_add(&nest_timer); // Fires on the next tick
+  uint64_t end = clock_monotonic() + NEST_TIMEOUT_NS;
+  while (!nest_timer_fired && clock_monotonic() < end) {
+    __asm__ __volatile__("pause");
+  }
+  nested_irqs = irqs_taken(cpu) - taken;
+  return 1;
+}
+
+void t_nested_irqs() {
+  vector_add_handler(TEST_NEST_VECTOR, h_nest);
+  __asm__ __volatile__("int %0" : : "i"(TEST_NEST_VECTOR));
+  print(nest_timer_fired ? "timer fired during a handler, "
+                         : "timer did not fire, ");
+  print_int(nested_irqs);
+  print(nest_on_irq_stack ? " interrupts nested on the interrupt stack\n"
+                          : " interrupts nested on a thread stack\n");
+  thread_exit();
+}
+
+void test_nested_irqs() { create_thread(create_process(), t_nested_irqs, 0); }
+
+/*
+The boot sector and the kernel image are read back through DMA and PIO, which
+must agree. The last sector of a scratch drive (any but drive 0, the boot disk,
+e.g. make run ATA_DISK=scratch.img) is written and read back, then restored.
+*/
+#define ATA_TEST_SECTORS 64
+
+void t_ata() {
+  if (ata_no_drives() == 0) {
+    print("no ATA drive\n");
+    thread_exit();
+  }
+  uint32_t count = ATA_TEST_SECTORS;
+  if (ata_sectors(0) < count) {
+    count = ata_sectors(0);
+  }
+  uint32_t no_bytes = count * ATA_SECTOR_SIZE;
+  uint8_t *dma = (uint8_t *)kmalloc(no_bytes);
+  uint8_t *pio = (uint8_t *)kmalloc(no_bytes);
+  int err = ata_read(0, 0, count, dma);
+  ata_set_dma(0);
+  err |= ata_read(0, 0, count, pio);
+  ata_set_dma(1);
+  print(err == 0 && dma[510] == 0x55 && dma[511] == 0xAA &&
+                mem_cmp(dma, pio, no_bytes) == 0
+            ? "DMA and PIO reads agree\n"
+            : "DMA and PIO reads differ\n");
+
+  uint32_t scratch = ata_no_drives() - 1;
+  if (scratch == 0) {
+    print("no scratch drive, write not tested\n");
+  } else {
+    uint64_t last = ata_sectors(scratch) - 1;
+    uint8_t *saved = dma;
+    uint8_t *pattern = pio;
+    err = ata_read(scratch, last, 1, saved);
+    for (uint32_t i = 0; i < ATA_SECTOR_SIZE; i++) {
+      pattern[i] = i * 7;
+    }
+    err |= ata_write(scratch, last, 1, pattern);
+    mem_set(pattern, 0, ATA_SECTOR_SIZE);
+    err |= ata_read(scratch, last, 1, pattern);
+    int same = 1;
+    for (uint32_t i = 0; i < ATA_SECTOR_SIZE; i++) {
+      same &= pattern[i] == (uint8_t)(i * 7);
+    }
+    err |= ata_write(scratch, last, 1, saved);
+    print(err == 0 && same ? "write read back\n" : "write not read back\n");
+  }
+  print_ata_stats();
+  kfree(dma);
+  kfree(pio);
+  thread_exit();
+}
+
+void test_ata() { create_thread(create_process(), t_ata, 0); }
+
+/*
+A batch of small requests, all queued at once, must read what one large read
+does, and the last sector is written and read back, then restored
+*/
+#define VIRTIO_TEST_REQS 32
+#define VIRTIO_TEST_SECTORS 4 // Per request
+
+void t_virtio_blk() {
+  uint32_t count = VIRTIO_TEST_REQS * VIRTIO_TEST_SECTORS;
+  if (virtio_blk_sectors() < count) {
+    print("no virtio-blk disk\n");
+    thread_exit();
+  }
+  uint32_t no_bytes = count * VIRTIO_BLK_SECTOR_SIZE;
+  uint8_t *batched = (uint8_t *)kmalloc(no_bytes);
+  uint8_t *single = (uint8_t *)kmalloc(no_bytes);
+  VirtioBlkReq reqs[VIRTIO_TEST_REQS];
+  for (uint32_t i = 0; i < VIRTIO_TEST_REQS; i++) {
+    uint32_t sector = i * VIRTIO_TEST_SECTORS;
+    reqs[i] = (VirtioBlkReq){sector, VIRTIO_TEST_SECTORS,
+                             batched + sector * VIRTIO_BLK_SECTOR_SIZE, 0};
+  }
+  int err = virtio_blk_submit(reqs, VIRTIO_TEST_REQS);
+  for (uint32_t i = 0; i < VIRTIO_TEST_REQS && err == 0; i++) {
+    err |= virtio_blk_wait(&reqs[i]);
+  }
+  err |= virtio_blk_read(0, count, single);
+  print(err == 0 && mem_cmp(batched, single, no_bytes) == 0
+            ? "batched and single reads agree\n"
+            : "batched and single reads differ\n");
+
+  uint64_t last = virtio_blk_sectors() - 1;
+  uint8_t *saved = batched;
+  uint8_t *pattern = single;
+  err = virtio_blk_read(last, 1, saved);
+  for (uint32_t i = 0; i < VIRTIO_BLK_SECTOR_SIZE; i++) {
+    pattern[i] = i * 7;
+  }
+  err |= virtio_blk_write(last, 1, pattern);
+  mem_set(pattern, 0, VIRTIO_BLK_SECTOR_SIZE);
+  err |= virtio_blk_read(last, 1, pattern);
+  int same = 1;
+  for (uint32_t i = 0; i < VIRTIO_BLK_SECTOR_SIZE; i++) {
+    same &= pattern[i] == (uint8_t)(i * 7);
+  }
+  err |= virtio_blk_write(last, 1, saved);
+  print(err == 0 && same ? "write read back\n" : "write not read back\n");
+  print_virtio_blk_stats();
+  kfree(batched);
+  kfree(single);
+  thread_exit();
+}
+
+void test_virtio_blk() { create_thread(create_process(), t_virtio_blk, 0); }
@@ -4,34 +4,420 @@ The Programmable Interrupt Timer  (PIT or System Clock), is a chip used for
 accurately generating interrupts at regular time intervals.
 Channel 0 on the PIT is tied ot IRQ0.
 
-The default frequency of the PIT is 18.22 Hz.
+The PIT's input clock runs at 1.193182 MHz, and each channel divides it by a
+16-bit count. Channel 0 is used in one of two modes:
+- Periodic (mode 2, rate generator): IRQ0 fires every 1/HZ seconds and every
+  tick runs the scheduler.
+- Tickless (mode 0, interrupt on terminal count): the counter is loaded with
+  the distance to the next event and IRQ0 fires once. The next event is the
+  earliest timer wheel deadline, or the end of the current time slice if
+  another thread is waiting to run. With nothing to do, the CPU is only woken
+  when the 16-bit counter runs out (~55 ms).
+
+In both modes the tick counter is advanced by the number of PIT clocks that
+actually elapsed, scaled by HZ, so a divisor that does not divide the PIT clock
+evenly does not make the uptime drift. In tickless mode this also makes up the
+ticks that were skipped while idle.
+
+Timer wheel
+- Pending timers are hashed by their expiry tick into WHEEL_SIZE buckets
+- Firing the timers due on a tick only requires looking at one bucket, and the
+  next deadline is found by walking buckets forward from the current tick
+- Timers fire on the boot CPU (the only one the PIT interrupts), but can be
+  added from any CPU. The wheel and the PIT state are protected by timer_lock.
+
+Clocksource
+- Ticks only give 1/HZ resolution, so the Time Stamp Counter (TSC) is
+  calibrated against PIT channel 2 at boot
+- clock_monotonic() converts TSC cycles to nanoseconds with a fixed-point
+  multiply, without taking an interrupt or a lock
+- The tick counter and the TSC calibration are also published in the vDSO
+  page (see vdso.c), so user mode can read the clock the same way.
+- Channel 2 normally drives the PC speaker. Its gate is controlled and its
+  output is read back through port 0x61, which makes it a one-shot stopwatch.
 
 */
 
+#include "include/timer.h"
 #include "include/idt.h"
+#include "include/io.h"
 #include "include/irq.h"
 #include "include/process.h"
+#include "include/smp.h"
+#include "include/spinlock.h"
+#include "include/sync.h"
+#include "include/vdso.h"
+#include <stddef.h>
+
+#if HZ < 19 || HZ > 1000
+#error "HZ must be in the range 19-1000" // 16-bit PIT divisor, wheel size
+#endif
+
+#define PIT_FREQ 1193182
+#define PIT_COUNTS_PER_TICK ((PIT_FREQ + HZ / 2) / HZ)
+#define PIT_MAX_COUNT 0xFFFF
+#define PIT_MIN_COUNT 0x40 // Avoid re-arming closer than the IRQ overhead
+
+#define PIT_CH0_DATA_PORT 0x40
+#define PIT_CH2_DATA_PORT 0x42
+#define PIT_CMD_PORT 0x43
+#define PIT_CH2_GATE_PORT 0x61 // bit 0: gate, bit 1: speaker, bit 5: output
+
+/*
+PIT command byte:
+- bits 6-7: channel (or 11 for the read-back command)
+- bits 4-5: access mode (11 = low byte then high byte)
+- bits 1-3: operating mode
+- bit 0: BCD mode (always 0)
+*/
+#define PIT_CMD_CH0_ONESHOT 0x30  // Channel 0, lobyte/hibyte, mode 0
+#define PIT_CMD_CH0_PERIODIC 0x34 // Channel 0, lobyte/hibyte, mode 2
+#define PIT_CMD_CH2_ONESHOT 0xB0  // Channel 2, lobyte/hibyte, mode 0
+#define PIT_CMD_READBACK_CH0 0xC2 // Latch count and status of channel 0
+#define PIT_STATUS_OUT 0x80       // Output pin state (set at terminal count)
+
+#define TIME_SLICE 1 // Ticks a thread may run before it can be preempted
+#define MAX_IDLE_TICKS ((uint32_t)PIT_MAX_COUNT * HZ / PIT_FREQ)
+
+#define WHEEL_SIZE 64
+
+#define TSC_CALIBRATE_MS 50
+#define TSC_SHIFT 24 // Fixed-point fraction bits of tsc_mult
+
+uint64_t sys_uptime_counter; // Count of the number of ticks from the PIT
+
+static uint32_t pit_armed;   // Count channel 0 was last loaded with
+static uint32_t pit_residue; // PIT clocks * HZ elapsed but not yet a tick
+static uint64_t slice_end;   // Tick at which the running thread's slice ends
+static uint64_t last_run;    // Last tick whose timers have been fired
+
+static Timer *timer_wheel[WHEEL_SIZE];
+static Spinlock timer_lock;
+
+uint32_t tsc_khz;         // TSC cycles per millisecond (0 if there is no TSC)
+static uint32_t tsc_mult; // Nanoseconds per cycle << TSC_SHIFT
+static uint64_t tsc_base; // TSC value at calibration (the clock's origin)
+
+/* Tick comparisons that stay correct when the counter wraps */
+#define TICK_BEFORE_EQ(a, b) ((int64_t)((a) - (b)) <= 0)
+#define WHEEL_BUCKET(tick) ((uint32_t)(tick) & (WHEEL_SIZE - 1))
+
+/*
+
+PIT
+
+*/
+
+static void pit_load(uint8_t cmd, uint16_t count) {
+  port_byte_out(PIT_CMD_PORT, cmd);
+  port_byte_out(PIT_CH0_DATA_PORT, count & 0xFF);
+  port_byte_out(PIT_CH0_DATA_PORT, count >> 8);
+  pit_armed = count;
+}
+
+/*
+Return the number of PIT clocks since channel 0 was last loaded. Once a mode 0
+counter reaches terminal count its output pin goes high and the counter keeps
+decrementing from 0xFFFF, so the pin tells the two cases apart.
+*/
+static uint32_t pit_elapsed() {
+  port_byte_out(PIT_CMD_PORT, PIT_CMD_READBACK_CH0);
+  uint8_t status = port_byte_in(PIT_CH0_DATA_PORT);
+  uint16_t count = port_byte_in(PIT_CH0_DATA_PORT);
+  count |= port_byte_in(PIT_CH0_DATA_PORT) << 8;
+
+  if (status & PIT_STATUS_OUT) {
+    return pit_armed + ((0x10000 - count) & 0xFFFF);
+  }
+  return pit_armed - count;
+}
+
+/* Credit elapsed PIT clocks to the tick counter, making up any lost ticks */
+static void pit_account(uint32_t elapsed) {
+  pit_residue += elapsed * HZ;
+  while (pit_residue >= PIT_FREQ) {
+    pit_residue -= PIT_FREQ;
+    sys_uptime_counter++;
+  }
+  vdso_set_ticks(sys_uptime_counter);
+}
+
+/*
 
-#define DEF_FREQ 18
+Clocksource
 
-int sys_uptime_counter; // Count of the number of ticks from the PIT
+*/
+
+uint64_t rdtsc() {
+  uint32_t low, high;
+  __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+  return (uint64_t)high << 32 | low;
+}
 
-/* Timer IRQ handler */
-void timer_handler(CpuContext *context) {
-  sys_uptime_counter++;
-  schedule(context); // The core of the scheduling algorithm
+static int has_tsc() {
+  uint32_t eax = 1, ebx, ecx, edx;
+  __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+  return (edx >> 4) & 1;
 }
 
-/* Add the timer handler to the IRQ based interrupt mapping */
+/*
+Count TSC cycles while PIT channel 2 counts down TSC_CALIBRATE_MS. Interrupts
+must be disabled.
+*/
+static void tsc_calibrate() {
+  if (!has_tsc()) {
+    return;
+  }
+
+  uint16_t count = (uint32_t)PIT_FREQ * TSC_CALIBRATE_MS / 1000;
+  uint8_t gate = port_byte_in(PIT_CH2_GATE_PORT);
+  port_byte_out(PIT_CH2_GATE_PORT, (gate & ~0x02) | 0x01); // Speaker off
+
+  port_byte_out(PIT_CMD_PORT, PIT_CMD_CH2_ONESHOT);
+  port_byte_out(PIT_CH2_DATA_PORT, count & 0xFF);
+  port_byte_out(PIT_CH2_DATA_PORT, count >> 8); // Starts counting
+  uint64_t start = rdtsc();
+  while (!(port_byte_in(PIT_CH2_GATE_PORT) & 0x20)) {
+  }
+  uint64_t cycles = rdtsc() - start;
+
+  port_byte_out(PIT_CH2_GATE_PORT, gate);
+
+  tsc_khz = cycles * PIT_FREQ / ((uint64_t)count * 1000);
+  tsc_mult = ((uint64_t)1000000 << TSC_SHIFT) / tsc_khz;
+  tsc_base = rdtsc();
+}
+
+/*
+Convert TSC cycles to nanoseconds. The 64x32-bit product is split into two
+halves so it cannot overflow.
+*/
+uint64_t tsc_to_ns(uint64_t cycles) {
+  uint32_t hi = cycles >> 32;
+  uint32_t lo = cycles;
+  return (((uint64_t)hi * tsc_mult) << (32 - TSC_SHIFT)) +
+         (((uint64_t)lo * tsc_mult) >> TSC_SHIFT);
+}
+
+/* Nanoseconds since boot. Falls back to tick resolution without a TSC. */
+uint64_t clock_monotonic() {
+  if (tsc_khz == 0) {
+    return sys_uptime_counter * (1000000000 / HZ);
+  }
+  return tsc_to_ns(rdtsc() - tsc_base);
+}
+
+/* Busy-wait, for delays too short to sleep or before interrupts are enabled */
+void timer_delay_us(uint32_t us) {
+  uint64_t end = clock_monotonic() + (uint64_t)us * 1000;
+  while (clock_monotonic() < end) {
+    __asm__ __volatile__("pause");
+  }
+}
+
+/*
+
+Timer wheel
+
+*/
+
+/* Return the tick of the earliest event within the reach of one PIT load */
+static uint64_t timer_next_event() {
+  uint64_t now = sys_uptime_counter;
+  uint64_t next = now + MAX_IDLE_TICKS;
+
+  if (schedule_pending() && TICK_BEFORE_EQ(slice_end, next)) {
+    next = TICK_BEFORE_EQ(slice_end, now) ? now + 1 : slice_end;
+  }
+
+  for (uint64_t tick = now + 1; TICK_BEFORE_EQ(tick, next); tick++) {
+    for (Timer *t = timer_wheel[WHEEL_BUCKET(tick)]; t != NULL; t = t->next) {
+      if (t->expires == tick) {
+        return tick;
+      }
+    }
+  }
+  return next;
+}
+
+/* Load channel 0 (one-shot) with the distance to the next event. timer_lock
+ * must be held. */
+static void timer_program() {
+  pit_account(pit_elapsed());
+
+  uint32_t ticks = timer_next_event() - sys_uptime_counter;
+  uint32_t count = (ticks * PIT_FREQ - pit_residue + HZ - 1) / HZ;
+  if (count > PIT_MAX_COUNT) {
+    count = PIT_MAX_COUNT;
+  }
+  if (count < PIT_MIN_COUNT) {
+    count = PIT_MIN_COUNT;
+  }
+  pit_load(PIT_CMD_CH0_ONESHOT, count);
+}
+
+/*
+Fire every timer that expired since the last call. timer_lock must be held, it
+is dropped while a callback runs (callbacks may add timers), so the bucket is
+rescanned from its head afterwards.
+*/
+static void timer_run() {
+  uint64_t now = sys_uptime_counter;
+  int buckets = 0;
+
+  while (last_run != now && buckets++ < WHEEL_SIZE) {
+    last_run++;
+    Timer **link = &timer_wheel[WHEEL_BUCKET(last_run)];
+    while (*link != NULL) {
+      Timer *t = *link;
+      if (TICK_BEFORE_EQ(t->expires, now)) {
+        *link = t->next;
+        t->next = NULL;
+        spin_unlock(&timer_lock);
+        t->fn(t->arg);
+        spin_lock(&timer_lock);
+        link = &timer_wheel[WHEEL_BUCKET(last_run)];
+      } else {
+        link = &t->next;
+      }
+    }
+  }
+  last_run = now;
+}
+
+void timer_add(Timer *timer) {
+  uint32_t flags = spin_lock_irqsave(&timer_lock);
+  if (TICK_BEFORE_EQ(timer->expires, sys_uptime_counter)) {
+    timer->expires = sys_uptime_counter + 1;
+  }
+  timer->next = timer_wheel[WHEEL_BUCKET(timer->expires)];
+  timer_wheel[WHEEL_BUCKET(timer->expires)] = timer;
+  if (TICKLESS) {
+    timer_program();
+  }
+  spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+void timer_del(Timer *timer) {
+  uint32_t flags = spin_lock_irqsave(&timer_lock);
+  Timer **link = &timer_wheel[WHEEL_BUCKET(timer->expires)];
+  while (*link != NULL) {
+    if (*link == timer) {
+      *link = timer->next;
+      timer->next = NULL;
+      break;
+    }
+    link = &(*link)->next;
+  }
+  spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+/*
+Re-evaluate the next timer event, e.g. after a timer was added or a thread
+became runnable. Only needed in tickless mode.
+*/
+void timer_update() {
+  if (!TICKLESS) {
+    return;
+  }
+  uint32_t flags = spin_lock_irqsave(&timer_lock);
+  timer_program();
+  spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+/*
+
+IRQ
+
+*/
+
+/*
+Timer IRQ handler. It keeps interrupts disabled, as the timers it runs may take
+locks that other handlers take.
+*/
+int timer_handler(CpuContext *context) {
+  uint32_t flags = spin_lock_irqsave(&timer_lock);
+  if (TICKLESS) {
+    pit_account(pit_elapsed());
+    pit_load(PIT_CMD_CH0_ONESHOT, PIT_MAX_COUNT); // Keep counting meanwhile
+  } else {
+    pit_account(PIT_COUNTS_PER_TICK);
+  }
+
+  timer_run();
+
+  int slice_expired = TICK_BEFORE_EQ(slice_end, sys_uptime_counter);
+  if (slice_expired) {
+    slice_end = sys_uptime_counter + TIME_SLICE;
+  }
+
+  if (TICKLESS) {
+    timer_program();
+  }
+  spin_unlock_irqrestore(&timer_lock, flags);
+
+  // The switch happens once the IRQ returns (see vector.c), as it does when a
+  // real-time thread released by a timer preempts without waiting for a slice
+  if (slice_expired) {
+    this_cpu()->need_resched = 1; // The core of the scheduling algorithm
+  }
+  return 1;
+}
+
+/*
+Add the timer handler to the IRQ based interrupt mapping, calibrate the TSC and
+start channel 0. Interrupts must be disabled.
+*/
 void timer_install() {
   irq_install_handler(0, timer_handler);
+  tsc_calibrate();
+  vdso_set_clocksource(1000000000 / HZ, tsc_khz, tsc_mult, TSC_SHIFT, tsc_base);
   sys_uptime_counter = 0;
+  last_run = 0;
+  slice_end = TIME_SLICE;
+  for (int i = 0; i < WHEEL_SIZE; i++) {
+    timer_wheel[i] = NULL;
+  }
+
+  if (TICKLESS) {
+    pit_load(PIT_CMD_CH0_ONESHOT, PIT_COUNTS_PER_TICK);
+  } else {
+    pit_load(PIT_CMD_CH0_PERIODIC, PIT_COUNTS_PER_TICK);
+  }
 }
 
-/* This function can be used to halt the CPU for a specified number of seconds
- */
-void timer_wait(double secs) {
-  double target = sys_uptime_counter + secs * DEF_FREQ;
-  while (sys_uptime_counter < target) {
+static void timer_wake(uintptr_t arg) { wait_queue_wake_one((WaitQueue *)arg); }
+
+/* Block the calling thread for ticks timer ticks (at least one) */
+static void timer_sleep_ticks(uint32_t ticks) {
+  WaitQueue wq;
+  wait_queue_init(&wq);
+  Timer timer = {.expires = sys_uptime_counter + (ticks ? ticks : 1),
+                 .fn = timer_wake,
+                 .arg = (uintptr_t)&wq,
+                 .next = NULL};
+  // Holding the queue lock, the timer cannot wake it before the thread sleeps
+  uint32_t flags = spin_lock_irqsave(&wq.lock);
+  timer_add(&timer);
+  wait_queue_sleep_locked(&wq, flags);
+}
+
+/*
+Block the calling thread for ms milliseconds, rounded up to whole ticks. In
+integers, so sleeping does not make a thread use the FPU (see fpu.c).
+*/
+void timer_wait_ms(uint32_t ms) {
+  timer_sleep_ticks(((uint64_t)ms * HZ + 999) / 1000);
+}
+
+/*
+Block the calling thread until clock_monotonic() reaches ns. It is woken on the
+first tick after that, so up to 1/HZ late. Returns at once if ns has passed.
+*/
+void timer_wait_until(uint64_t ns) {
+  uint64_t now = clock_monotonic();
+  if (ns > now) {
+    uint64_t ticks = ((ns - now) * HZ + 999999999) / 1000000000;
+    timer_sleep_ticks(ticks);
   }
 }
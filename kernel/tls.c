@@ -0,0 +1,60 @@
+/*
+
+Thread-local storage
+
+Variables declared __thread get a copy per thread, reached through GS. The
+compiler addresses them at fixed negative offsets from the thread pointer (the
+i386 ELF TLS layout), so reading one is a single GS-relative load:
+
+    | .tdata image | zeroed .tbss | Tcb |
+                                  ^ thread pointer = GS base
+
+- The linker collects the initial values (.tdata) and the size of the zeroed
+  part (.tbss) between tls_start and tls_end (see linker.ld). The kernel is
+  one static image, so it is compiled with -ftls-model=local-exec and the
+  offsets are final at link time.
+- Every thread gets a block when it is created. The first word of its Tcb
+  points to the Tcb itself, which is how the compiler takes the address of a
+  TLS variable.
+- Each CPU has a GDT entry for GS (GDT_TLS). The scheduler rebases it on the
+  next thread on every switch and reloads GS, since the CPU only reads a
+  descriptor when a selector is loaded. Interrupt and system call entry load
+  GS too, so kernel code always sees the running thread's block, also when it
+  interrupted user mode. User mode keeps its own GS.
+- TLS may only be used once the CPU runs threads (after sched_init() or
+  sched_init_ap()). Until then GS is flat and has no block.
+
+*/
+
+#include "include/tls.h"
+#include "include/gdt.h"
+#include "include/memory.h"
+#include "include/smp.h"
+#include "include/vmm.h"
+
+#define TLS_ALIGN 16 // linker.ld pads the TLS size to this
+
+extern uint8_t tls_start[], tls_data_end[], tls_end[];
+
+/* Allocate and initialize a TLS block for thread. Return its thread pointer. */
+uintptr_t tls_alloc(Thread *thread) {
+  uint32_t size = tls_end - tls_start;
+  uint32_t data_size = tls_data_end - tls_start;
+  uintptr_t block = kmalloc(size + TLS_ALIGN - 1 + sizeof(Tcb));
+  Tcb *tcb = (Tcb *)((block + size + TLS_ALIGN - 1) & ~(TLS_ALIGN - 1));
+  uint8_t *image = (uint8_t *)tcb - size;
+  mem_cpy(tls_start, image, data_size);
+  mem_set(image + data_size, 0, size - data_size);
+  tcb->self = tcb;
+  tcb->thread = thread;
+  tcb->block = (void *)block;
+  return (uintptr_t)tcb;
+}
+
+void tls_free(Thread *thread) { kfree(((Tcb *)thread->tls)->block); }
+
+/* Point GS at next's TLS block on cpu. Interrupts must be disabled. */
+void tls_switch(Cpu *cpu, Thread *next) {
+  gdt_set_entry(cpu->gdt, GDT_TLS, next->tls, 0xFFFFF, 0x92, 0xC0);
+  __asm__ __volatile__("mov %0, %%gs" : : "r"((uint16_t)TLS_SEL) : "memory");
+}
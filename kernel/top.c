@@ -0,0 +1,179 @@
+/*
+
+A live view of the scheduler's per-thread accounting, like top
+
+- Tab toggles a full-screen table of threads, sorted by the CPU time they used
+  over the last second, and restores the screen when closed.
+- A kernel thread redraws it once a second and otherwise sleeps, so a hidden
+  view costs nothing. The counters are copied under the scheduler lock (see
+  sched_snapshot()) and drawn after it is released.
+- %CPU is relative to one CPU, the idle threads show how idle each CPU was.
+  The first refresh after opening averages over the time since the view was
+  last refreshed (or since boot).
+
+*/
+
+#include "include/top.h"
+#include "include/kb.h"
+#include "include/process.h"
+#include "include/screen.h"
+#include "include/sync.h"
+#include "include/timer.h"
+#include <stddef.h>
+
+#define TOP_KEY '\t'
+#define TOP_MAX_THREADS 64
+#define TOP_FIRST_ROW 2 // Below the title and the column names
+
+#define NS_PER_MS 1000000
+
+/* Column positions */
+#define COL_PID 0
+#define COL_TID 5
+#define COL_STATE 10
+#define COL_CPU 19
+#define COL_PCPU 24
+#define COL_RUN 30
+#define COL_WAIT 42
+#define COL_VOL 54
+#define COL_INVOL 64
+
+static struct {
+  volatile int shown;
+  Semaphore toggled; // Upped when the view is opened
+  ThreadStats stats[TOP_MAX_THREADS];
+  ThreadStats last[TOP_MAX_THREADS]; // Previous refresh
+  uint64_t delta_ns[TOP_MAX_THREADS];
+  uint32_t no_last;
+  uint64_t last_refresh;
+} top;
+
+static const char *status_names[] = {"READY", "RUNNING", "BLOCKED", "DEAD"};
+
+static void top_key(char pressed) {
+  if (pressed != TOP_KEY) {
+    return;
+  }
+  top.shown = !top.shown;
+  if (top.shown) {
+    semaphore_up(&top.toggled);
+  }
+}
+
+/* CPU time a thread used since the last refresh */
+static uint64_t run_delta(ThreadStats *stats) {
+  for (uint32_t i = 0; i < top.no_last; i++) {
+    if (top.last[i].thread == stats->thread && top.last[i].tid == stats->tid) {
+      return stats->run_ns - top.last[i].run_ns;
+    }
+  }
+  return stats->run_ns; // New since the last refresh
+}
+
+/* Sort stats (and delta_ns along) by delta_ns, descending */
+static void sort_stats(uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t max = i;
+    for (uint32_t j = i + 1; j < n; j++) {
+      if (top.delta_ns[j] > top.delta_ns[max]) {
+        max = j;
+      }
+    }
+    ThreadStats stats = top.stats[i];
+    top.stats[i] = top.stats[max];
+    top.stats[max] = stats;
+    uint64_t delta = top.delta_ns[i];
+    top.delta_ns[i] = top.delta_ns[max];
+    top.delta_ns[max] = delta;
+  }
+}
+
+static void clear_row(int y) {
+  for (int x = 0; x < get_screen_w(); x++) {
+    print_at(" ", x, y, WHITE, BLACK);
+  }
+}
+
+static void draw_header(uint32_t no_threads) {
+  clear_row(0);
+  print_at("top - up ", 0, 0, WHITE, BLACK);
+  print_int((uint32_t)(top.last_refresh / (NS_PER_MS * 1000)));
+  print(" s, ");
+  print_int(no_threads);
+  print(" threads, Tab to close");
+
+  print_block(0, 1, get_screen_w() - 1, 1, WHITE);
+  print_at("PID", COL_PID, 1, BLACK, WHITE);
+  print_at("TID", COL_TID, 1, BLACK, WHITE);
+  print_at("STATE", COL_STATE, 1, BLACK, WHITE);
+  print_at("CPU", COL_CPU, 1, BLACK, WHITE);
+  print_at("%CPU", COL_PCPU, 1, BLACK, WHITE);
+  print_at("RUN ms", COL_RUN, 1, BLACK, WHITE);
+  print_at("WAIT ms", COL_WAIT, 1, BLACK, WHITE);
+  print_at("VOL", COL_VOL, 1, BLACK, WHITE);
+  print_at("INVOL", COL_INVOL, 1, BLACK, WHITE);
+}
+
+static void draw_row(int y, ThreadStats *stats, uint32_t pcpu) {
+  clear_row(y);
+  print_int_at(stats->pid, COL_PID, y, WHITE, BLACK);
+  print_int_at(stats->tid, COL_TID, y, WHITE, BLACK);
+  print_at(status_names[stats->status], COL_STATE, y, WHITE, BLACK);
+  print_int_at(stats->cpu, COL_CPU, y, WHITE, BLACK);
+  print_int_at(pcpu, COL_PCPU, y, pcpu >= 50 ? LIGHT_RED : WHITE, BLACK);
+  print_int_at(stats->run_ns / NS_PER_MS, COL_RUN, y, WHITE, BLACK);
+  print_int_at(stats->wait_ns / NS_PER_MS, COL_WAIT, y, WHITE, BLACK);
+  print_int_at(stats->nr_voluntary, COL_VOL, y, WHITE, BLACK);
+  print_int_at(stats->nr_involuntary, COL_INVOL, y, WHITE, BLACK);
+}
+
+static void top_draw() {
+  uint32_t n = sched_snapshot(top.stats, TOP_MAX_THREADS);
+  uint64_t now = clock_monotonic();
+  uint64_t interval = now - top.last_refresh;
+  top.last_refresh = now;
+
+  for (uint32_t i = 0; i < n; i++) {
+    top.delta_ns[i] = run_delta(&top.stats[i]);
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    top.last[i] = top.stats[i];
+  }
+  top.no_last = n;
+  sort_stats(n);
+
+  draw_header(n);
+  int y = TOP_FIRST_ROW;
+  for (uint32_t i = 0; i < n && y < get_screen_h(); i++, y++) {
+    uint32_t pcpu = interval ? top.delta_ns[i] * 100 / interval : 0;
+    draw_row(y, &top.stats[i], pcpu);
+  }
+  for (; y < get_screen_h(); y++) {
+    clear_row(y);
+  }
+}
+
+static void top_loop() {
+  while (1) {
+    semaphore_down(&top.toggled);
+    if (!top.shown) {
+      continue;
+    }
+    screen_backup();
+    disable_cursor();
+    while (top.shown) {
+      top_draw();
+      timer_wait_ms(1000);
+    }
+    screen_restore();
+    enable_cursor();
+  }
+}
+
+/* Start the view's thread and listen for its key. Needs the scheduler. */
+void top_install() {
+  top.shown = 0;
+  semaphore_init(&top.toggled, 0);
+  register_kb_observer(&top_key);
+  create_thread(create_process(), (void (*)(uintptr_t))top_loop, 0);
+}
@@ -0,0 +1,17 @@
+[bits 32]
+
+%define SYS_EXIT 0
+
+global user_thread_entry
+
+section .utext
+
+	; First code run by a user thread (see make_user_thread() in process.c), in ring
+	; 3. Calls the thread's function with its argument, then exits the thread.
+
+user_thread_entry:
+	push eax; Argument
+	call ebx; Function
+	mov  eax, SYS_EXIT
+	int  0x80
+	jmp  $
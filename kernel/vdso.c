@@ -0,0 +1,63 @@
+/*
+
+A page of kernel data that user processes can read directly
+
+- Reading the time or scheduler state through a system call costs a privilege
+  transition each time. Instead, the kernel keeps that state in one page,
+  which create_process_pd() maps read-only at VDSO_VA in every process.
+- Writers keep it consistent with sequence counters (see seqlock.h): the
+  clock is written by the timer IRQ, each CPU's counters under its run queue
+  lock. Readers in user mode retry instead of locking.
+- The page is part of the kernel image. Nothing else may share it, as all of
+  it becomes visible to user mode.
+
+*/
+
+#include "include/vdso.h"
+
+#define PAGE_SIZE 4096
+#define K_CODE_START 0xC0000000 // Kernel VA of physical address 0
+
+static uint8_t vdso_page[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+static VdsoData *const vdso = (VdsoData *)vdso_page;
+
+_Static_assert(sizeof(VdsoData) <= PAGE_SIZE, "VdsoData must fit a page");
+
+/* Physical address of the page, for mapping it */
+uintptr_t vdso_frame() { return (uintptr_t)vdso_page - K_CODE_START; }
+
+/* Publish how to turn TSC cycles and ticks into nanoseconds */
+void vdso_set_clocksource(uint32_t ns_per_tick, uint32_t tsc_khz,
+                          uint32_t tsc_mult, uint32_t tsc_shift,
+                          uint64_t tsc_base) {
+  VdsoClock *clock = &vdso->clock;
+  seq_write_begin(&clock->seq);
+  clock->ns_per_tick = ns_per_tick;
+  clock->tsc_khz = tsc_khz;
+  clock->tsc_mult = tsc_mult;
+  clock->tsc_shift = tsc_shift;
+  clock->tsc_base = tsc_base;
+  seq_write_end(&clock->seq);
+}
+
+/* timer_lock must be held */
+void vdso_set_ticks(uint64_t ticks) {
+  VdsoClock *clock = &vdso->clock;
+  seq_write_begin(&clock->seq);
+  clock->ticks = ticks;
+  seq_write_end(&clock->seq);
+}
+
+/* The run queue lock of cpu must be held */
+void vdso_set_cpu(uint32_t cpu, uint32_t switches, uint32_t nr_ready) {
+  VdsoCpu *stats = &vdso->cpus[cpu];
+  seq_write_begin(&stats->seq);
+  stats->switches = switches;
+  stats->nr_ready = nr_ready;
+  seq_write_end(&stats->seq);
+}
+
+/* Before any process runs */
+void vdso_set_sysenter(uint32_t has_sysenter) {
+  vdso->has_sysenter = has_sysenter;
+}
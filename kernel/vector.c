@@ -0,0 +1,237 @@
+/*
+
+Interrupt dispatch
+
+- Every vector has an entry stub generated in int.asm, which saves a
+  CpuContext and calls vector_dispatch().
+- Handlers are chained per vector. On a vector of an IRQ, every handler runs,
+  since any of the devices sharing the line may have raised it. On an
+  exception, the handlers run until one recovers from it (e.g. loads a missing
+  page), and the faulting instruction is then retried. If none does, the
+  exception is a fault (isr_fault_handler()).
+- Exceptions are handled on the stack they were raised on, with interrupts
+  disabled, as the thread that raised one may have to block or exit.
+- Other vectors run their handlers on the CPU's interrupt stack, with
+  interrupts enabled. A vector may have an ack function, which acknowledges
+  the interrupt once the handlers ran. Until then the interrupt controller
+  holds back interrupts of the same or a lower priority, so only more urgent
+  ones nest: the local APIC compares the priority class (vector / 16) of the
+  highest vector in service, the PIC's fully nested mode the IRQ numbers (IRQ
+  0 first, the slave's IRQs in place of IRQ 2). Nesting is bounded by the
+  priorities, and only the outermost interrupt uses the thread's stack.
+- Handlers must not block or switch threads, as they run on a per-CPU stack.
+  They set need_resched instead, and the outermost interrupt calls schedule()
+  on its way out, back on the thread's stack. A lock they share with other
+  handlers must be taken with interrupts disabled.
+- Handlers are only ever added. An entry is filled in before it is linked, so
+  dispatching walks the chains without a lock. Entries come from a fixed pool,
+  as most are added before the heap exists.
+- Each CPU counts the interrupts it took on each vector, the ones no handler
+  claimed, and the TSC cycles the handlers took, interrupts that nested in
+  them included. An exception whose handler switched threads is counted, but
+  its cycles are not, as they include the time other threads ran.
+
+*/
+
+#include "include/vector.h"
+#include "include/irq.h"
+#include "include/isr.h"
+#include "include/latency.h"
+#include "include/screen.h"
+#include "include/smp.h"
+#include "include/spinlock.h"
+#include "include/timer.h"
+#include <stddef.h>
+
+typedef struct VectorEntry {
+  VectorHandler handler;
+  struct VectorEntry *next;
+} VectorEntry;
+
+typedef struct {
+  VectorEntry *head;
+  VectorAck ack;
+} Vector;
+
+/* An interrupt on its way to the interrupt stack */
+typedef struct {
+  CpuContext *context;
+  uint64_t entry_tsc;
+} IrqEntry;
+
+/* Call fn(arg) on stack, see switch.asm */
+extern void call_on_stack(uintptr_t stack, void (*fn)(void *), void *arg);
+
+static Vector vectors[NO_VECTORS];
+static VectorEntry entries[NO_VECTOR_HANDLERS];
+static uint32_t no_entries;
+static Spinlock vectors_lock; // Serializes adding handlers
+
+/*
+Run handler on vector, after the handlers it already has. Return -1 if the pool
+of handlers is used up.
+*/
+int vector_add_handler(uint32_t vector, VectorHandler handler) {
+  if (vector >= NO_VECTORS) {
+    return -1;
+  }
+  uint32_t flags = spin_lock_irqsave(&vectors_lock);
+  if (no_entries == NO_VECTOR_HANDLERS) {
+    spin_unlock_irqrestore(&vectors_lock, flags);
+    return -1;
+  }
+  VectorEntry *entry = &entries[no_entries++];
+  entry->handler = handler;
+  entry->next = NULL;
+  VectorEntry **link = &vectors[vector].head;
+  while (*link != NULL) {
+    link = &(*link)->next;
+  }
+  __atomic_store_n(link, entry, __ATOMIC_RELEASE); // Filled in before visible
+  spin_unlock_irqrestore(&vectors_lock, flags);
+  return 0;
+}
+
+/* Acknowledge interrupts on vector with ack, once their handlers ran */
+void vector_set_ack(uint32_t vector, VectorAck ack) {
+  if (vector < NO_VECTORS) {
+    vectors[vector].ack = ack;
+  }
+}
+
+/*
+Hand the handlers and ack of vector from over to vector to, which has none.
+Neither may be raised meanwhile.
+*/
+void vector_move(uint32_t from, uint32_t to) {
+  if (from >= NO_VECTORS || to >= NO_VECTORS) {
+    return;
+  }
+  uint32_t flags = spin_lock_irqsave(&vectors_lock);
+  vectors[to] = vectors[from];
+  vectors[from] = (Vector){NULL, NULL};
+  spin_unlock_irqrestore(&vectors_lock, flags);
+}
+
+/*
+Run the handlers of vector on context. Return 1 if one handled it: on an
+exception, the first one that does is the last to run.
+*/
+static int run_handlers(Vector *vector, CpuContext *context, int exception) {
+  int handled = 0;
+  for (VectorEntry *entry = __atomic_load_n(&vector->head, __ATOMIC_ACQUIRE);
+       entry != NULL && !(handled && exception);
+       entry = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE)) {
+    handled |= entry->handler(context);
+  }
+  return handled;
+}
+
+/* Handle an exception, with interrupts disabled */
+static void dispatch_exception(CpuContext *context) {
+  uint32_t no = context->int_no;
+  Cpu *cpu = this_cpu();
+  uint32_t switches = cpu->switches;
+  uint64_t start = rdtsc();
+  cpu->vectors[no].count++;
+  int handled = run_handlers(&vectors[no], context, 1);
+  Cpu *now = this_cpu(); // Threads that switched may resume on another CPU
+  if (now == cpu && now->switches == switches) {
+    now->vectors[no].cycles += rdtsc() - start;
+  }
+  if (!handled) {
+    now->vectors[no].unhandled++;
+    isr_fault_handler(context);
+  }
+}
+
+/*
+Handle an interrupt with interrupts enabled, then acknowledge it with them
+disabled again, so that it is not raised anew before its iret
+*/
+static void dispatch_irq(IrqEntry *irq) {
+  uint32_t no = irq->context->int_no;
+  Vector *vector = &vectors[no];
+  Cpu *cpu = this_cpu(); // Handlers do not switch threads
+  uint64_t start = rdtsc();
+  cpu->vectors[no].count++;
+
+  uint32_t outer_vector = cpu->irq_vector;
+  uint64_t outer_entry_tsc = cpu->irq_entry_tsc;
+  int traced = TRACE_LATENCY && vector->head != NULL;
+  if (traced) {
+    latency_record(no, LAT_ENTRY, start - irq->entry_tsc);
+    cpu->irq_vector = no; // Threads woken meanwhile are traced, see latency.c
+    cpu->irq_entry_tsc = irq->entry_tsc;
+  }
+  irqs_off_end();
+  __asm__ __volatile__("sti");
+  int handled = run_handlers(vector, irq->context, 0);
+  __asm__ __volatile__("cli");
+  irqs_off_begin((uintptr_t)dispatch_irq);
+
+  uint64_t end = rdtsc();
+  cpu->vectors[no].cycles += end - start;
+  if (!handled) {
+    cpu->vectors[no].unhandled++;
+  }
+  if (traced) {
+    latency_record(no, LAT_HANDLER, end - start);
+    cpu->irq_vector = outer_vector;
+    cpu->irq_entry_tsc = outer_entry_tsc;
+  }
+  if (vector->ack != NULL) {
+    vector->ack(no);
+  }
+}
+
+/*
+Called by the entry stub of every vector except 0x80 and the spurious one,
+which read the TSC at entry_tsc
+*/
+void vector_dispatch(CpuContext *context, uint64_t entry_tsc) {
+  if (context->int_no < NO_EXCEPTIONS) {
+    dispatch_exception(context);
+    return;
+  }
+  Cpu *cpu = this_cpu();
+  irqs_off_begin((uintptr_t)vector_dispatch);
+  IrqEntry irq = {context, entry_tsc};
+  if (cpu->irq_depth++ == 0 && cpu->irq_stack != 0) {
+    call_on_stack(cpu->irq_stack, (void (*)(void *))dispatch_irq, &irq);
+  } else {
+    dispatch_irq(&irq); // Nested, or before the CPU has its interrupt stack
+  }
+  cpu->irq_depth--;
+
+  /* Back on the thread's stack once the outermost interrupt is handled */
+  if (cpu->irq_depth == 0 && cpu->need_resched && cpu->preempt_count == 0) {
+    schedule();
+  }
+  irqs_off_end(); // iret enables them
+}
+
+/* Print every vector that was taken, summed over the CPUs */
+void print_vector_stats() {
+  for (uint32_t no = 0; no < NO_VECTORS; no++) {
+    VectorStats total = {0, 0, 0};
+    for (uint32_t i = 0; i < no_cpus; i++) {
+      VectorStats stats = cpus[i].vectors[no]; // Racy, only for display
+      total.count += stats.count;
+      total.unhandled += stats.unhandled;
+      total.cycles += stats.cycles;
+    }
+    if (total.count == 0) {
+      continue;
+    }
+    print("vector ");
+    print_int(no);
+    print(": ");
+    print_int(total.count);
+    print(" times, ");
+    print_int(total.unhandled);
+    print(" unhandled, ");
+    print_int(tsc_to_ns(total.cycles) / 1000);
+    print(" us\n");
+  }
+}
@@ -0,0 +1,494 @@
+/*
+
+virtio-blk
+
+A driver for the paravirtual disk QEMU provides with -drive if=virtio,
+through the legacy (virtio 0.9.5) interface of its PCI function: a block of
+I/O ports in BAR 0, and one split virtqueue in guest memory.
+
+- The virtqueue has three rings in physically contiguous pages: descriptors
+  (buffers, chained per request), the available ring (heads of chains the
+  driver queued) and the used ring (heads the device completed). A request is
+  a chain of a header (type and sector), the data, one descriptor per
+  physically contiguous piece, and a status byte the device writes.
+- Many requests may be outstanding, up to what the descriptors hold.
+  virtio_blk_submit() queues a whole batch and publishes it with a single
+  write of the available index, then notifies the device once. The device
+  can say it does not need to be notified (it is still working through the
+  ring), which saves the port write, a VM exit.
+- The interrupt handler reaps every completed request, then asks for an
+  interrupt only at the next completion: with VIRTIO_RING_F_EVENT_IDX, by
+  publishing the used index it has seen, and it checks the ring again in
+  case a completion came meanwhile. Requests that complete while earlier ones
+  are reaped take no interrupt of their own.
+- Threads sleep in virtio_blk_wait() until their request completes, and in
+  virtio_blk_submit() while the ring is full. The wait queue's lock protects
+  the whole virtqueue.
+
+*/
+
+#include "include/virtio_blk.h"
+#include "include/acpi.h"
+#include "include/io.h"
+#include "include/irq.h"
+#include "include/memory.h"
+#include "include/pci.h"
+#include "include/pmm.h"
+#include "include/screen.h"
+#include "include/sync.h"
+#include "include/timer.h"
+#include "include/vmm.h"
+#include <stddef.h>
+
+#define PAGE_SIZE 4096
+#define PAGE_ALIGN(x) (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+#define VIRTIO_VENDOR 0x1AF4
+#define VIRTIO_BLK_LEGACY 0x1001 // Transitional device, with the legacy ports
+
+/* Legacy registers, from the I/O base in BAR 0 */
+#define REG_DEVICE_FEATURES 0x00
+#define REG_DRIVER_FEATURES 0x04
+#define REG_QUEUE_PFN 0x08 // Physical page of the selected queue
+#define REG_QUEUE_SIZE 0x0C
+#define REG_QUEUE_SELECT 0x0E
+#define REG_QUEUE_NOTIFY 0x10
+#define REG_STATUS 0x12
+#define REG_ISR 0x13      // Reading it acknowledges the interrupt
+#define REG_CAPACITY 0x14 // Disk size in sectors, 64-bit (no MSI-X)
+
+#define STATUS_ACKNOWLEDGE 0x01
+#define STATUS_DRIVER 0x02
+#define STATUS_DRIVER_OK 0x04
+#define STATUS_FAILED 0x80
+
+#define F_RING_EVENT_IDX (1 << 29)
+#define ISR_QUEUE 0x01
+
+#define DESC_F_NEXT 0x1
+#define DESC_F_WRITE 0x2 // The device writes the buffer
+#define USED_F_NO_NOTIFY 0x1
+
+#define BLK_T_IN 0
+#define BLK_T_OUT 1
+#define BLK_S_OK 0
+
+#define MAX_QUEUE_SIZE 1024
+#define BATCH 8 // Requests transfer() queues at once
+
+typedef struct {
+  uint64_t pa;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+} VirtqDesc;
+
+typedef struct {
+  uint16_t flags;
+  uint16_t idx;
+  uint16_t ring[]; // Then used_event, with VIRTIO_RING_F_EVENT_IDX
+} VirtqAvail;
+
+typedef struct {
+  uint32_t id; // Head of the completed chain
+  uint32_t len;
+} VirtqUsedElem;
+
+typedef struct {
+  uint16_t flags;
+  uint16_t idx;
+  VirtqUsedElem ring[]; // Then avail_event, with VIRTIO_RING_F_EVENT_IDX
+} VirtqUsed;
+
+/* What the device reads and writes for a request, per head descriptor */
+typedef struct {
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t sector;
+  uint8_t status;
+  uint8_t pad[7];
+} BlkSlot;
+
+static struct {
+  uint16_t io; // 0 without a device
+  uint16_t size;
+  int event_idx;
+  uint64_t capacity;
+  VirtqDesc *desc;
+  VirtqAvail *avail;
+  VirtqUsed *used;
+  BlkSlot *slots;
+  uintptr_t slots_pa;
+  VirtioBlkReq **reqs; // Request of each head descriptor
+  uint16_t free_head;  // Free descriptors, chained through next
+  uint16_t no_free;
+  uint16_t avail_idx;  // Next entry of the available ring
+  uint16_t kicked_idx; // Available index the device was last told about
+  uint16_t last_used;  // Next entry of the used ring to reap
+  uint32_t in_flight;
+  WaitQueue wq; // Its lock protects all of the above once set up
+  VirtioBlkStats stats;
+} blk;
+
+/*
+
+Virtqueue
+
+*/
+
+static volatile uint16_t *used_event() {
+  return &blk.avail->ring[blk.size];
+}
+
+static volatile uint16_t *avail_event() {
+  return (volatile uint16_t *)&blk.used->ring[blk.size];
+}
+
+static uint16_t alloc_desc() {
+  uint16_t d = blk.free_head;
+  blk.free_head = blk.desc[d].next;
+  blk.no_free--;
+  return d;
+}
+
+/* Put the chain starting at head back on the free list */
+static void free_chain(uint16_t head) {
+  uint16_t d = head;
+  uint16_t no = 1;
+  while (blk.desc[d].flags & DESC_F_NEXT) {
+    d = blk.desc[d].next;
+    no++;
+  }
+  blk.desc[d].next = blk.free_head;
+  blk.free_head = head;
+  blk.no_free += no;
+}
+
+/* Descriptors req needs: header, data pieces and status */
+static uint32_t descs_needed(VirtioBlkReq *req) {
+  uintptr_t va = (uintptr_t)req->buf;
+  uint32_t no_bytes = req->count * VIRTIO_BLK_SECTOR_SIZE;
+  return 2 + (va % PAGE_SIZE + no_bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+/* Whether every page of req's buffer is mapped */
+static int buf_mapped(VirtioBlkReq *req) {
+  uintptr_t va = (uintptr_t)req->buf;
+  uintptr_t end = va + req->count * VIRTIO_BLK_SECTOR_SIZE;
+  for (uintptr_t page = va & ~(PAGE_SIZE - 1); page < end; page += PAGE_SIZE) {
+    if (va_to_pa(page) == 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Chain req's descriptors and queue the head, unpublished. Its buffer must be
+mapped, see buf_mapped(). */
+static void add_request(VirtioBlkReq *req) {
+  uint16_t head = alloc_desc();
+  BlkSlot *slot = &blk.slots[head];
+  slot->type = req->write ? BLK_T_OUT : BLK_T_IN;
+  slot->reserved = 0;
+  slot->sector = req->sector;
+  slot->status = 0xFF;
+  uintptr_t slot_pa = blk.slots_pa + head * sizeof(BlkSlot);
+  blk.desc[head] = (VirtqDesc){slot_pa, 16, DESC_F_NEXT, 0};
+
+  uint16_t prev = head;
+  uintptr_t va = (uintptr_t)req->buf;
+  uint32_t left = req->count * VIRTIO_BLK_SECTOR_SIZE;
+  uint16_t data_flags = DESC_F_NEXT | (req->write ? 0 : DESC_F_WRITE);
+  while (left > 0) {
+    uint32_t no_bytes = PAGE_SIZE - va % PAGE_SIZE;
+    if (no_bytes > left) {
+      no_bytes = left;
+    }
+    uintptr_t pa = va_to_pa(va);
+    VirtqDesc *last = &blk.desc[prev];
+    if (prev != head && last->pa + last->len == pa) {
+      last->len += no_bytes; // Physically contiguous with the previous piece
+    } else {
+      uint16_t d = alloc_desc();
+      blk.desc[d] = (VirtqDesc){pa, no_bytes, data_flags, 0};
+      blk.desc[prev].next = d;
+      prev = d;
+    }
+    va += no_bytes;
+    left -= no_bytes;
+  }
+
+  uint16_t status = alloc_desc();
+  blk.desc[status] =
+      (VirtqDesc){slot_pa + offsetof(BlkSlot, status), 1, DESC_F_WRITE, 0};
+  blk.desc[prev].next = status;
+
+  req->status = VIRTIO_BLK_PENDING;
+  req->submitted = clock_monotonic();
+  blk.reqs[head] = req;
+  blk.avail->ring[blk.avail_idx % blk.size] = head;
+  blk.avail_idx++;
+  blk.in_flight++;
+  if (blk.in_flight > blk.stats.max_in_flight) {
+    blk.stats.max_in_flight = blk.in_flight;
+  }
+  blk.stats.requests++;
+  blk.stats.sectors += req->count;
+}
+
+/*
+Publish the requests queued since the last kick, and notify the device
+unless it said it does not need to be
+*/
+static void kick() {
+  uint16_t old = blk.kicked_idx;
+  uint16_t new = blk.avail_idx;
+  if (old == new) {
+    return;
+  }
+  // The chains and ring entries before the index, the index before the check
+  __atomic_store_n(&blk.avail->idx, new, __ATOMIC_RELEASE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  blk.kicked_idx = new;
+  int notify;
+  if (blk.event_idx) { // Whether the index it asked about is among the new ones
+    notify = (uint16_t)(new - *avail_event() - 1) < (uint16_t)(new - old);
+  } else {
+    notify = !(blk.used->flags & USED_F_NO_NOTIFY);
+  }
+  if (notify) {
+    port_word_out(blk.io + REG_QUEUE_NOTIFY, 0);
+    blk.stats.notifies++;
+  } else {
+    blk.stats.suppressed++;
+  }
+}
+
+/* Complete the requests the device is done with */
+static void reap() {
+  do {
+    while (blk.last_used != __atomic_load_n(&blk.used->idx, __ATOMIC_ACQUIRE)) {
+      uint16_t head = blk.used->ring[blk.last_used % blk.size].id;
+      VirtioBlkReq *req = blk.reqs[head];
+      int ok = blk.slots[head].status == BLK_S_OK;
+      free_chain(head);
+      blk.last_used++;
+      blk.in_flight--;
+      uint64_t ns = clock_monotonic() - req->submitted;
+      blk.stats.total_ns += ns;
+      if (ns > blk.stats.max_ns) {
+        blk.stats.max_ns = ns;
+      }
+      if (!ok) {
+        blk.stats.errors++;
+      }
+      req->status = ok ? 0 : -1;
+    }
+    if (!blk.event_idx) {
+      return;
+    }
+    // Only interrupt for the next completion, which may have come already
+    *used_event() = blk.last_used;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  } while (blk.last_used != __atomic_load_n(&blk.used->idx, __ATOMIC_ACQUIRE));
+}
+
+static int virtio_blk_handler(CpuContext *context) {
+  if (!(port_byte_in(blk.io + REG_ISR) & ISR_QUEUE)) {
+    return 0; // Another device on the line, or a configuration change
+  }
+  uint32_t flags = spin_lock_irqsave(&blk.wq.lock);
+  blk.stats.interrupts++;
+  reap();
+  while (wait_queue_wake_one_locked(&blk.wq)) {
+  }
+  spin_unlock_irqrestore(&blk.wq.lock, flags);
+  return 1;
+}
+
+/*
+
+Requests
+
+*/
+
+/*
+Queue count requests and tell the device about them at once. Sleeps while the
+ring is full. Return -1, queueing none of them, if one is out of range or
+there is no disk; a request whose buffer is not mapped fails on its own.
+*/
+int virtio_blk_submit(VirtioBlkReq *reqs, uint32_t count) {
+  if (blk.io == 0) {
+    return -1;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    if (reqs[i].count == 0 || reqs[i].count > VIRTIO_BLK_MAX_SECTORS ||
+        reqs[i].sector + reqs[i].count > blk.capacity) {
+      return -1;
+    }
+  }
+  uint32_t flags = spin_lock_irqsave(&blk.wq.lock);
+  for (uint32_t i = 0; i < count; i++) {
+    if (!buf_mapped(&reqs[i])) {
+      reqs[i].status = -1;
+      continue;
+    }
+    while (blk.no_free < descs_needed(&reqs[i])) {
+      kick(); // Let the device work through what is queued meanwhile
+      wait_queue_sleep_locked(&blk.wq, flags);
+      flags = spin_lock_irqsave(&blk.wq.lock);
+    }
+    add_request(&reqs[i]);
+  }
+  kick();
+  spin_unlock_irqrestore(&blk.wq.lock, flags);
+  return 0;
+}
+
+/* Sleep until req completed. Return its status. */
+int virtio_blk_wait(VirtioBlkReq *req) {
+  uint32_t flags = spin_lock_irqsave(&blk.wq.lock);
+  while (req->status == VIRTIO_BLK_PENDING) {
+    wait_queue_sleep_locked(&blk.wq, flags);
+    flags = spin_lock_irqsave(&blk.wq.lock);
+  }
+  spin_unlock_irqrestore(&blk.wq.lock, flags);
+  return req->status;
+}
+
+/* Transfer count sectors at sector, BATCH requests at a time */
+static int transfer(uint64_t sector, uint32_t count, uint8_t *buf,
+                    int write) {
+  VirtioBlkReq reqs[BATCH];
+  int err = 0;
+  while (count > 0 && err == 0) {
+    uint32_t no_reqs = 0;
+    for (; no_reqs < BATCH && count > 0; no_reqs++) {
+      uint32_t n = count;
+      if (n > VIRTIO_BLK_MAX_SECTORS) {
+        n = VIRTIO_BLK_MAX_SECTORS;
+      }
+      reqs[no_reqs] = (VirtioBlkReq){sector, n, buf, write, 0, 0};
+      sector += n;
+      count -= n;
+      buf += n * VIRTIO_BLK_SECTOR_SIZE;
+    }
+    if (virtio_blk_submit(reqs, no_reqs) < 0) {
+      return -1;
+    }
+    for (uint32_t i = 0; i < no_reqs; i++) {
+      err |= virtio_blk_wait(&reqs[i]);
+    }
+  }
+  return err;
+}
+
+/* Read count sectors, starting at sector, into buf. Return -1 on an error. */
+int virtio_blk_read(uint64_t sector, uint32_t count, void *buf) {
+  return transfer(sector, count, buf, 0);
+}
+
+/* Write count sectors from buf, starting at sector. Return -1 on an error. */
+int virtio_blk_write(uint64_t sector, uint32_t count, const void *buf) {
+  return transfer(sector, count, (uint8_t *)buf, 1);
+}
+
+/* Size of the disk in sectors, 0 if there is none */
+uint64_t virtio_blk_sectors() { return blk.io != 0 ? blk.capacity : 0; }
+
+/*
+
+Setup
+
+*/
+
+/*
+Find the virtio-blk function on the PCI bus and set up its queue. Needs
+pci_init() and the heap. Interrupts must be disabled. Return 1 if there is a
+disk.
+*/
+uint32_t virtio_blk_init() {
+  PciDevice pci;
+  if (!pci_find_device(VIRTIO_VENDOR, VIRTIO_BLK_LEGACY, &pci) ||
+      !(pci_read(&pci, PCI_BAR0) & PCI_BAR_IO) || pci.irq >= NO_ISA_IRQS) {
+    return 0;
+  }
+  uint16_t io = pci_bar(&pci, 0);
+  pci_enable(&pci, PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+  port_byte_out(io + REG_STATUS, 0); // Reset
+  port_byte_out(io + REG_STATUS, STATUS_ACKNOWLEDGE);
+  port_byte_out(io + REG_STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+  uint32_t features = port_long_in(io + REG_DEVICE_FEATURES);
+  port_long_out(io + REG_DRIVER_FEATURES, features & F_RING_EVENT_IDX);
+
+  port_word_out(io + REG_QUEUE_SELECT, 0);
+  uint16_t size = port_word_in(io + REG_QUEUE_SIZE);
+  // Rings and their event indexes, the used ring on its own page
+  uint32_t avail_bytes = sizeof(VirtqAvail) + (size + 1) * 2;
+  uint32_t used_bytes = sizeof(VirtqUsed) + size * sizeof(VirtqUsedElem) + 2;
+  uint32_t used_offset = PAGE_ALIGN(size * sizeof(VirtqDesc) + avail_bytes);
+  uint32_t slots_offset = used_offset + PAGE_ALIGN(used_bytes);
+  uint32_t no_bytes = slots_offset + size * sizeof(BlkSlot);
+  uintptr_t pa = size != 0 && size <= MAX_QUEUE_SIZE
+                     ? alloc_frames(PAGE_ALIGN(no_bytes) / PAGE_SIZE)
+                     : 0;
+  uintptr_t va = pa != 0 ? map_dma(pa, no_bytes) : 0;
+  blk.reqs = (VirtioBlkReq **)kmalloc(size * sizeof(VirtioBlkReq *));
+  if (va == 0 || blk.reqs == NULL ||
+      irq_install_handler(pci.irq, virtio_blk_handler) < 0) {
+    port_byte_out(io + REG_STATUS, STATUS_FAILED);
+    return 0;
+  }
+  mem_set((uint8_t *)va, 0, no_bytes); // The frames may hold stale data
+
+  blk.size = size;
+  blk.event_idx = (features & F_RING_EVENT_IDX) != 0;
+  blk.capacity = port_long_in(io + REG_CAPACITY) |
+                 (uint64_t)port_long_in(io + REG_CAPACITY + 4) << 32;
+  blk.desc = (VirtqDesc *)va;
+  blk.avail = (VirtqAvail *)(va + size * sizeof(VirtqDesc));
+  blk.used = (VirtqUsed *)(va + used_offset);
+  blk.slots = (BlkSlot *)(va + slots_offset);
+  blk.slots_pa = pa + slots_offset;
+  for (uint16_t i = 0; i < size; i++) {
+    blk.desc[i].next = i + 1;
+  }
+  blk.free_head = 0;
+  blk.no_free = size;
+  wait_queue_init(&blk.wq);
+  port_long_out(io + REG_QUEUE_PFN, pa / PAGE_SIZE);
+  port_byte_out(io + REG_STATUS,
+                STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_DRIVER_OK);
+  blk.io = io;
+
+  print("virtio-blk: ");
+  print_int(blk.capacity / 2);
+  print(" KiB, ");
+  print_int(size);
+  print(" descriptors\n");
+  return 1;
+}
+
+/* Print what the disk did since boot */
+void print_virtio_blk_stats() {
+  VirtioBlkStats stats = blk.stats; // Racy, only for display
+  print("virtio-blk: ");
+  print_int(stats.requests);
+  print(" requests, ");
+  print_int(stats.sectors / 2);
+  print(" KiB, ");
+  print_int(stats.errors);
+  print(" errors, ");
+  print_int(stats.notifies);
+  print(" notifies (");
+  print_int(stats.suppressed);
+  print(" not needed), ");
+  print_int(stats.interrupts);
+  print(" interrupts, up to ");
+  print_int(stats.max_in_flight);
+  print(" in flight, avg ");
+  print_int(stats.requests != 0 ? stats.total_ns / stats.requests / 1000 : 0);
+  print(" us, max ");
+  print_int(stats.max_ns / 1000);
+  print(" us\n");
+}
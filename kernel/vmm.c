@@ -25,7 +25,10 @@ Heap
 #include "include/isr.h"
 #include "include/memory.h"
 #include "include/pmm.h"
+#include "include/process.h"
 #include "include/screen.h"
+#include "include/spinlock.h"
+#include "include/vdso.h"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -39,6 +42,9 @@ typedef enum {
   PT_PRESENT = (1 << 0),
   PT_WRITE = (1 << 1),
   PT_USER = (1 << 2),
+  PT_WRITE_THROUGH = (1 << 3),
+  PT_CACHE_DISABLE = (1 << 4),
+  PT_SHARED = (1 << 9), // Available to the OS: frame not owned by the PD
 } PtFlag;
 
 typedef enum {
@@ -50,9 +56,14 @@ typedef enum {
 
 #define K_CODE_START 0xC0000000
 #define K_CODE_END 0xD0000000
+#define K_CODE_PT_PA 0x7F000 // Maps the kernel image, set up by the boot sector
 
 #define K_HEAP_START 0xD0000000
 #define K_HEAP_END 0xE0000000
+#define K_HEAP_PT_BYTES 0x1000000 // More than the PMM has frames for
+
+#define K_MMIO_START 0xE0000000
+#define K_MMIO_END 0xF0000000
 
 #define K_PAGE_START 0xF0000000
 #define K_PAGE_END 0xFFBFFFFF
@@ -70,6 +81,12 @@ x86 virtual address format:
 - bits 0-11: offset within the page
 */
 
+static uint32_t read_cr3() {
+  uint32_t cr3;
+  __asm__ __volatile__("mov %%cr3, %0" : "=r"(cr3));
+  return cr3;
+}
+
 void load_pd(uintptr_t pd_pa) {
   __asm__ __volatile__("mov %0, %%cr3" : : "r"(pd_pa) : "memory");
 }
@@ -151,10 +168,15 @@ static void create_pde(uintptr_t va) {
   uint32_t pde_i = va_to_pde_i(va);
   (((Pd *)((uintptr_t)PD_RECURSIVE_I << VA_PDI_START | PD_RECURSIVE_I
                                                            << VA_PTI_START)))
-      ->pts[pde_i] = (Pt *)((uintptr_t)alloc_frame() | PT_PRESENT | PT_WRITE);
+      ->pts[pde_i] = (Pt *)((uintptr_t)alloc_frame() | PT_PRESENT | PT_WRITE |
+                            (va < K_CODE_START ? PT_USER : 0));
+  /* The frame may hold stale data, clear it through the recursive mapping */
+  mem_set((uint8_t *)((uintptr_t)PD_RECURSIVE_I << VA_PDI_START |
+                      pde_i << VA_PTI_START),
+          0x0, PAGE_SIZE);
 }
 
-static void create_pte(uintptr_t va, uintptr_t frame) {
+static void create_pte_flags(uintptr_t va, uintptr_t frame, uint32_t flags) {
   if (!is_pte_empty(va)) {
     return;
   }
@@ -164,30 +186,212 @@ static void create_pte(uintptr_t va, uintptr_t frame) {
     create_pde(va);
   }
   (((Pt *)((uintptr_t)PD_RECURSIVE_I << VA_PDI_START | pde_i << VA_PTI_START)))
-      ->frames[pte_i] = (uintptr_t)(frame | PT_PRESENT | PT_WRITE);
+      ->frames[pte_i] = (uintptr_t)(frame | PT_PRESENT | flags);
+}
+
+static void create_pte(uintptr_t va, uintptr_t frame) {
+  create_pte_flags(va, frame, PT_WRITE);
+}
+
+/* Unmap a page of the loaded PD (the frame is not freed) */
+static void remove_pte(uintptr_t va) {
+  if (is_pte_empty(va)) {
+    return;
+  }
+  ((Pt *)((uintptr_t)PD_RECURSIVE_I << VA_PDI_START |
+          va_to_pde_i(va) << VA_PTI_START))
+      ->frames[va_to_pte_i(va)] = 0;
+  __asm__ __volatile__("invlpg (%0)" : : "r"(va) : "memory");
+}
+
+/*
+Physical address va is mapped to in the loaded PD, 0 if it is not mapped. The
+kernel's mappings are the same in every PD, so that is where devices reach a
+kernel buffer (e.g. for DMA).
+*/
+uintptr_t va_to_pa(uintptr_t va) {
+  if (is_pte_empty(va)) {
+    return 0;
+  }
+  uintptr_t frame = ((Pt *)((uintptr_t)PD_RECURSIVE_I << VA_PDI_START |
+                            va_to_pde_i(va) << VA_PTI_START))
+                        ->frames[va_to_pte_i(va)];
+  return (frame & ~(PAGE_SIZE - 1)) | (va & (PAGE_SIZE - 1));
+}
+
+/*
+Map frame at va in the given PD, which need not be the loaded one: the PD is
+loaded meanwhile, with preemption disabled so the thread keeps the CPU and the
+CPU keeps the PD. IRQ handlers only touch kernel memory, which every PD maps,
+so they may still run. The page is zeroed if zero is set.
+*/
+static void map_page_in(ProcessPd *process_pd, uintptr_t va, uintptr_t frame,
+                        uint32_t flags, int zero) {
+  preempt_disable();
+  uint32_t cr3 = read_cr3();
+  load_pd(process_pd->pd_pa);
+  create_pte_flags(va, frame, flags);
+  if (zero) {
+    mem_set((uint8_t *)va, 0x0, PAGE_SIZE);
+  }
+  load_pd(cr3);
+  preempt_enable();
+}
+
+/*
+Free the frames mapped by one user page table of process_pd, except shared
+ones (the vDSO page, pages of program images). Like map_page_in(), the PD is
+loaded meanwhile.
+*/
+static void free_user_pt(ProcessPd *process_pd, uint32_t pde_i) {
+  preempt_disable();
+  uint32_t cr3 = read_cr3();
+  load_pd(process_pd->pd_pa);
+  Pt *pt = (Pt *)((uintptr_t)PD_RECURSIVE_I << VA_PDI_START |
+                  pde_i << VA_PTI_START);
+  for (int i = 0; i < NO_PTE; i++) {
+    uintptr_t frame = pt->frames[i] & ~(PAGE_SIZE - 1);
+    if ((pt->frames[i] & PT_PRESENT) && !(pt->frames[i] & PT_SHARED)) {
+      free_frame(frame);
+    }
+  }
+  load_pd(cr3);
+  preempt_enable();
+}
+
+/* Map a zeroed, user writable frame at a user VA in the given PD */
+void map_user_page(ProcessPd *process_pd, uintptr_t va, uintptr_t frame) {
+  map_page_in(process_pd, va, frame, PT_WRITE | PT_USER, 1);
+}
+
+/* Undo map_user_page(): unmap va in the given PD and free its frame */
+void unmap_user_page(ProcessPd *process_pd, uintptr_t va) {
+  preempt_disable();
+  uint32_t cr3 = read_cr3();
+  load_pd(process_pd->pd_pa);
+  uintptr_t frame = va_to_pa(va) & ~(PAGE_SIZE - 1);
+  remove_pte(va);
+  load_pd(cr3);
+  preempt_enable();
+  if (frame != 0) {
+    free_frame(frame);
+  }
+}
+
+/*
+Map frame at a user VA of the loaded PD, read-only unless UP_WRITE is set.
+With UP_FILL, the page is filled with no_bytes of src followed by zeros; it is
+writable while that happens. A frame mapped UP_SHARED is not freed along with
+the PD. Nothing is done if the VA is mapped already.
+*/
+void map_user_page_here(uintptr_t va, uintptr_t frame, uint32_t flags,
+                        const uint8_t *src, uint32_t no_bytes) {
+  if (!is_pte_empty(va)) {
+    return;
+  }
+  uint32_t pte_flags = PT_USER | (flags & UP_WRITE ? PT_WRITE : 0) |
+                       (flags & UP_SHARED ? PT_SHARED : 0);
+  if (!(flags & UP_FILL)) {
+    create_pte_flags(va, frame, pte_flags);
+    return;
+  }
+  create_pte_flags(va, frame, pte_flags | PT_WRITE);
+  mem_cpy((uint8_t *)src, (uint8_t *)va, no_bytes);
+  mem_set((uint8_t *)va + no_bytes, 0x0, PAGE_SIZE - no_bytes);
+  ((Pt *)((uintptr_t)PD_RECURSIVE_I << VA_PDI_START |
+          va_to_pde_i(va) << VA_PTI_START))
+      ->frames[va_to_pte_i(va)] = frame | PT_PRESENT | pte_flags;
+  __asm__ __volatile__("invlpg (%0)" : : "r"(va) : "memory");
+}
+
+/*
+Return 1 if [va, va + no_bytes) is mapped and user accessible in the loaded PD,
+i.e. whether the kernel may touch it on behalf of user mode. That includes the
+few user pages in the kernel half (.utext and the vDSO).
+*/
+int is_user_range(uintptr_t va, uint32_t no_bytes) {
+  if (va + no_bytes < va) {
+    return 0;
+  }
+  for (uintptr_t page = va & ~(PAGE_SIZE - 1); page < va + no_bytes;
+       page += PAGE_SIZE) {
+    if (is_pte_empty(page)) {
+      return 0;
+    }
+    uintptr_t pte = ((Pt *)((uintptr_t)PD_RECURSIVE_I << VA_PDI_START |
+                            va_to_pde_i(page) << VA_PTI_START))
+                        ->frames[va_to_pte_i(page)];
+    if (!(pte & PT_USER)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static uintptr_t k_mmio_next = K_MMIO_START;
+
+/* Map a physical range into the kernel's MMIO window, see map_mmio() */
+static uintptr_t map_window(uintptr_t pa, uint32_t no_bytes, uint32_t flags) {
+  uint32_t offset = pa & (PAGE_SIZE - 1);
+  uint32_t no_pages = (offset + no_bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+  if (k_mmio_next + no_pages * PAGE_SIZE > K_MMIO_END) {
+    return 0;
+  }
+
+  uintptr_t va = k_mmio_next;
+  for (uint32_t i = 0; i < no_pages; i++) {
+    create_pte_flags(va + i * PAGE_SIZE, pa - offset + i * PAGE_SIZE, flags);
+  }
+  k_mmio_next += no_pages * PAGE_SIZE;
+  return va + offset;
+}
+
+/*
+Map a physical range that is not managed by the PMM (device registers,
+firmware tables) into the kernel's MMIO window, uncached. Mappings are never
+removed, so this is meant for setup during boot, before processes exist (their
+PDs copy the kernel PDEs when created). Return the VA of pa, or 0 if the
+window is full.
+*/
+uintptr_t map_mmio(uintptr_t pa, uint32_t no_bytes) {
+  return map_window(pa, no_bytes,
+                    PT_WRITE | PT_WRITE_THROUGH | PT_CACHE_DISABLE);
+}
+
+/*
+Like map_mmio(), for frames from the PMM that a device reads and writes by
+physical address (e.g. the rings of a virtqueue). They stay cached, as x86
+keeps the caches coherent with DMA.
+*/
+uintptr_t map_dma(uintptr_t pa, uint32_t no_bytes) {
+  return map_window(pa, no_bytes, PT_WRITE);
 }
 
 uintptr_t kmalloc(uint32_t no_bytes);
 
 /* The kernel PD wil be the head */
 ProcessPd *process_pds = NULL;
+static Spinlock process_pds_lock;
 
 /*
 Create an empty page directory for another process.
 Returns a pointer to a struct representing a processes PD.
 */
 ProcessPd *create_process_pd() {
+  ProcessPd *process_pd = (ProcessPd *)kmalloc(sizeof(ProcessPd));
+  uint32_t flags = spin_lock_irqsave(&process_pds_lock);
   ProcessPd *curr = process_pds;
   while (curr->next != NULL) {
     curr = curr->next;
   }
-
-  ProcessPd *process_pd = (ProcessPd *)kmalloc(sizeof(ProcessPd));
   process_pd->pd_va =
       curr == process_pds ? (Pd *)K_PAGE_START : curr->pd_va + 1;
   process_pd->pd_pa = alloc_frame();
   process_pd->next = NULL;
+  process_pd->prev = curr;
+  process_pd->dying = 0;
   curr->next = process_pd;
+  spin_unlock_irqrestore(&process_pds_lock, flags);
   create_pte((uintptr_t)process_pd->pd_va, process_pd->pd_pa);
 
   /* Initialize PD */
@@ -199,11 +403,12 @@ ProcessPd *create_process_pd() {
   process_pd->pd_va->pts[PD_RECURSIVE_I] =
       (Pt *)(process_pd->pd_pa | PT_WRITE | PT_PRESENT);
 
-  /* Map Kernel */
+  /* Map Kernel (user accessible, so .utext can be, see vm_init()) */
   int kernel_pde = va_to_pde_i(K_CODE_START);
-  process_pd->pd_va->pts[kernel_pde] = (Pt *)(0x7F000 | PT_PRESENT);
+  process_pd->pd_va->pts[kernel_pde] =
+      (Pt *)(K_CODE_PT_PA | PT_PRESENT | PT_WRITE | PT_USER);
 
-  for (int i = kernel_pde; i < 1023; i++) {
+  for (int i = kernel_pde + 1; i < 1023; i++) {
     if (process_pd->pd_va->pts[i] != process_pds->pd_va->pts[i]) {
       process_pd->pd_va->pts[i] =
           (Pt *)(((uintptr_t)process_pds->pd_va->pts[i] & NO_FLAG_MASK) |
@@ -211,51 +416,50 @@ ProcessPd *create_process_pd() {
     }
   }
 
+  /* Kernel data user mode may read, see vdso.c */
+  map_page_in(process_pd, VDSO_VA, vdso_frame(), PT_USER | PT_SHARED, 0);
+
   return process_pd;
 }
 
+/*
+Free a PD that no CPU has loaded, with every user page and user page table in
+it. The kernel's page tables are shared by all PDs and stay. Preemption is
+only disabled while one page table is walked at a time.
+*/
 void delete_process_pd(ProcessPd *process_pd) {
   if (process_pd == process_pds) {
     return;
   }
 
   int kernel_pde = va_to_pde_i(K_CODE_START);
-
-  for (int i = kernel_pde; i < 1023; i++) {
-    free_frame((uintptr_t)process_pds->pd_va->pts[i]);
-    process_pd->pd_va->pts[i] = NULL;
-  }
-  free_frame((uintptr_t)process_pd->pd_va->pts[kernel_pde]);
-  process_pd->pd_va->pts[kernel_pde] = NULL;
-
-  for (int i = 0; i < NO_PDE; i++) {
-    free_frame((uintptr_t)process_pd->pd_va->pts[i]);
-    process_pd->pd_va->pts[i] = NULL;
+  for (int i = 0; i < kernel_pde; i++) {
+    uintptr_t pde = (uintptr_t)process_pd->pd_va->pts[i];
+    if (pde & PT_PRESENT) {
+      free_user_pt(process_pd, i);
+      free_frame(pde & ~(PAGE_SIZE - 1));
+    }
   }
 
-  free_frame((uintptr_t)process_pd->pd_va->pts[PD_RECURSIVE_I]);
-  process_pd->pd_va->pts[PD_RECURSIVE_I] = NULL;
-
-  ProcessPd *curr = process_pds;
-  while (curr->next != process_pd) {
-    curr = curr->next;
+  uint32_t flags = spin_lock_irqsave(&process_pds_lock);
+  process_pd->prev->next = process_pd->next;
+  if (process_pd->next != NULL) {
+    process_pd->next->prev = process_pd->prev;
   }
-  curr->next = process_pd->next;
+  spin_unlock_irqrestore(&process_pds_lock, flags);
 
+  /* The VA may be handed out again, it must not keep pointing at the frame */
+  remove_pte((uintptr_t)process_pd->pd_va);
   free_frame(process_pd->pd_pa);
-  process_pd->next = NULL;
-  process_pd->pd_pa = 0;
-  process_pd->pd_va = NULL;
   kfree(process_pd);
-  process_pd = NULL;
 }
 
 /*
 
 Page directory/page tables are initialized and paging is enabled in boot sector.
 
-- The higher-half kernel code is linked at VA 0xC0000500 and is mapped to PA
-0x500.
+- The higher-half kernel code is linked at VA 0xC0010000 and is mapped to PA
+0x10000.
 - To access page table frames, we need to map virtual addresses to them. We do
   this using a recursive mapping in the last entry of the page directory.
 - Created page directories will be stored at 0xF0000000.
@@ -273,17 +477,42 @@ void vm_init() {
   /* Install page fault handler */
   isr_install_handler(14, page_fault_handler);
 
+  /* Let user mode run the code and read the data linked into .utext, but not
+   * write it, as all processes share it. The CPU checks the PDE's U/S and R/W
+   * bits as well as the PTE's, so the kernel image's PDE allows everything and
+   * its PTEs decide: pages without PT_USER stay out of reach of user mode. */
+  (((Pd *)(PD_RECURSIVE_I << VA_PDI_START | PD_RECURSIVE_I << VA_PTI_START)))
+      ->pts[va_to_pde_i(K_CODE_START)] =
+      (Pt *)(K_CODE_PT_PA | PT_PRESENT | PT_WRITE | PT_USER);
+  extern uint8_t start_utext[], end_utext[];
+  for (uintptr_t va = (uintptr_t)start_utext; va < (uintptr_t)end_utext;
+       va += PAGE_SIZE) {
+    ((Pt *)((uintptr_t)PD_RECURSIVE_I << VA_PDI_START |
+            va_to_pde_i(va) << VA_PTI_START))
+        ->frames[va_to_pte_i(va)] |= PT_USER;
+  }
+
   /* Remove temp PDE created during boot */
   (((Pd *)(PD_RECURSIVE_I << VA_PDI_START | PD_RECURSIVE_I << VA_PTI_START)))
       ->pts[0] = 0x0;
   flush_tlb();
 
+  /* Create the page tables of the whole heap, and of the first PDs, up front.
+   * PDs only get the kernel PDEs that exist when they are created, and kernel
+   * threads run on whichever PD is loaded (see switch_pd() in process.c). */
+  for (uintptr_t va = K_HEAP_START; va < K_HEAP_START + K_HEAP_PT_BYTES;
+       va += NO_PTE * PAGE_SIZE) {
+    create_pde(va);
+  }
+  create_pde(K_PAGE_START);
+
   /* Record kernel PD */
   process_pds = (ProcessPd *)kmalloc(sizeof(ProcessPd));
   process_pds->pd_va = (Pd *)(K_CODE_START + 0x7E000);
   process_pds->pd_pa = (uintptr_t)0x7E000;
-  ;
   process_pds->next = NULL;
+  process_pds->prev = NULL;
+  process_pds->dying = 0;
 }
 
 /*
@@ -337,11 +566,12 @@ Kernel Space
 */
 
 VmRange *k_heap = NULL;
+static Spinlock k_heap_lock; // Any CPU may allocate, also from IRQ handlers
 
 /*
 Dynamically allocate aribtrarily-sized regions of memory
 */
-uintptr_t kmalloc(uint32_t no_bytes) {
+static uintptr_t heap_alloc(uint32_t no_bytes) {
   /* Heap initialization */
   if (k_heap == NULL) {
     k_heap = vmm_init(K_HEAP_START);
@@ -407,7 +637,7 @@ Mark a given heap node as free for use, and merge it with its neighbours if they
 are also free. No real physical memory is freed by this function, virtual memory
 ranges are essentially just marked for reuse. Return 1 if VA cannot be freed
 */
-int kfree(void *va) {
+static int heap_free(void *va) {
   VmNode *va_node = va - sizeof(VmNode);
 
   /* Ensure VA node is in heap range */
@@ -453,7 +683,21 @@ int kfree(void *va) {
   }
 
   return 0;
-};
+}
+
+uintptr_t kmalloc(uint32_t no_bytes) {
+  uint32_t flags = spin_lock_irqsave(&k_heap_lock);
+  uintptr_t va = heap_alloc(no_bytes);
+  spin_unlock_irqrestore(&k_heap_lock, flags);
+  return va;
+}
+
+int kfree(void *va) {
+  uint32_t flags = spin_lock_irqsave(&k_heap_lock);
+  int err = heap_free(va);
+  spin_unlock_irqrestore(&k_heap_lock, flags);
+  return err;
+}
 
 /*
 
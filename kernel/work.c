@@ -0,0 +1,169 @@
+/*
+
+Deferred work
+
+IRQ handlers should only do what cannot wait (reading a device register,
+acknowledging it) and leave the rest to a worker thread, which runs it with
+interrupts enabled:
+
+- Work items are allocated by whoever queues them, usually statically, so
+  queueing never allocates and can be done from IRQ handlers.
+- Queueing an item that is still pending does nothing. A handler that queues
+  the same item on every interrupt has its work batched: the item runs once
+  for everything that arrived before it started (e.g. kb.c keeps a buffer
+  of keys that its item drains).
+- There is a worker thread per priority, which takes its whole queue at once
+  and runs the items in the order they were queued. The WORK_HIGH worker is a
+  real-time thread (see sched_set_periodic()), so it preempts best-effort
+  threads as soon as it is woken, with a budget that keeps a flood of
+  interrupts from taking more than WORK_HIGH_BUDGET of every period.
+- Each queue counts its depth and the latency from queueing an item to
+  running it (print_work_stats()).
+
+*/
+
+#include "include/work.h"
+#include "include/process.h"
+#include "include/screen.h"
+#include "include/timer.h"
+#include <stddef.h>
+
+#define WORK_HIGH_PERIOD 10000000 // 10 ms
+#define WORK_HIGH_BUDGET 1000000  // 1 ms
+
+typedef struct {
+  WaitQueue wq; // The worker sleeps here, wq.lock also protects the queue
+  Work *head;
+  Work *tail;
+  uint32_t depth; // Items pending
+  Thread *worker;
+
+  /* Statistics, updated by the worker (max_depth under wq.lock) */
+  uint32_t max_depth;
+  uint32_t items;   // Items run
+  uint32_t batches; // Times the worker took its queue
+  uint64_t latency_ns;
+  uint64_t max_latency_ns;
+} WorkQueue;
+
+static WorkQueue queues[NO_WORK_PRIOS];
+
+void work_init_item(Work *work, void (*fn)(uintptr_t), uintptr_t arg) {
+  work->fn = fn;
+  work->arg = arg;
+  work->pending = 0;
+  work->queued_at = 0;
+  work->next = NULL;
+}
+
+/*
+Have the worker of prio call work->fn(work->arg). Return 0 if work was still
+pending, in which case it only runs once. Safe to call from IRQ handlers.
+*/
+int work_queue(WorkPrio prio, Work *work) {
+  WorkQueue *q = &queues[prio];
+  uint32_t flags = spin_lock_irqsave(&q->wq.lock);
+  int queued = !work->pending;
+  if (queued) {
+    work->pending = 1;
+    work->queued_at = clock_monotonic();
+    work->next = NULL;
+    if (q->tail == NULL) {
+      q->head = work;
+    } else {
+      q->tail->next = work;
+    }
+    q->tail = work;
+    if (++q->depth > q->max_depth) {
+      q->max_depth = q->depth;
+    }
+    wait_queue_wake_one_locked(&q->wq);
+  }
+  spin_unlock_irqrestore(&q->wq.lock, flags);
+  return queued;
+}
+
+/* Run one item of a batch taken from q. Its next link must be read already. */
+static void work_run(WorkQueue *q, Work *work) {
+  uint32_t flags = spin_lock_irqsave(&q->wq.lock);
+  work->pending = 0; // From here on it may be queued again
+  uint64_t latency = clock_monotonic() - work->queued_at;
+  void (*fn)(uintptr_t) = work->fn;
+  uintptr_t arg = work->arg;
+  spin_unlock_irqrestore(&q->wq.lock, flags);
+
+  q->items++;
+  q->latency_ns += latency;
+  if (latency > q->max_latency_ns) {
+    q->max_latency_ns = latency;
+  }
+  fn(arg);
+}
+
+static void worker_loop(uintptr_t prio) {
+  WorkQueue *q = &queues[prio];
+  if (prio == WORK_HIGH) {
+    sched_set_periodic(WORK_HIGH_PERIOD, WORK_HIGH_BUDGET); // Else best-effort
+  }
+  while (1) {
+    uint32_t flags = spin_lock_irqsave(&q->wq.lock);
+    while (q->head == NULL) {
+      wait_queue_sleep_locked(&q->wq, flags);
+      flags = spin_lock_irqsave(&q->wq.lock);
+    }
+    Work *batch = q->head;
+    q->head = NULL;
+    q->tail = NULL;
+    q->depth = 0;
+    q->batches++;
+    spin_unlock_irqrestore(&q->wq.lock, flags);
+
+    while (batch != NULL) {
+      Work *work = batch;
+      batch = batch->next;
+      work_run(q, work);
+    }
+  }
+}
+
+/* Start the worker threads. The scheduler must be initialized. */
+void work_init() {
+  for (int i = 0; i < NO_WORK_PRIOS; i++) {
+    WorkQueue *q = &queues[i];
+    wait_queue_init(&q->wq);
+    q->head = NULL;
+    q->tail = NULL;
+    q->depth = 0;
+    q->max_depth = 0;
+    q->items = 0;
+    q->batches = 0;
+    q->latency_ns = 0;
+    q->max_latency_ns = 0;
+  }
+  Process *kernel_process = thread_current()->process;
+  for (int i = 0; i < NO_WORK_PRIOS; i++) {
+    queues[i].worker = create_thread(kernel_process, worker_loop, i);
+  }
+}
+
+void print_work_stats() {
+  static const char *names[NO_WORK_PRIOS] = {"high", "low"};
+  for (int i = 0; i < NO_WORK_PRIOS; i++) {
+    WorkQueue *q = &queues[i];
+    print("work ");
+    print(names[i]);
+    print(": ");
+    print_int(q->items);
+    print(" items in ");
+    print_int(q->batches);
+    print(" batches, depth ");
+    print_int(q->depth);
+    print(" (max ");
+    print_int(q->max_depth);
+    print("), latency ");
+    print_int(q->items ? (uint32_t)(q->latency_ns / q->items) / 1000 : 0);
+    print(" us avg, ");
+    print_int((uint32_t)q->max_latency_ns / 1000);
+    print(" us max\n");
+  }
+}